@@ -1,74 +1,108 @@
 /* ctetris.c */
-#ifndef WIDTH
-#define WIDTH 10
-#endif
+#include "ctetris.h"
 
-#ifndef HEIGHT
-#define HEIGHT 20
+#ifndef ttm_assert
+#define ttm_assert(e)
 #endif
 
-#ifndef RANDOM_ROTATE
-#define RANDOM_ROTATE   0
+/* Seed of the piece sequence of a new game started by game_loop. */
+#ifndef ttm_rnd_seed
+#define ttm_rnd_seed()  (1)
 #endif
 
-#ifndef SHOW_NEXT
-#define SHOW_NEXT       1
+#ifndef ttm_sleep_ms
+#define ttm_sleep_ms(ms)
 #endif
 
-typedef enum UserCommandTag {
-    NOTHING,
-    ROTATE_CW,
-    ROTATE_CCW,
-    MOVE_LEFT,
-    MOVE_RIGHT,
-    SPEEDUP,
-    DROP,
-    QUIT
-} UserCommand;
-
-#ifndef ttm_assert
-#define ttm_assert(e)
+/*
+    A frontend that defines both of these gets the tickless loop, which
+    sleeps until the next input or gravity deadline instead of waking
+    up on every tick.
+        ttm_now_ms()            monotonic milliseconds, may wrap
+        ttm_wait_input_ms(gs, ms)
+                                blocks until input may be available or ms
+                                pass, nonzero if woken by input.
+                                ms is TTM_WAIT_FOREVER while no game runs
+*/
+#if defined(ttm_now_ms) && defined(ttm_wait_input_ms)
+#define TICKLESS
 #endif
 
-#ifndef ttm_rnd_init
-#define ttm_rnd_init()
+/*
+    A frontend renders with one of these, the first one if it defines
+    both:
+        ttm_render_rows_callback(gs, gameboard, width, height, low, high)
+                                rows [low, high) changed since the last
+                                call, only they are filled in gameboard
+        ttm_render_callback(gs, gameboard, width, height)
+                                every row is filled in
+    gameboard is unsigned char, a TTM_CELL_ value per cell, row 0 first.
+*/
+#if defined(ttm_render_rows_callback)
+#define RENDER_ROWS
+#elif !defined(ttm_render_callback)
+#define NO_RENDER
 #endif
 
-#ifndef ttm_rnd
-#define ttm_rnd()   (1)
+#ifndef ttm_read_command_callback
+UserCommand ttm_read_command_callback(GameState *gs);
 #endif
 
-#ifndef ttm_sleep_ms
-#define ttm_sleep_ms(ms)
+/*
+    Counters of TTM_STATS builds, see TtmStats. A frontend can give its
+    own cycle counter as ttm_cycles(), the time stamp counter is used
+    where there is one.
+*/
+#if TTM_STATS
+#ifndef ttm_cycles
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define ttm_cycles()    __rdtsc()
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ttm_cycles()    __rdtsc()
+#else
+#define ttm_cycles()    0ULL
+#endif
 #endif
 
-#ifndef ttm_render_callback
-#define ttm_render_callback(gameboard, width, height)
-#define NO_RENDER
+/*
+    Latency and pacing are in microseconds of ttm_now_us(), unsigned
+    and wrapping, which a frontend can give. Without it they come from
+    ttm_now_ms() and are not kept where there is neither.
+*/
+#if !defined(ttm_now_us) && defined(ttm_now_ms)
+#define ttm_now_us()    ((unsigned int)ttm_now_ms() * 1000U)
+#endif
+#ifdef ttm_now_us
+#define STATS_CLOCK
 #endif
 
-UserCommand ttm_read_command_callback();
+#define stats_add(gs, field, n) \
+    { if ((gs)->stats) (gs)->stats->field += (n); }
 
-#define swap_int(a, b)  { int t = (a); (a) = (b); (b) = t; }
+/* Runs statement stmt, timed by timer when the game has stats. */
+#define stats_time(gs, timer, stmt) { \
+    if ((gs)->stats) { \
+        unsigned long long start_ = ttm_cycles(); \
+        stmt; \
+        ttm_stats_time((gs)->stats, (timer), ttm_cycles() - start_); \
+    } else { \
+        stmt; \
+    } }
+#else
+#define stats_add(gs, field, n)
+#define stats_time(gs, timer, stmt)     stmt
+#endif
 
-typedef enum PlayCycleResultTag {
-    QUIT_GAME,
-    END_OF_GAME,
-    CONTINUE_PLAY
-} PlayCycleResult;
+/* Shifts a row mask by x columns, negative x shifts towards column 0. */
+#define shift_row(m, x) \
+    ((x) >= 0 ? (ttm_row_t)((ttm_row_t)(m) << (x)) : (ttm_row_t)((m) >> -(x)))
 
 #define NEED_RENDER             0x01
 #define NEW_TETRIMINO_SPAWNED   0x02
 #define QUIT_REQUESTED          0x04
 
-typedef struct TetriminoTag {
-    int defx[4];
-    int defy[4];
-    int x;      /* x,y - rotation matrix 0,0 */
-    int y;
-    int box;    /* side of a square box that tetrimino is fits == max(w,h) */
-} Tetrimino;
-
 Tetrimino tetriminos[7] = {
     /* I */
     { { 0, 1, 2, 3 },
@@ -100,32 +134,189 @@ Tetrimino tetriminos[7] = {
         0, 0, 3 },
 };
 
-#if SHOW_NEXT
-int next_tetrimino = -1;
-#endif
+/* Generated from tetriminos[] above. */
+const TetriminoShape tetrimino_shapes[7][4] = {
+    /* I */
+    {
+        { { 0x0, 0x0, 0xF, 0x0 }, { 0, 1, 2, 3 }, { 2, 2, 2, 2 }, {  2,  2,  2,  2 }, 0, 3, 2, 2 },
+        { { 0x2, 0x2, 0x2, 0x2 }, { 1, 1, 1, 1 }, { 0, 1, 2, 3 }, { -1,  0, -1, -1 }, 1, 1, 0, 3 },
+        { { 0x0, 0xF, 0x0, 0x0 }, { 0, 1, 2, 3 }, { 1, 1, 1, 1 }, {  1,  1,  1,  1 }, 0, 3, 1, 1 },
+        { { 0x4, 0x4, 0x4, 0x4 }, { 2, 2, 2, 2 }, { 0, 1, 2, 3 }, { -1, -1,  0, -1 }, 2, 2, 0, 3 }
+    },
+    /* J */
+    {
+        { { 0x0, 0x7, 0x1, 0x0 }, { 0, 1, 2, 0 }, { 1, 1, 1, 2 }, {  1,  1,  1, -1 }, 0, 2, 1, 2 },
+        { { 0x3, 0x2, 0x2, 0x0 }, { 0, 1, 1, 1 }, { 0, 0, 1, 2 }, {  0,  0, -1, -1 }, 0, 1, 0, 2 },
+        { { 0x4, 0x7, 0x0, 0x0 }, { 2, 0, 1, 2 }, { 0, 1, 1, 1 }, {  1,  1,  0, -1 }, 0, 2, 0, 1 },
+        { { 0x2, 0x2, 0x6, 0x0 }, { 1, 1, 1, 2 }, { 0, 1, 2, 2 }, { -1,  0,  2, -1 }, 1, 2, 0, 2 }
+    },
+    /* L */
+    {
+        { { 0x0, 0x7, 0x4, 0x0 }, { 0, 1, 2, 2 }, { 1, 1, 1, 2 }, {  1,  1,  1, -1 }, 0, 2, 1, 2 },
+        { { 0x2, 0x2, 0x3, 0x0 }, { 1, 1, 0, 1 }, { 0, 1, 2, 2 }, {  2,  0, -1, -1 }, 0, 1, 0, 2 },
+        { { 0x1, 0x7, 0x0, 0x0 }, { 0, 0, 1, 2 }, { 0, 1, 1, 1 }, {  0,  1,  1, -1 }, 0, 2, 0, 1 },
+        { { 0x6, 0x2, 0x2, 0x0 }, { 1, 2, 1, 1 }, { 0, 0, 1, 2 }, { -1,  0,  0, -1 }, 1, 2, 0, 2 }
+    },
+    /* O */
+    {
+        { { 0x0, 0x6, 0x6, 0x0 }, { 1, 2, 1, 2 }, { 1, 1, 2, 2 }, { -1,  1,  1, -1 }, 1, 2, 1, 2 },
+        { { 0x0, 0x6, 0x6, 0x0 }, { 1, 2, 1, 2 }, { 1, 1, 2, 2 }, { -1,  1,  1, -1 }, 1, 2, 1, 2 },
+        { { 0x0, 0x6, 0x6, 0x0 }, { 1, 2, 1, 2 }, { 1, 1, 2, 2 }, { -1,  1,  1, -1 }, 1, 2, 1, 2 },
+        { { 0x0, 0x6, 0x6, 0x0 }, { 1, 2, 1, 2 }, { 1, 1, 2, 2 }, { -1,  1,  1, -1 }, 1, 2, 1, 2 }
+    },
+    /* S */
+    {
+        { { 0x0, 0x3, 0x6, 0x0 }, { 0, 1, 1, 2 }, { 1, 1, 2, 2 }, {  1,  1,  2, -1 }, 0, 2, 1, 2 },
+        { { 0x2, 0x3, 0x1, 0x0 }, { 1, 0, 1, 0 }, { 0, 1, 1, 2 }, {  1,  0, -1, -1 }, 0, 1, 0, 2 },
+        { { 0x3, 0x6, 0x0, 0x0 }, { 0, 1, 1, 2 }, { 0, 0, 1, 1 }, {  0,  0,  1, -1 }, 0, 2, 0, 1 },
+        { { 0x4, 0x6, 0x2, 0x0 }, { 2, 1, 2, 1 }, { 0, 1, 1, 2 }, { -1,  1,  0, -1 }, 1, 2, 0, 2 }
+    },
+    /* T */
+    {
+        { { 0x0, 0x7, 0x2, 0x0 }, { 0, 1, 2, 1 }, { 1, 1, 1, 2 }, {  1,  1,  1, -1 }, 0, 2, 1, 2 },
+        { { 0x2, 0x3, 0x2, 0x0 }, { 1, 0, 1, 1 }, { 0, 1, 1, 2 }, {  1,  0, -1, -1 }, 0, 1, 0, 2 },
+        { { 0x2, 0x7, 0x0, 0x0 }, { 1, 0, 1, 2 }, { 0, 1, 1, 1 }, {  1,  0,  1, -1 }, 0, 2, 0, 1 },
+        { { 0x2, 0x6, 0x2, 0x0 }, { 1, 1, 2, 1 }, { 0, 1, 1, 2 }, { -1,  0,  1, -1 }, 1, 2, 0, 2 }
+    },
+    /* Z */
+    {
+        { { 0x0, 0x6, 0x3, 0x0 }, { 1, 2, 0, 1 }, { 1, 1, 2, 2 }, {  2,  1,  1, -1 }, 0, 2, 1, 2 },
+        { { 0x1, 0x3, 0x2, 0x0 }, { 0, 0, 1, 1 }, { 0, 1, 1, 2 }, {  0,  1, -1, -1 }, 0, 1, 0, 2 },
+        { { 0x6, 0x3, 0x0, 0x0 }, { 1, 2, 0, 1 }, { 0, 0, 1, 1 }, {  1,  0,  0, -1 }, 0, 2, 0, 1 },
+        { { 0x2, 0x6, 0x4, 0x0 }, { 1, 1, 2, 2 }, { 0, 1, 1, 2 }, { -1,  0,  1, -1 }, 1, 2, 0, 2 }
+    }
+};
+
+/*
+    SRS offsets of each orientation, see https://tetris.wiki/SRS, in
+    orientation order here: 0 is the SRS state 0, 1 is L, 2 is 2 and 3
+    is R. Offsets of I are made relative to its first one, so for every
+    piece kick t of a rotation from a to b is offsets[a][t] - offsets[b][t].
+*/
+static const signed char kick_offsets[2][4][TTM_KICKS][2] = {
+    /* J, L, S, T, Z */
+    {
+        { { 0, 0 }, {  0, 0 }, {  0,  0 }, { 0, 0 }, {  0, 0 } },
+        { { 0, 0 }, { -1, 0 }, { -1, -1 }, { 0, 2 }, { -1, 2 } },
+        { { 0, 0 }, {  0, 0 }, {  0,  0 }, { 0, 0 }, {  0, 0 } },
+        { { 0, 0 }, {  1, 0 }, {  1, -1 }, { 0, 2 }, {  1, 2 } }
+    },
+    /* I */
+    {
+        { { 0, 0 }, { -1, 0 }, {  2, 0 }, { -1,  0 }, {  2,  0 } },
+        { { 0, 0 }, {  0, 0 }, {  0, 0 }, {  0, -2 }, {  0,  1 } },
+        { { 0, 0 }, {  2, 0 }, { -1, 0 }, {  2, -1 }, { -1, -1 } },
+        { { 0, 0 }, {  1, 0 }, {  1, 0 }, {  1,  1 }, {  1, -2 } }
+    }
+};
 
-int gameboard[WIDTH * HEIGHT];
+#define TIMER_TICKS_PER_CYCLE   25
+#define TIMER_TICK_MS           20
 
-int tetrimino[4*4];
-int ttm_x, ttm_y, ttm_box;
-int ttm_pos_x, ttm_pos_y;
+void ttm_stats_time(TtmStats *stats, int timer, unsigned long long cycles) {
+    TtmTimer *t = &stats->timers[timer];
+    unsigned long long v = cycles;
+    int b = 0;
 
-/* TODO: We can track stack height, which will allow some optimizations */
+    /* Significant bits by halving, no 64-bit division here. */
+    if (v >> (TTM_STATS_BUCKETS - 1))
+        b = TTM_STATS_BUCKETS - 1;
+    else {
+        if (v >> 16) { v >>= 16; b += 16; }
+        if (v >> 8) { v >>= 8; b += 8; }
+        if (v >> 4) { v >>= 4; b += 4; }
+        if (v >> 2) { v >>= 2; b += 2; }
+        if (v >> 1) { v >>= 1; b += 1; }
+        b += (int)v;
+    }
 
-#define TIMER_TICKS_PER_CYCLE   25
+    ++t->count;
+    ++t->hist[b];
+    t->cycles += cycles;
+    if (cycles > t->max)
+        t->max = cycles;
+}
+
+void ttm_hdr_add(TtmHdr *hdr, unsigned int us) {
+    unsigned int v = us;
+    int b = 0;
+
+    if (v >> TTM_HDR_SUB_BITS) {
+        /* Power of two, then the bits under its top one. */
+        int e = 0;
+        if (v >> 16) { v >>= 16; e += 16; }
+        if (v >> 8) { v >>= 8; e += 8; }
+        if (v >> 4) { v >>= 4; e += 4; }
+        if (v >> 2) { v >>= 2; e += 2; }
+        if (v >> 1) e += 1;
+        b = ((e - TTM_HDR_SUB_BITS + 1) << TTM_HDR_SUB_BITS) +
+            (int)((us >> (e - TTM_HDR_SUB_BITS)) &
+                ((1U << TTM_HDR_SUB_BITS) - 1));
+    } else {
+        b = (int)v;
+    }
+
+    ++hdr->count;
+    ++hdr->hist[b];
+    hdr->total += us;
+    if (us > hdr->max)
+        hdr->max = us;
+}
 
-int timer_counter;
-int time_is_up;
+unsigned int ttm_hdr_value(int b) {
+    int e = (b >> TTM_HDR_SUB_BITS) + TTM_HDR_SUB_BITS - 1;
+    unsigned int sub = (unsigned int)b & ((1U << TTM_HDR_SUB_BITS) - 1);
 
-void reset_game_timer() {
-    timer_counter = 0;
-    time_is_up = 0;
+    if (b < 1 << TTM_HDR_SUB_BITS)
+        return (unsigned int)b;
+
+    return (((1U << TTM_HDR_SUB_BITS) | sub) << (e - TTM_HDR_SUB_BITS)) +
+        ((1U << (e - TTM_HDR_SUB_BITS)) - 1);
+}
+
+#ifdef STATS_CLOCK
+/* Stamps a command the game read, for its latency. */
+static void stats_read(GameState *gs, UserCommand cmd) {
+    if (gs->stats && cmd != NOTHING) {
+        gs->stats->read_us = ttm_now_us();
+        gs->stats->read_pending = 1;
+    }
+}
+
+/* Adds the latency of the command read last once a cycle ran it. */
+static void stats_frame(GameState *gs, UserCommand cmd, int rendered) {
+    if (!gs->stats || cmd == NOTHING || !gs->stats->read_pending)
+        return;
+    if (rendered)
+        ttm_hdr_add(&gs->stats->latency, ttm_now_us() - gs->stats->read_us);
+    gs->stats->read_pending = 0;
+}
+
+/* Adds how late tick runs, it was due tick * TIMER_TICK_MS after start_us. */
+static void stats_tick(GameState *gs, unsigned int start_us, unsigned int tick) {
+    unsigned int late;
+
+    if (!gs->stats)
+        return;
+    late = ttm_now_us() - start_us - tick * (TIMER_TICK_MS * 1000U);
+    ttm_hdr_add(&gs->stats->lateness, (int)late < 0 ? 0 : late);
+}
+#else
+#define stats_read(gs, cmd)
+#define stats_frame(gs, cmd, rendered)
+#define stats_tick(gs, start_us, tick)
+#endif
+
+void reset_game_timer(GameState *gs) {
+    gs->timer_counter = 0;
+    gs->time_is_up = 0;
 }
 
-void run_game_timer() {
-    if (++timer_counter >= 25) {
-        time_is_up = 1;
-        timer_counter = 0;
+void run_game_timer(GameState *gs) {
+    ++gs->ticks;
+    if (++gs->timer_counter >= TIMER_TICKS_PER_CYCLE) {
+        gs->time_is_up = 1;
+        gs->timer_counter = 0;
     }
 }
 
@@ -133,62 +324,234 @@ int max_int(int a, int b) {
     return a >= b ? a : b;
 }
 
-void collapse_rows(int rl, int rh) {
-    int i;
-    int laddr = rl * WIDTH;
-    int haddr = rh * WIDTH;
-    int size = WIDTH * HEIGHT - haddr;
+/* Murmur3 finalizer, a bijection of 32-bit words. */
+unsigned int fmix32(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x85EBCA6BU;
+    x ^= x >> 13;
+    x *= 0xC2B2AE35U;
+    x ^= x >> 16;
+    return x;
+}
+
+/*
+    Zobrist key of row r holding row, 0 for an empty row. Keys of rows
+    are XORed together, so a change of one row updates the key of the
+    board with two row keys. Only 32-bit multiplies, which need no
+    helpers from the CRT.
+*/
+unsigned long long ttm_row_key(int r, ttm_row_t row) {
+    unsigned int lo = (unsigned int)row, a, b;
+
+    if (!row)
+        return 0;
+
+#if ROW_BITS > 32
+    lo ^= fmix32((unsigned int)(row >> 32) + 0x2545F491U);
+#endif
+    a = fmix32(lo ^ (unsigned int)r * 0x9E3779B9U);
+    b = fmix32(lo + (unsigned int)(r + 1) * 0x85EBCA77U);
+
+    return (unsigned long long)b << 32 | a;
+}
+
+/* Key of the active and next tetrimino, 0 for none. */
+unsigned long long ttm_piece_key(int index, int next) {
+    return ttm_row_key(HEIGHT, (ttm_row_t)((index + 1) | (next + 1) << 3));
+}
+
+/* Key of the board size, so games of different sizes do not collide. */
+unsigned long long ttm_size_key(int width, int height) {
+    return ttm_row_key(HEIGHT + 1, (ttm_row_t)(width | height << 8));
+}
+
+int ttm_set_size(GameState *gs, int width, int height) {
+    if (width < TTM_MIN_SIZE || width > WIDTH ||
+            height < TTM_MIN_SIZE || height > HEIGHT) {
+        gs->width = WIDTH;
+        gs->height = HEIGHT;
+        return -1;
+    }
+
+    gs->width = width;
+    gs->height = height;
+
+    return 0;
+}
+
+/* Adds rows [low, high) to those the next render passes on as changed. */
+void ttm_dirty_rows(GameState *gs, int low, int high) {
+    if (low >= high)
+        return;
+
+    if (gs->dirty_low >= gs->dirty_high) {
+        gs->dirty_low = low;
+        gs->dirty_high = high;
+        return;
+    }
+
+    if (low < gs->dirty_low)
+        gs->dirty_low = low;
+    if (high > gs->dirty_high)
+        gs->dirty_high = high;
+}
+
+/*
+    Recomputes stack shape and the key from the board rows.
+*/
+void update_stack_shape(GameState *gs) {
+    ttm_row_t seen = 0;
+    int r, c;
+
+    ttm_dirty_rows(gs, 0, gs->height);
+    gs->stack_height = 0;
+    for (c = 0; c < gs->width; ++c)
+        gs->column_height[c] = 0;
+
+#if TTM_COLORS
+    for (r = 0; r < HEIGHT; ++r)
+        for (c = 0; c < TTM_COLOR_WORDS; ++c)
+            gs->colors[r][c] = 0;
+#endif
+
+    gs->key = ttm_size_key(gs->width, gs->height) ^
+        ttm_piece_key(gs->index, gs->next_tetrimino);
+
+    /* From the top, each column gets its height from its first cell. */
+    for (r = gs->height - 1; r >= 0; --r) {
+        ttm_row_t row = gs->board[r], fresh = row & ~seen;
+        int fill = 0;
+
+        gs->key ^= ttm_row_key(r, row);
+        for (; row; row &= row - 1)
+            ++fill;
+        gs->row_fill[r] = (unsigned char)fill;
+        if (fill && !gs->stack_height)
+            gs->stack_height = r + 1;
+
+        for (c = 0; fresh; ++c, fresh >>= 1)
+            if (fresh & 1)
+                gs->column_height[c] = (unsigned char)(r + 1);
+        seen |= gs->board[r];
+    }
+}
+
+/*
+    Removes rows [rl, rh) shifting the stack above down and clearing
+    the rows that became free at the top of the stack.
+*/
+void collapse_rows(GameState *gs, int rl, int rh) {
+    int r, c;
+    int n = rh - rl;
     
     ttm_assert(rl < rh);
+    ttm_assert(rh <= gs->stack_height);
 
-    for (i = 0; i < size; ++i)
-        gameboard[laddr + i] = gameboard[haddr + i];
+    ttm_dirty_rows(gs, rl, gs->stack_height);
+
+    for (r = rl; r < gs->stack_height - n; ++r) {
+        gs->key ^= ttm_row_key(r, gs->board[r]) ^
+            ttm_row_key(r, gs->board[r + n]);
+        gs->board[r] = gs->board[r + n];
+        gs->row_fill[r] = gs->row_fill[r + n];
+#if TTM_COLORS
+        for (c = 0; c < TTM_COLOR_WORDS; ++c)
+            gs->colors[r][c] = gs->colors[r + n][c];
+#endif
+    }
+
+    /* Colors of free rows are not read, they are left as they are. */
+    for (; r < gs->stack_height; ++r) {
+        gs->key ^= ttm_row_key(r, gs->board[r]);
+        gs->board[r] = 0;
+        gs->row_fill[r] = 0;
+    }
 
-    /* TODO: If we track stack height, we can optimize here by zeroing
-       only part of gameboard that was actually used.
+    gs->stack_height -= n;
+
+    /*
+        Columns topped above rl go down by the number of removed rows
+        below their top. If the top cell itself was removed, the column
+        continues down to the next occupied cell.
     */
-    for (i = (HEIGHT - (rh - rl)) * WIDTH; i < (HEIGHT * WIDTH); ++i)
-        gameboard[i] = 0;
+    for (c = 0; c < gs->width; ++c) {
+        int h = gs->column_height[c];
+        if (h <= rl)
+            continue;
+        h -= (h < rh ? h : rh) - rl;
+        while (h > 0 && !((gs->board[h - 1] >> c) & 1))
+            --h;
+        gs->column_height[c] = h;
+    }
 }
 
-void check_and_collapse_rows() {
-    int r, c;
-    int rl = -1, rh = -1;
+/*
+    Removes full rows among the rows covered by the tetrimino that has
+    just been placed. Only these rows can become full.
 
-    /* TODO: If we track stack height, we need only to go as high as the top
-        of the stack and no higher.
-    */
-    for (r = 0; r < HEIGHT; ++r) {
-        int full = 1;
-        int empty = 0;
-        for (c = 0; c < WIDTH; ++c) {
-            int cell = gameboard[r * WIDTH + c];
-            full &= cell;
-            empty |= cell;
-        }
-        
-        if (full) {
-            if (rl == -1)
-                rl = r;
-            else
-                rh = r;
-        } else if (rl != -1) {
-            /* [rl, rh) - interval */
-            if (rh == -1)
-                rh = r;
-            collapse_rows(rl, rh);
-            r = rl - 1;
-            rl = rh = -1;
+    Returns number of rows removed.
+*/
+int check_and_collapse_rows(GameState *gs) {
+    int r, rl, rh;
+    int cleared = 0;
+
+    rl = gs->pos_y + gs->shape->bottom;
+    rh = gs->pos_y + gs->shape->top;
+    if (rl < 0)
+        rl = 0;
+    if (rh >= gs->stack_height)
+        rh = gs->stack_height - 1;
+
+    /* Collapse runs of full rows from the top so lower indices stay valid. */
+    for (r = rh; r >= rl; --r) {
+        if (gs->row_fill[r] == gs->width) {
+            int top = r + 1;
+            while (r > rl && gs->row_fill[r - 1] == gs->width)
+                --r;
+            collapse_rows(gs, r, top);
+            cleared += top - r;
         }
-        
-        if (!empty)
-            break;
     }
+
+    stats_add(gs, clears[cleared], 1);
+
+    return cleared;
 }
 
-int check_collision(int landing) {
-    int r, c;
-    
+/*
+    Checks whether the active tetrimino would collide with walls, floor
+    or stack if placed at x, y.
+*/
+static int collides_at(const GameState *gs, int x, int y) {
+    int r, row;
+    const TetriminoShape *shape = gs->shape;
+
+    /* Walls and floor are checked against bounds of the occupied cells. */
+    if (x + shape->left < 0 || x + shape->right >= gs->width)
+        return 1;
+
+    row = y + shape->bottom;
+    if (row < 0)
+        return 1;
+
+    for (r = shape->bottom; r <= shape->top && row < gs->height; ++r, ++row) {
+        if (gs->board[row] & shift_row(shape->rows[r], x))
+            return 1;
+    }
+
+    return 0; 
+}
+
+int check_collision_at(GameState *gs, int x, int y) {
+    int collided = collides_at(gs, x, y);
+
+    stats_add(gs, collision_checks, 1);
+    stats_add(gs, collisions, collided);
+
+    return collided;
+}
+
+int check_collision(GameState *gs, int landing) {
     /*
         Normalize as it is used as an row offset to detect landing collision.
         Whether the piece is landed is checked by offsetting it down one row
@@ -196,48 +559,45 @@ int check_collision(int landing) {
     */
     landing = landing ? 1 : 0;
 
-    for (r = 0; r < 4; ++r) {
-        int row = ttm_pos_y - landing + r;
-        int row_offset = row * WIDTH;
-        
-        /* 
-            If tetramino is landing on the floor or there is a rotation
-            that causes it be appear below the floor and there is no stack,
-            then just check is any of the tetramino's bits are set in rows
-            below the floor and if so, we hit the floor.
-        */
-        if (row < 0) {
-            for (c = 0; c < 4; ++c) {
-                if (tetrimino[r * 4 + c])
-                    return 1;
-            }
-        }
-        
-        if (row < 0 || row >= HEIGHT)
-            continue;
-            
-        for (c = 0; c < 4; ++c) {
-            int col = ttm_pos_x + c;
-            int col_offset = row_offset + col;
-            
-            if (col < 0 || col >= WIDTH) {
-                if (tetrimino[r * 4 + c])
-                    return 1;
-                continue;
-            }
+    return check_collision_at(gs, gs->pos_x, gs->pos_y - landing);
+}
 
-            int pfcell = gameboard[col_offset];
-            int tmcell = tetrimino[r * 4 + c];
-            if (pfcell && tmcell)
-                return 1;
-        }
+/*
+    Returns number of rows the active tetrimino can fall before it lands.
+    The landing row (e.g. for a ghost piece) is gs->pos_y minus this.
+
+    When every column of the tetrimino is above the top of the stack
+    column below it, the distance comes from column heights alone.
+    Otherwise the tetrimino is tucked under an overhang and is stepped
+    down against the board rows.
+*/
+int ttm_drop_distance(GameState *gs) {
+    int c, d;
+    int dist = gs->height + 4;
+    const TetriminoShape *shape = gs->shape;
+
+    for (c = shape->left; c <= shape->right; ++c) {
+        int bottom = shape->bottoms[c];
+        if (bottom < 0)
+            continue;
+        d = gs->pos_y + bottom - gs->column_height[gs->pos_x + c];
+        if (d < 0)
+            break;
+        if (d < dist)
+            dist = d;
     }
 
-    return 0; 
+    if (c > shape->right)
+        return dist;
+
+    for (d = 0; !check_collision_at(gs, gs->pos_x, gs->pos_y - d - 1); ++d)
+        ;
+
+    return d;
 }
 
-int check_landing() {
-    return check_collision(1);
+int check_landing(GameState *gs) {
+    return check_collision(gs, 1);
 }
 
 /*
@@ -247,148 +607,530 @@ int check_landing() {
     Returns 1 if tetrimino already in landed position before
     advance was attempted or 0 otherwise.
 */
-int advance_tetrimino() {
-    int landed = check_landing();
+int advance_tetrimino(GameState *gs) {
+    int landed = check_landing(gs);
     if (!landed)
-        --ttm_pos_y;
+        --gs->pos_y;
         
     return landed;
 }
 
 /*
-    Transposes a square matrix.
-    m matrix
-    bs buffer size (width and height)
-    x_off, y_off location of matrix in the buffer
-    ms matrix size (width and height)
- */
-void transpose(int *m, int bs, int x_off, int y_off, int ms) {
-    int x, y;
-    
-    ttm_assert((x_off + ms) <= bs);
-    ttm_assert((y_off + ms) <= bs);
-
-    for (y = 0; y < ms; ++y) {
-        for (x = y + 1; x < ms; ++x) {
-            int *mrx = &m[(y + y_off) * bs + x + x_off];
-            int *mry = &m[(x + x_off) * bs + y + y_off];
-            swap_int(*mrx, *mry);
-        }
+    Rotates the active tetrimino by a multiple of 90 degrees, positive
+    angle is ROTATE_CW. Only the orientation index changes.
+*/
+void rotate_tetrimino(GameState *gs, int angle) {
+    gs->rot = (gs->rot + angle / 90) & 3;
+    gs->shape = &tetrimino_shapes[gs->index][gs->rot];
+}
+
+int ttm_kicks(int index, int rot, int dir, signed char (*kicks)[2]) {
+    const signed char (*a)[2], (*b)[2];
+    int t, n = index == 3 ? 1 : TTM_KICKS;
+
+    a = kick_offsets[index == 0][rot & 3];
+    b = kick_offsets[index == 0][(rot + dir) & 3];
+    for (t = 0; t < n; ++t) {
+        kicks[t][0] = (signed char)(a[t][0] - b[t][0]);
+        kicks[t][1] = (signed char)(a[t][1] - b[t][1]);
     }
+
+    return n;
 }
 
-void mirror_y(int *m, int bs, int x_off, int y_off, int ms) {
-    int x, y;
+/*
+    Rotates the active tetrimino one step, ROTATE_CW if dir is positive,
+    at the first of its kicks that does not collide. Kicks do not lift
+    it above the row it spawns on.
 
-    for (y = 0; y < ms; ++y) {
-        for (x = 0; x < ms / 2; ++x) {
-            int *row = &m[(y + y_off) * bs];
-            int *mrl = &row[x + x_off];
-            int *mrr = &row[ms - 1 - x - x_off];
-            swap_int(*mrl, *mrr);
+    Returns 1 if it rotated or 0 if every kick collides.
+*/
+int ttm_rotate(GameState *gs, int dir) {
+    signed char kicks[TTM_KICKS][2];
+    int t, n = ttm_kicks(gs->index, gs->rot, dir, kicks);
+
+    rotate_tetrimino(gs, dir > 0 ? 90 : -90);
+    for (t = 0; t < n; ++t) {
+        int x = gs->pos_x + kicks[t][0], y = gs->pos_y + kicks[t][1];
+        if (y <= gs->height - 2 && !check_collision_at(gs, x, y)) {
+            gs->pos_x = x;
+            gs->pos_y = y;
+            return 1;
         }
     }
+    rotate_tetrimino(gs, dir > 0 ? -90 : 90);
+    stats_add(gs, rotations_rejected, 1);
+
+    return 0;
 }
 
-void rotate_cw(int *m, int bs, int x_off, int y_off, int ms) {
-    transpose(m, bs, x_off, y_off, ms);
-    mirror_y(m, bs, x_off, y_off, ms);
+void move_tetrimino(GameState *gs, int offset) {
+    if (offset < 0)
+        --gs->pos_x;
+    else if (offset > 0)
+        ++gs->pos_x;
 }
 
-void rotate_ccw(int *m, int bs, int x_off, int y_off, int ms) {
-    mirror_y(m, bs, x_off, y_off, ms);
-    transpose(m, bs, x_off, y_off, ms);
+/*
+    xoshiro128** by David Blackman and Sebastiano Vigna, see
+    https://prng.di.unimi.it/. Only 32-bit operations, so it does not
+    need runtime library helpers on 32-bit targets.
+*/
+#define rotl32(x, k)    (((x) << (k)) | ((x) >> (32 - (k))))
+
+unsigned int ttm_random(GameState *gs) {
+    unsigned int *s = gs->rng;
+    unsigned int result = rotl32(s[1] * 5, 7) * 9;
+    unsigned int t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl32(s[3], 11);
+
+    return result;
 }
 
-void rotate_tetrimino(int angle) {
-    switch (angle) {
-        case 90:
-            rotate_cw(tetrimino, 4, ttm_x, ttm_y, ttm_box);
-            break;
-            
-        case -90:
-            rotate_ccw(tetrimino, 4, ttm_x, ttm_y, ttm_box);
-            break;
+/*
+    Returns a uniformly distributed number in [0, n). Values from the
+    incomplete top interval of the 32-bit range are rejected so that
+    small numbers are not favoured.
+*/
+unsigned int ttm_random_below(GameState *gs, unsigned int n) {
+    unsigned int threshold = (0U - n) % n;
+    unsigned int r;
+
+    do {
+        r = ttm_random(gs);
+    } while (r < threshold);
+
+    return r % n;
+}
+
+void rng_jump(GameState *gs, const unsigned int *poly) {
+    unsigned int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i, b;
+
+    for (i = 0; i < 4; ++i) {
+        for (b = 0; b < 32; ++b) {
+            if (poly[i] & (1U << b)) {
+                s0 ^= gs->rng[0];
+                s1 ^= gs->rng[1];
+                s2 ^= gs->rng[2];
+                s3 ^= gs->rng[3];
+            }
+            ttm_random(gs);
+        }
     }
+
+    gs->rng[0] = s0;
+    gs->rng[1] = s1;
+    gs->rng[2] = s2;
+    gs->rng[3] = s3;
 }
 
-void move_tetrimino(int offset) {
-    if (offset < 0)
-        --ttm_pos_x;
-    else if (offset > 0)
-        ++ttm_pos_x;
+/*
+    Advance the generator by 2^64 and 2^96 numbers. Starting from one
+    seed, n jumps give n sequences that never overlap, e.g. one per
+    thread. Long jumps split further, e.g. one per process.
+*/
+void ttm_rng_jump(GameState *gs) {
+    static const unsigned int poly[4] = {
+        0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b
+    };
+    rng_jump(gs, poly);
+}
+
+void ttm_rng_long_jump(GameState *gs) {
+    static const unsigned int poly[4] = {
+        0xb523952e, 0x0b6f099f, 0xccf5a0ef, 0x1c580662
+    };
+    rng_jump(gs, poly);
 }
 
-void spawn_new_tetrimino() {
+/* splitmix32, used to expand seeds into generator state. */
+unsigned int splitmix32(unsigned int *x) {
+    unsigned int z = (*x += 0x9e3779b9U);
+    z = (z ^ (z >> 16)) * 0x85ebca6bU;
+    z = (z ^ (z >> 13)) * 0xc2b2ae35U;
+    return z ^ (z >> 16);
+}
+
+/*
+    Seeds the piece sequence. Different streams of the same seed give
+    unrelated sequences, e.g. one per game of a batch, while staying
+    reproducible from (seed, stream). Also restarts the 7-bag.
+*/
+void ttm_seed_stream(GameState *gs, unsigned int seed, unsigned int stream) {
+    unsigned int x = seed;
+    unsigned int y = splitmix32(&stream);
     int i;
-    int ttm_index;
-    Tetrimino *tmdef;
-#if RANDOM_ROTATE
-    int rotation;
-#endif
-    
+
+    for (i = 0; i < 4; ++i)
+        gs->rng[i] = splitmix32(&x) ^ splitmix32(&y);
+
+    /* All-zero state is the one state the generator cannot leave. */
+    if (!(gs->rng[0] | gs->rng[1] | gs->rng[2] | gs->rng[3]))
+        gs->rng[0] = 1;
+
+    gs->bag = 0;
+}
+
+void ttm_seed(GameState *gs, unsigned int seed) {
+    ttm_seed_stream(gs, seed, 0);
+}
+
+/*
+    Draws the index of the next tetrimino. With TTM_BAG7 every run of 7
+    pieces is a random permutation of all of them.
+*/
+int draw_tetrimino(GameState *gs) {
+    unsigned int k;
+    int i;
+
+    if (gs->randomizer != TTM_BAG7)
+        return (int)ttm_random_below(gs, 7);
+
+    if (!gs->bag)
+        gs->bag = 0x7F;
+
+    /* Take the k-th piece still in the bag. */
+    k = 0;
+    for (i = 0; i < 7; ++i)
+        k += (gs->bag >> i) & 1;
+    k = ttm_random_below(gs, k);
+
+    for (i = 0; ; ++i) {
+        if (((gs->bag >> i) & 1) && !k--)
+            break;
+    }
+    gs->bag &= (unsigned char)~(1 << i);
+
+    return i;
+}
+
+void spawn_new_tetrimino(GameState *gs) {
+    stats_add(gs, spawns, 1);
+
+    gs->key ^= ttm_piece_key(gs->index, gs->next_tetrimino);
+
 #if SHOW_NEXT
-    if (next_tetrimino < 0) {
-        ttm_index = ttm_rnd() % 7;
-        next_tetrimino = ttm_rnd() % 7;
+    if (gs->next_tetrimino < 0) {
+        gs->index = draw_tetrimino(gs);
+        gs->next_tetrimino = draw_tetrimino(gs);
     } else {
-        ttm_index = next_tetrimino;
-        next_tetrimino = ttm_rnd() % 7;
+        gs->index = gs->next_tetrimino;
+        gs->next_tetrimino = draw_tetrimino(gs);
     }
 #else
-    ttm_index = ttm_rnd() % 7;
+    gs->index = draw_tetrimino(gs);
 #endif
-    
-    tmdef = &tetriminos[ttm_index];
-    
-    for (i = 0; i < 16; ++i)
-        tetrimino[i] = 0;
-        
-    for (i = 0; i < 4; ++i) {
-        int r = tmdef->defy[i];
-        int c = tmdef->defx[i];
-        tetrimino[r * 4 + c] = 1;
-    }
 
-    ttm_x = tmdef->x;
-    ttm_y = tmdef->y;
-    ttm_box = tmdef->box;
+    gs->key ^= ttm_piece_key(gs->index, gs->next_tetrimino);
     
 #if RANDOM_ROTATE
-    rotation = ttm_rnd() % 3;
-    rotate_tetrimino(rotation * 90);
+    gs->rot = ttm_random_below(gs, 4);
+#else
+    gs->rot = 0;
 #endif
+    gs->shape = &tetrimino_shapes[gs->index][gs->rot];
     
-    ttm_pos_y = HEIGHT - 2;
-    ttm_pos_x = (WIDTH - ttm_box) / 2;
+    gs->pos_y = gs->height - 2;
+    gs->pos_x = (gs->width - tetriminos[gs->index].box) / 2;
 }
 
-void place_tetrimino() {
-    int r, c;
-    for (r = 0; r < 4; ++r) {
-        for (c = 0; c < 4; ++c) {
-            /* 
-                ttm_pos_y may be such that places tetrimino outside bounds
-                of the gameboard completely or partially. This is the case
-                for spawning, where spawn position is in two rows above the
-                visible gameboard. We do not need to allocate these rows
-                as they never rendered, thus the check.
-            */
-            int row = ttm_pos_y + r;
-            if (row < HEIGHT) {
-                int *pfcell = &gameboard[(ttm_pos_y + r) * WIDTH + ttm_pos_x + c];
-                /* 
-                    Use XOR instead or OR so we can use it for rendering.
-                    Normally there should be no collisions between
-                    stack and tetrimino.
-                */
-                *pfcell ^= tetrimino[r * 4 + c];
+/*
+    Fills pieces with the indices of the next tetriminos to spawn that
+    the game shows, at most n: next_tetrimino with SHOW_NEXT, then
+    gs->preview more. Those are drawn from a copy of the generator, gs
+    is not changed. Returns how many there are.
+*/
+int ttm_preview(const GameState *gs, int *pieces, int n) {
+    GameState peek;
+    int i = 0;
+
+    if (n > SHOW_NEXT + gs->preview)
+        n = SHOW_NEXT + gs->preview;
+
+    /* Only what draw_tetrimino and ttm_random read. */
+    peek.rng[0] = gs->rng[0];
+    peek.rng[1] = gs->rng[1];
+    peek.rng[2] = gs->rng[2];
+    peek.rng[3] = gs->rng[3];
+    peek.bag = gs->bag;
+    peek.randomizer = gs->randomizer;
+
+#if SHOW_NEXT
+    if (n > 0 && gs->next_tetrimino >= 0)
+        pieces[i++] = gs->next_tetrimino;
+#endif
+
+    for (; i < n; ++i) {
+        pieces[i] = draw_tetrimino(&peek);
+#if RANDOM_ROTATE
+        /* Spawning draws the rotation after the piece. */
+        ttm_random_below(&peek, 4);
+#endif
+    }
+
+    return n;
+}
+
+void place_tetrimino(GameState *gs) {
+    int i, r;
+    const TetriminoShape *shape = gs->shape;
+
+    ttm_dirty_rows(gs, gs->pos_y + shape->bottom, gs->pos_y + shape->top + 1);
+
+    for (r = shape->bottom; r <= shape->top; ++r) {
+        /* 
+            gs->pos_y may be such that places tetrimino outside bounds
+            of the gameboard completely or partially. This is the case
+            for spawning, where spawn position is in two rows above the
+            visible gameboard. We do not need to allocate these rows
+            as they never rendered, thus the check.
+        */
+        int row = gs->pos_y + r;
+        if (row < gs->height) {
+            ttm_row_t old = gs->board[row];
+            gs->board[row] = old | shift_row(shape->rows[r], gs->pos_x);
+            gs->key ^= ttm_row_key(row, old) ^ ttm_row_key(row, gs->board[row]);
+        }
+    }
+
+    for (i = 0; i < 4; ++i) {
+        int row = gs->pos_y + shape->cy[i];
+        int col = gs->pos_x + shape->cx[i];
+        if (row < gs->height) {
+            ++gs->row_fill[row];
+            if (row >= gs->column_height[col])
+                gs->column_height[col] = row + 1;
+            if (row >= gs->stack_height)
+                gs->stack_height = row + 1;
+#if TTM_COLORS
+            {
+                unsigned int *w = &gs->colors[row][col >> 3];
+                int shift = (col & 7) << 2;
+                *w = (*w & ~(0xFU << shift)) |
+                    (unsigned int)(gs->index + 1) << shift;
             }
+#endif
+        }
+    }
+}
+
+int ttm_cell(const GameState *gs, int x, int y) {
+    if (!((gs->board[y] >> x) & 1))
+        return TTM_CELL_EMPTY;
+#if TTM_COLORS
+    {
+        int cell = (gs->colors[y][x >> 3] >> ((x & 7) << 2)) & 0xF;
+        if (cell)
+            return cell;
+    }
+#endif
+    return TTM_CELL_FILLED;
+}
+
+void ttm_snapshot(const GameState *gs, TtmSnapshot *snap) {
+    int i;
+
+    for (i = 0; i < 4; ++i)
+        snap->rng[i] = gs->rng[i];
+    for (i = 0; i < HEIGHT; ++i)
+        snap->board[i] = gs->board[i];
+    snap->pos_x = (signed char)gs->pos_x;
+    snap->pos_y = (short)gs->pos_y;
+    snap->piece = (unsigned char)(gs->index | gs->rot << 3);
+    snap->next_tetrimino = (signed char)gs->next_tetrimino;
+    snap->timer = (unsigned char)(gs->timer_counter | gs->time_is_up << 7);
+    snap->bag = gs->bag;
+#if TTM_COLORS
+    {
+        int w;
+        for (i = 0; i < HEIGHT; ++i)
+            for (w = 0; w < TTM_COLOR_WORDS; ++w)
+                snap->colors[i][w] = gs->colors[i][w];
+    }
+#endif
+}
+
+void ttm_restore(GameState *gs, const TtmSnapshot *snap) {
+    int i;
+
+    for (i = 0; i < 4; ++i)
+        gs->rng[i] = snap->rng[i];
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = snap->board[i];
+    gs->pos_x = snap->pos_x;
+    gs->pos_y = snap->pos_y;
+    gs->index = snap->piece & 7;
+    gs->rot = snap->piece >> 3;
+    gs->shape = &tetrimino_shapes[gs->index][gs->rot];
+    gs->next_tetrimino = snap->next_tetrimino;
+    gs->timer_counter = snap->timer & 0x7F;
+    gs->time_is_up = snap->timer >> 7;
+    gs->bag = snap->bag;
+
+    update_stack_shape(gs);
+#if TTM_COLORS
+    {
+        int w;
+        for (i = 0; i < HEIGHT; ++i)
+            for (w = 0; w < TTM_COLOR_WORDS; ++w)
+                gs->colors[i][w] = snap->colors[i][w];
+    }
+#endif
+}
+
+void ttm_undo_init(TtmUndo *undo) {
+    undo->first = 0;
+    undo->count = 0;
+    undo->ticks = 0;
+}
+
+/*
+    Pushes a snapshot when a tetrimino has spawned since the last one,
+    the oldest goes when the stack is full. A new game empties it.
+*/
+void ttm_undo_track(TtmUndo *undo, const GameState *gs) {
+    int i;
+
+    if (gs->ticks < undo->ticks)
+        undo->count = 0;
+    undo->ticks = gs->ticks;
+
+    if (undo->count && gs->pieces ==
+            undo->pieces[(undo->first + undo->count - 1) % TTM_UNDO_DEPTH])
+        return;
+
+    if (undo->count == TTM_UNDO_DEPTH) {
+        undo->first = (undo->first + 1) % TTM_UNDO_DEPTH;
+        --undo->count;
+    }
+
+    i = (undo->first + undo->count++) % TTM_UNDO_DEPTH;
+    ttm_snapshot(gs, &undo->snaps[i]);
+    undo->pieces[i] = gs->pieces;
+    undo->lines[i] = gs->lines;
+}
+
+/*
+    Takes back the last placed tetrimino, so the one before is where it
+    spawned. Returns 0 or -1 if there is nothing to take back or the
+    game is recorded, as a replay can not take a move back.
+*/
+int ttm_undo_move(TtmUndo *undo, GameState *gs) {
+    int i;
+
+    if (undo->count < 2 || gs->record)
+        return -1;
+
+    --undo->count;
+    i = (undo->first + undo->count - 1) % TTM_UNDO_DEPTH;
+    ttm_restore(gs, &undo->snaps[i]);
+    gs->pieces = undo->pieces[i];
+    gs->lines = undo->lines[i];
+
+    return 0;
+}
+
+void ttm_input_init(TtmInput *in, unsigned int das_ms, unsigned int arr_ms) {
+    in->head = 0;
+    in->tail = 0;
+    in->das = das_ms;
+    in->arr = arr_ms < TIMER_TICK_MS ? TIMER_TICK_MS : arr_ms;
+    in->down = 0;
+    in->held = NOTHING;
+    in->repeat_ms = 0;
+    in->read_ms = 0;
+    in->dropped = 0;
+}
+
+int ttm_input_push(TtmInput *in, int key, unsigned int ms) {
+    TtmKeyEvent *e;
+
+    if (in->tail - in->head == TTM_INPUT_SIZE) {
+        ++in->dropped;
+        return -1;
+    }
+
+    e = &in->events[in->tail++ % TTM_INPUT_SIZE];
+    e->ms = ms;
+    e->key = (unsigned char)key;
+
+    return 0;
+}
+
+UserCommand ttm_input_read(TtmInput *in, unsigned int now_ms) {
+    while (1) {
+        int due = in->held != NOTHING && (int)(now_ms - in->repeat_ms) >= 0;
+        const TtmKeyEvent *e;
+        int cmd;
+        unsigned int bit;
+
+        /* A repeat goes before the events that happened after it. */
+        if (in->head == in->tail || (due &&
+                (int)(in->events[in->head % TTM_INPUT_SIZE].ms -
+                    in->repeat_ms) > 0)) {
+            if (!due)
+                return NOTHING;
+            in->read_ms = in->repeat_ms;
+            in->repeat_ms += in->arr;
+            return (UserCommand)in->held;
+        }
+
+        e = &in->events[in->head++ % TTM_INPUT_SIZE];
+        cmd = e->key & ~TTM_KEY_UP;
+        bit = 1U << cmd;
+
+        if (e->key & TTM_KEY_UP) {
+            in->down &= ~bit;
+            if (in->held == cmd)
+                in->held = NOTHING;
+            continue;
         }
+
+        if (in->down & bit)
+            continue;
+        in->down |= bit;
+
+        if (cmd == MOVE_LEFT || cmd == MOVE_RIGHT || cmd == SPEEDUP) {
+            in->held = cmd;
+            in->repeat_ms = e->ms + in->das;
+        }
+
+        in->read_ms = e->ms;
+        return (UserCommand)cmd;
     }
 }
 
+unsigned int ttm_input_wait_ms(const TtmInput *in, unsigned int now_ms) {
+    if (in->head != in->tail)
+        return 0;
+    if (in->held == NOTHING)
+        return TTM_WAIT_FOREVER;
+    if ((int)(in->repeat_ms - now_ms) <= 0)
+        return 0;
+    return in->repeat_ms - now_ms;
+}
+
+/*
+    Places the landed tetrimino into the stack, removes full rows and
+    spawns the next tetrimino.
+*/
+void lock_tetrimino(GameState *gs) {
+    place_tetrimino(gs);
+    gs->lines += check_and_collapse_rows(gs);
+    ++gs->pieces;
+    spawn_new_tetrimino(gs);
+}
+
 /* 
+    Applies a user command to the game.
+
     Returns flags that indicate result of processing of user input.
         NEED_RENDER     
             The user input changed the gameboard and it needs 
@@ -401,73 +1143,48 @@ void place_tetrimino() {
         QUIT_REQUESTED
             User requested to quit application.
 */
-int process_user_input() {
+int apply_command(GameState *gs, UserCommand cmd) {
     int flags = 0;
-    UserCommand cmd = ttm_read_command_callback();
-    
-    /* TODO: 
-        For now just skip the whole wall/floor kick thing as it is
-        non-trivial.
-        And yet also see https://tetris.wiki/SRS 
-        (How Guidline SDS Really Works).
-    */
+
     switch (cmd) {
         case ROTATE_CW:
-            rotate_tetrimino(90);
-            if (check_collision(0))
-                rotate_tetrimino(-90);
-            else
+            if (ttm_rotate(gs, 1))
                 flags |= NEED_RENDER;
             break;
 
         case ROTATE_CCW:
-            rotate_tetrimino(-90);
-            if (check_collision(0))
-                rotate_tetrimino(90);
-            else
+            if (ttm_rotate(gs, -1))
                 flags |= NEED_RENDER;
             break;
             
         case MOVE_LEFT:
-            move_tetrimino(-1);
-            if (check_collision(0))
-                move_tetrimino(1);
+            move_tetrimino(gs, -1);
+            if (check_collision(gs, 0))
+                move_tetrimino(gs, 1);
             else
                 flags |= NEED_RENDER;
             break;
             
         case MOVE_RIGHT:
-            move_tetrimino(1);
-            if (check_collision(0))
-                move_tetrimino(-1);
+            move_tetrimino(gs, 1);
+            if (check_collision(gs, 0))
+                move_tetrimino(gs, -1);
             else
                 flags |= NEED_RENDER;
             break;
             
         case SPEEDUP:
-            if (advance_tetrimino()) {
-                place_tetrimino();
-                check_and_collapse_rows();
-                spawn_new_tetrimino();
+            if (advance_tetrimino(gs)) {
+                lock_tetrimino(gs);
                 flags |= NEW_TETRIMINO_SPAWNED;
             }
             flags |= NEED_RENDER;
             break;
             
         case DROP:
-            /* 
-                1. Find the first non-empty row.
-                2. Move down checking for landing iteratively.
-            */
-            while (1) {
-                if (advance_tetrimino()) {
-                    place_tetrimino();
-                    check_and_collapse_rows();
-                    spawn_new_tetrimino();
-                    flags |= NEW_TETRIMINO_SPAWNED;
-                    break;
-                }
-            }
+            gs->pos_y -= ttm_drop_distance(gs);
+            lock_tetrimino(gs);
+            flags |= NEW_TETRIMINO_SPAWNED;
             flags |= NEED_RENDER;
             break;
             
@@ -483,46 +1200,102 @@ int process_user_input() {
     return flags;
 }
 
-void render_gameboard() {
+/* Reads the next command, timed as TTM_TIMER_INPUT. */
+UserCommand read_command(GameState *gs) {
+    UserCommand cmd;
+
+    stats_time(gs, TTM_TIMER_INPUT, cmd = ttm_read_command_callback(gs));
+    stats_read(gs, cmd);
+
+    return cmd;
+}
+
+int process_user_input(GameState *gs) {
+    return apply_command(gs, read_command(gs));
+}
+
+void expand_gameboard(GameState *gs) {
     /*
-        1. Place the tetramino on the gameboard
+        1. Expand the changed board rows with the tetrimino merged in
+           into the cell-per-byte gameboard view, every row for
+           ttm_render_callback.
         2. Call render callback with gameboard address, width and height.
-        3. Remove the teramino from the gameboard by XORing the tetramino
-           matrix with the gameboard.
     */
 #ifndef NO_RENDER    
-    place_tetrimino();
-    ttm_render_callback(gameboard, WIDTH, HEIGHT);
-    place_tetrimino();
+    unsigned char gameboard[WIDTH * HEIGHT];
+    int r, c, low, high;
+
+    /* The tetrimino leaves the rows it was drawn on for its own. */
+    ttm_dirty_rows(gs, gs->drawn_low, gs->drawn_high);
+    gs->drawn_low = gs->pos_y + gs->shape->bottom;
+    gs->drawn_high = gs->pos_y + gs->shape->top + 1;
+    ttm_dirty_rows(gs, gs->drawn_low, gs->drawn_high);
+
+#ifdef RENDER_ROWS
+    low = gs->dirty_low > 0 ? gs->dirty_low : 0;
+    high = gs->dirty_high < gs->height ? gs->dirty_high : gs->height;
+    if (low >= high)
+        low = high = 0;
+#else
+    low = 0;
+    high = gs->height;
+#endif
+    gs->dirty_low = 0;
+    gs->dirty_high = 0;
+
+    for (r = low; r < high; ++r) {
+        ttm_row_t piece = 0;
+        unsigned char *cells = &gameboard[r * gs->width];
+        int tr = r - gs->pos_y;
+        if (tr >= gs->shape->bottom && tr <= gs->shape->top)
+            piece = shift_row(gs->shape->rows[tr], gs->pos_x);
+        for (c = 0; c < gs->width; ++c)
+            cells[c] = (unsigned char)((piece >> c) & 1 ?
+                gs->index + 1 : ttm_cell(gs, c, r));
+    }
+
+#ifdef RENDER_ROWS
+    ttm_render_rows_callback(gs, gameboard, gs->width, gs->height, low, high);
+#else
+    ttm_render_callback(gs, gameboard, gs->width, gs->height);
+#endif
 #endif    
 }
 
-PlayCycleResult run_cycle() {
+void render_gameboard(GameState *gs) {
+#ifndef NO_RENDER
+    stats_time(gs, TTM_TIMER_RENDER, expand_gameboard(gs));
+#endif
+}
+
+PlayCycleResult command_cycle(GameState *gs, UserCommand cmd) {
     PlayCycleResult result = CONTINUE_PLAY;
     int flags;
 
-    flags = process_user_input();
+    if (cmd != NOTHING && gs->record)
+        gs->record(gs, cmd);
+
+    flags = apply_command(gs, cmd);
     if ((flags & NEW_TETRIMINO_SPAWNED)) {
-        if (check_landing())
+        if (check_landing(gs))
             result = END_OF_GAME;
 
         /* Here we need to reset timer, because new tetrimino was generated. */
-        reset_game_timer();
-    } else if (time_is_up) {
-        if (advance_tetrimino()) {
-            place_tetrimino();
-            check_and_collapse_rows();
-            spawn_new_tetrimino();
-            if (check_landing())
+        reset_game_timer(gs);
+    } else if (gs->time_is_up) {
+        if (advance_tetrimino(gs)) {
+            lock_tetrimino(gs);
+            if (check_landing(gs))
                 result = END_OF_GAME;
         }
         
         flags |= NEED_RENDER;
-        reset_game_timer();
+        reset_game_timer(gs);
     }
     
     if (flags & NEED_RENDER)
-        render_gameboard();
+        render_gameboard(gs);
+    stats_frame(gs, cmd, flags & NEED_RENDER);
         
     if (flags & QUIT_REQUESTED)
         result = QUIT_GAME;
@@ -530,51 +1303,191 @@ PlayCycleResult run_cycle() {
     return result;
 }
 
-void init_game() {
+/*
+    Runs one cycle of the game with the given user command.
+*/
+PlayCycleResult run_command_cycle(GameState *gs, UserCommand cmd) {
+    PlayCycleResult result;
+
+    stats_time(gs, TTM_TIMER_CYCLE, result = command_cycle(gs, cmd));
+
+    return result;
+}
+
+PlayCycleResult run_cycle(GameState *gs) {
+    return run_command_cycle(gs, read_command(gs));
+}
+
+/*
+    Advances the game by one timer tick with the given user command,
+    without waiting. This is what play_loop does every 20ms and lets
+    headless code drive games at full speed. More commands on the same
+    tick go to run_command_cycle.
+*/
+PlayCycleResult ttm_step(GameState *gs, UserCommand cmd) {
+    run_game_timer(gs);
+    return run_command_cycle(gs, cmd);
+}
+
+/*
+    Same as n calls to ttm_step(gs, NOTHING). Ticks on which only the
+    timer counts are skipped without running a cycle.
+*/
+PlayCycleResult ttm_step_idle(GameState *gs, unsigned int n) {
+    PlayCycleResult result = CONTINUE_PLAY;
+
+    while (n && result == CONTINUE_PLAY) {
+        unsigned int quiet = TIMER_TICKS_PER_CYCLE - 1 - gs->timer_counter;
+        if (quiet >= n) {
+            gs->timer_counter += n;
+            gs->ticks += n;
+            break;
+        }
+
+        gs->timer_counter += quiet;
+        gs->ticks += quiet;
+        n -= quiet + 1;
+        result = ttm_step(gs, NOTHING);
+    }
+
+    return result;
+}
+
+void init_game(GameState *gs) {
     int i;
 
-    for (i = 0; i < (WIDTH * HEIGHT); ++i)
-        gameboard[i] = 0;
+    ttm_set_size(gs, gs->width, gs->height);
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+
+    /* Nothing is on the screen, every row is drawn. */
+    gs->dirty_low = 0;
+    gs->dirty_high = 0;
+    gs->drawn_low = 0;
+    gs->drawn_high = 0;
 
-    spawn_new_tetrimino();
+    gs->index = -1;
+    gs->next_tetrimino = -1;
+    update_stack_shape(gs);
+
+    gs->pieces = 0;
+    gs->lines = 0;
+    gs->ticks = 0;
+
+    /* A state that was never seeded gets the default sequence. */
+    if (!(gs->rng[0] | gs->rng[1] | gs->rng[2] | gs->rng[3]))
+        ttm_seed(gs, 1);
+
+    spawn_new_tetrimino(gs);
     
-    ttm_assert(!check_collision(0));
+    ttm_assert(!check_collision(gs, 0));
 
-    reset_game_timer();
+    reset_game_timer(gs);
 }
 
-PlayCycleResult play_loop() {
+#ifdef TICKLESS
+/*
+    Ticks are still counted as if the loop ran every TIMER_TICK_MS, so
+    gravity keeps its timing and replays stay the same, but the loop
+    only wakes up for input and for the tick gravity is due on.
+*/
+PlayCycleResult play_loop(GameState *gs) {
+    PlayCycleResult result = CONTINUE_PLAY;
+    unsigned int start, now, tick, gravity;
+#ifdef STATS_CLOCK
+    unsigned int start_us;
+#endif
+    
+    init_game(gs);
+    start = ttm_now_ms();
+#ifdef STATS_CLOCK
+    start_us = ttm_now_us();
+#endif
+    
+    while (result == CONTINUE_PLAY) {
+        UserCommand cmd;
+
+        now = ttm_now_ms() - start;
+        gravity = gs->ticks + TIMER_TICKS_PER_CYCLE - gs->timer_counter;
+        
+        if (now / TIMER_TICK_MS >= gravity) {
+            stats_tick(gs, start_us, gravity);
+            result = ttm_step_idle(gs, gravity - gs->ticks);
+            continue;
+        }
+        
+        if (!ttm_wait_input_ms(gs, gravity * TIMER_TICK_MS - now))
+            continue;
+        
+        cmd = read_command(gs);
+        if (cmd == NOTHING)
+            continue;
+        
+        /*
+            The tick polling would have read it on. The rest of a burst is
+            read on the same tick by the next passes, so the queue empties
+            without the game ticks getting ahead of the clock.
+        */
+        tick = (ttm_now_ms() - start + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        if (tick > gs->ticks) {
+            result = ttm_step_idle(gs, tick - 1 - gs->ticks);
+            if (result == CONTINUE_PLAY)
+                result = ttm_step(gs, cmd);
+        } else
+            result = run_command_cycle(gs, cmd);
+    }
+    
+    return result;
+}
+#else
+PlayCycleResult play_loop(GameState *gs) {
     PlayCycleResult result;
+#ifdef STATS_CLOCK
+    unsigned int start_us;
+#endif
     
-    init_game();
+    init_game(gs);
+#ifdef STATS_CLOCK
+    start_us = ttm_now_us();
+#endif
     
     while (1) {
-        run_game_timer();
-        result = run_cycle();
+        run_game_timer(gs);
+        stats_tick(gs, start_us, gs->ticks - 1);
+        result = run_cycle(gs);
         if (result != CONTINUE_PLAY)
             break;
             
-        ttm_sleep_ms(20);  // 20ms (50Hz)
+        ttm_sleep_ms(TIMER_TICK_MS);  // 20ms (50Hz)
     }
     
     return result;
 }
+#endif
+
+GameState game;
 
 void game_loop() {
-    ttm_rnd_init();
+    GameState *gs = &game;
 
     while (1) {
         while (1) {
-            UserCommand cmd = ttm_read_command_callback();
+            UserCommand cmd = ttm_read_command_callback(gs);
             if (cmd == QUIT)
                 return;
             else if (cmd != NOTHING)
                 break;
 
+#ifdef TICKLESS
+            (void)ttm_wait_input_ms(gs, TTM_WAIT_FOREVER);
+#else
             ttm_sleep_ms(300);
+#endif
         }
     
-        PlayCycleResult result = play_loop();
+        ttm_seed(gs, ttm_rnd_seed());
+        PlayCycleResult result = play_loop(gs);
         if (result == QUIT_GAME)
             break;
     }
@@ -0,0 +1,482 @@
+/* ctetris.h */
+#ifndef CTETRIS_H
+#define CTETRIS_H
+
+#ifndef WIDTH
+#define WIDTH 10
+#endif
+
+#ifndef HEIGHT
+#define HEIGHT 20
+#endif
+
+#ifndef RANDOM_ROTATE
+#define RANDOM_ROTATE   0
+#endif
+
+#ifndef SHOW_NEXT
+#define SHOW_NEXT       1
+#endif
+
+/* Counters and timings of GameState.stats, compiled out when 0. */
+#ifndef TTM_STATS
+#define TTM_STATS       0
+#endif
+
+/* Tetrimino of every stack cell in GameState.colors, kept when 1. */
+#ifndef TTM_COLORS
+#define TTM_COLORS      0
+#endif
+
+#if HEIGHT > 255
+#error HEIGHT is too large for column heights
+#endif
+
+/*
+    WIDTH and HEIGHT are the largest board of the build, every game can
+    be given its own size up to them, see ttm_set_size. Storage is sized
+    for the largest board.
+
+    The gameboard is stored as one bitmask per row, bit c is column c.
+    The row word is the narrowest unsigned type that holds WIDTH bits,
+    so the row operations of a build are specialized for its widest
+    board: a 10 or 16 column build works on 16-bit rows, 32 and 64
+    column builds on 32 and 64-bit ones.
+*/
+#if WIDTH <= 16
+typedef unsigned short ttm_row_t;
+#define ROW_BITS        16
+#elif WIDTH <= 32
+typedef unsigned int ttm_row_t;
+#define ROW_BITS        32
+#elif WIDTH <= 64
+typedef unsigned long long ttm_row_t;
+#define ROW_BITS        64
+#else
+#error WIDTH is too large for a single row word
+#endif
+
+/* Row with columns [0, width) occupied. */
+#define TTM_FULL_ROW(width) \
+    ((ttm_row_t)((ttm_row_t)~(ttm_row_t)0 >> (ROW_BITS - (width))))
+
+#define FULL_ROW        TTM_FULL_ROW(WIDTH)
+
+/*
+    Builds with TTM_COLORS keep which tetrimino every cell of the stack
+    came from, for frontends to colour it. A cell takes a nibble, eight
+    to a word, so a 10 column row takes two words. Collision checks and
+    row clears never read them, they go by the row bitmasks alone.
+*/
+#define TTM_COLOR_WORDS ((WIDTH + 7) / 8)
+
+/*
+    Cells of the gameboard a render callback gets, a byte each: empty,
+    index + 1 of the tetrimino for the active one and, with TTM_COLORS,
+    for the stack, or TTM_CELL_FILLED for a stack cell of no known
+    tetrimino.
+*/
+#define TTM_CELL_EMPTY  0
+#define TTM_CELL_FILLED 8
+
+/* Smallest board side, the I tetrimino has to fit across. */
+#define TTM_MIN_SIZE    4
+
+#if defined(_MSC_VER)
+#define TTM_ALIGNED(n)  __declspec(align(n))
+#else
+#define TTM_ALIGNED(n)  __attribute__((aligned(n)))
+#endif
+
+#define swap_int(a, b)  { int t = (a); (a) = (b); (b) = t; }
+
+/* Timeout of ttm_wait_input_ms that never expires. */
+#define TTM_WAIT_FOREVER    0xFFFFFFFFU
+
+typedef enum UserCommandTag {
+    NOTHING,
+    ROTATE_CW,
+    ROTATE_CCW,
+    MOVE_LEFT,
+    MOVE_RIGHT,
+    SPEEDUP,
+    DROP,
+    QUIT
+} UserCommand;
+
+typedef enum PlayCycleResultTag {
+    QUIT_GAME,
+    END_OF_GAME,
+    CONTINUE_PLAY
+} PlayCycleResult;
+
+typedef struct TetriminoTag {
+    int defx[4];
+    int defy[4];
+    int x;      /* x,y - rotation matrix 0,0 */
+    int y;
+    int box;    /* side of a square box that tetrimino is fits == max(w,h) */
+} Tetrimino;
+
+/*
+    Every orientation of every tetrimino. Orientation k is the spawn
+    orientation rotated k times by 90 degrees (ROTATE_CW) inside its
+    box, i.e. cell (x, y) of the box moves to (box - 1 - y, x).
+*/
+typedef struct TetriminoShapeTag {
+    unsigned char rows[4];  /* row masks within 4x4 matrix, bit c == column c */
+    signed char cx[4];      /* occupied cells, bottom row first */
+    signed char cy[4];
+    signed char bottoms[4]; /* lowest occupied row of each column, -1 if none */
+    signed char left;       /* bounds of occupied cells */
+    signed char right;
+    signed char bottom;
+    signed char top;
+} TetriminoShape;
+
+extern Tetrimino tetriminos[7];
+extern const TetriminoShape tetrimino_shapes[7][4];
+
+/* Most wall and floor kicks a rotation tries, see ttm_kicks. */
+#define TTM_KICKS   5
+
+/* Timings of TtmStats. */
+#define TTM_TIMER_CYCLE     0   /* run_command_cycle, the render included */
+#define TTM_TIMER_RENDER    1   /* render_gameboard */
+#define TTM_TIMER_INPUT     2   /* ttm_read_command_callback */
+#define TTM_TIMERS          3
+
+/* Buckets of a timing histogram, see TtmTimer. */
+#define TTM_STATS_BUCKETS   32
+
+/*
+    Times in cycles of ttm_cycles. Bucket b of the histogram counts
+    times of b significant bits, [2^(b-1), 2^b), the last one also
+    counts all longer ones.
+*/
+typedef struct TtmTimerTag {
+    unsigned long long count;
+    unsigned long long cycles;      /* total */
+    unsigned long long max;
+    unsigned long long hist[TTM_STATS_BUCKETS];
+} TtmTimer;
+
+/*
+    Sub-buckets per power of two of a TtmHdr, values are told apart to
+    within 1/8. Values under 8 have a bucket each.
+*/
+#define TTM_HDR_SUB_BITS    3
+#define TTM_HDR_BUCKETS     240     /* up to 2^32 - 1 */
+
+/*
+    Log-linear histogram of microseconds, in the manner of
+    HdrHistogram. Bucket b holds values up to ttm_hdr_value(b).
+*/
+typedef struct TtmHdrTag {
+    unsigned long long count;
+    unsigned long long total;
+    unsigned long long max;
+    unsigned long long hist[TTM_HDR_BUCKETS];
+} TtmHdr;
+
+/*
+    Counters of a game, kept in builds with TTM_STATS. The engine adds
+    to them and never clears them, the frontend does that when it
+    wants them per game.
+*/
+typedef struct TtmStatsTag {
+    unsigned long long collision_checks;    /* check_collision_at calls */
+    unsigned long long collisions;          /* of them that collided */
+    unsigned long long rotations_rejected;  /* ttm_rotate with no free kick */
+    unsigned long long spawns;              /* spawn_new_tetrimino calls */
+    unsigned long long clears[5];   /* check_and_collapse_rows calls by rows removed */
+    TtmTimer timers[TTM_TIMERS];
+
+    /*
+        Kept by play_loop with a clock, see ttm_now_us in ctetris.c.
+            latency     from ttm_read_command_callback giving a command
+                        to the end of the render of the frame it changed
+            lateness    of the ticks play_loop runs on its 20ms cadence,
+                        behind the time they were due
+    */
+    TtmHdr latency;
+    TtmHdr lateness;
+
+    /* Command being run, not a counter. */
+    unsigned int read_us;           /* when it was read */
+    int read_pending;               /* it was read and is not run yet */
+} TtmStats;
+
+/*
+    State of a single game. Games do not share any state, so any number
+    of them can be run side by side.
+
+    Fields a collision check reads come first and fit the first cache
+    line for the default 10x20 board. Heap allocations should be
+    64-byte aligned to keep it that way.
+*/
+typedef struct TTM_ALIGNED(64) GameStateTag {
+    ttm_row_t board[HEIGHT];        /* rows from height up stay empty */
+    const TetriminoShape *shape;    /* active tetrimino */
+    int pos_x;                      /* position of its 4x4 matrix */
+    int pos_y;
+    int width;                      /* board size, see ttm_set_size */
+    int height;
+    int index;                      /* index into tetriminos[] */
+    int rot;                        /* orientation, 0-3 */
+
+    /*
+        Stack shape, maintained by place_tetrimino and collapse_rows.
+            stack_height    row above the highest occupied cell of the board,
+                            rows from stack_height up are empty
+            column_height   row above the highest occupied cell of a column
+            row_fill        number of occupied cells in a row
+    */
+    int stack_height;
+    unsigned char column_height[WIDTH];
+    unsigned char row_fill[HEIGHT];
+
+    int next_tetrimino;             /* -1 until first spawn or !SHOW_NEXT */
+    int timer_counter;
+    int time_is_up;
+
+    unsigned int rng[4];            /* piece sequence generator state */
+    unsigned char bag;              /* pieces left in the 7-bag, bit per piece */
+    unsigned char randomizer;       /* TTM_UNIFORM or TTM_BAG7 */
+    unsigned char preview;          /* pieces shown after the next one */
+
+    /*
+        Zobrist key of the board and its size, the active and the next
+        tetrimino, maintained by place_tetrimino, collapse_rows and
+        spawn_new_tetrimino. XOR of ttm_size_key, ttm_row_key of every
+        row and ttm_piece_key, position and rotation are not part of it.
+    */
+    unsigned long long key;
+
+    unsigned int pieces;            /* tetriminos locked into the stack */
+    unsigned int lines;             /* rows removed */
+    unsigned int ticks;             /* timer ticks since init_game */
+
+    /*
+        Rows for the next render, see ttm_dirty_rows. Board rows
+        [dirty_low, dirty_high) changed since the last render, the
+        active tetrimino was drawn on [drawn_low, drawn_high) in it.
+    */
+    int dirty_low;
+    int dirty_high;
+    int drawn_low;
+    int drawn_high;
+
+    /* When set, called with every command a cycle consumes. */
+    void (*record)(struct GameStateTag *gs, UserCommand cmd);
+    void *record_ctx;
+
+    TtmStats *stats;                /* NULL or counters, with TTM_STATS */
+
+    void *user;                     /* for use by callbacks */
+
+#if TTM_COLORS
+    /*
+        Nibble c % 8 of colors[r][c / 8] is the cell of row r, column c
+        as a TTM_CELL_ value, 0 where no tetrimino is known. Only cells
+        occupied on board are meaningful.
+    */
+    unsigned int colors[HEIGHT][TTM_COLOR_WORDS];
+#endif
+} GameState;
+
+/*
+    Snapshot of a game: the board, the active tetrimino, the piece
+    generator and the timer. It takes 64 bytes, one cache line, for
+    boards up to 20 rows of 16 columns, see ttm_snapshot. Counters and
+    what is derived from the board, like the stack shape and the key,
+    are not kept. TTM_COLORS builds keep the colors of the stack after
+    that line.
+*/
+typedef struct TTM_ALIGNED(64) TtmSnapshotTag {
+    unsigned int rng[4];
+    ttm_row_t board[HEIGHT];
+    short pos_y;                    /* beyond a byte on boards over 127 rows */
+    signed char pos_x;
+    unsigned char piece;            /* index | rot << 3 */
+    signed char next_tetrimino;
+    unsigned char timer;            /* timer_counter | time_is_up << 7 */
+    unsigned char bag;
+#if TTM_COLORS
+    unsigned int colors[HEIGHT][TTM_COLOR_WORDS];
+#endif
+} TtmSnapshot;
+
+/* Moves ttm_undo_move can take back. */
+#define TTM_UNDO_DEPTH  32
+
+/*
+    Snapshots of the last TTM_UNDO_DEPTH spawns, oldest at first, with
+    the counters a move changes. Ticks keep counting through an undo.
+    Games that are recorded can not be undone.
+*/
+typedef struct TtmUndoTag {
+    TtmSnapshot snaps[TTM_UNDO_DEPTH];
+    unsigned int pieces[TTM_UNDO_DEPTH];
+    unsigned int lines[TTM_UNDO_DEPTH];
+    int first;
+    int count;
+    unsigned int ticks;             /* of the last ttm_undo_track */
+} TtmUndo;
+
+/* Key events a TtmInput queues, a power of two. */
+#define TTM_INPUT_SIZE  64
+
+/* Delayed auto shift and auto repeat rate frontends start with. */
+#ifndef TTM_DAS_MS
+#define TTM_DAS_MS      170
+#endif
+#ifndef TTM_ARR_MS
+#define TTM_ARR_MS      50
+#endif
+
+/* Key of a TtmKeyEvent that is released, or'ed with its command. */
+#define TTM_KEY_UP      0x80
+
+typedef struct TtmKeyEventTag {
+    unsigned int ms;                /* of ttm_now_ms when it happened */
+    unsigned char key;              /* UserCommand, TTM_KEY_UP */
+} TtmKeyEvent;
+
+/*
+    Queue of key events from a frontend to the game. ttm_input_read
+    takes them one command at a time in the order they happened, so a
+    burst of keys is not lost between two reads.
+
+    A held MOVE_LEFT, MOVE_RIGHT or SPEEDUP repeats das ms after it was
+    pressed, then every arr ms, counted from the times of the events,
+    not of the reads. Presses of a key that is already down are the
+    system's own repeat and are left out. A frontend that can not tell
+    when a key is released pushes the release with the press.
+*/
+typedef struct TtmInputTag {
+    TtmKeyEvent events[TTM_INPUT_SIZE];
+    unsigned int head;              /* next event to read */
+    unsigned int tail;              /* next free, head + count */
+    unsigned int das;
+    unsigned int arr;
+    unsigned int down;              /* bit per UserCommand of keys down */
+    int held;                       /* command that repeats or NOTHING */
+    unsigned int repeat_ms;         /* when it repeats next */
+    unsigned int read_ms;           /* when the last command read happened */
+    unsigned int dropped;           /* events pushed to a full queue */
+} TtmInput;
+
+/* GameState.randomizer */
+#define TTM_UNIFORM     0   /* every piece drawn independently */
+#define TTM_BAG7        1   /* pieces drawn from a shuffled bag of all 7 */
+
+int max_int(int a, int b);
+
+void ttm_seed(GameState *gs, unsigned int seed);
+void ttm_seed_stream(GameState *gs, unsigned int seed, unsigned int stream);
+unsigned int ttm_random(GameState *gs);
+unsigned int ttm_random_below(GameState *gs, unsigned int n);
+void ttm_rng_jump(GameState *gs);
+void ttm_rng_long_jump(GameState *gs);
+
+/* Adds a time taken by timer to stats. */
+void ttm_stats_time(TtmStats *stats, int timer, unsigned long long cycles);
+
+/* Adds a value to a histogram. */
+void ttm_hdr_add(TtmHdr *hdr, unsigned int us);
+
+/* Largest value of bucket b of a TtmHdr. */
+unsigned int ttm_hdr_value(int b);
+
+void reset_game_timer(GameState *gs);
+void run_game_timer(GameState *gs);
+
+unsigned long long ttm_row_key(int r, ttm_row_t row);
+unsigned long long ttm_piece_key(int index, int next);
+unsigned long long ttm_size_key(int width, int height);
+
+/*
+    Sets the board size of a game, call before init_game. A side under
+    TTM_MIN_SIZE or over the build's gives WIDTH x HEIGHT instead, so
+    init_game calling it on a game never given a size gets the default.
+    Returns 0 or -1 if the size was out of range.
+*/
+int ttm_set_size(GameState *gs, int width, int height);
+
+/*
+    Adds board rows [low, high) to those the next render passes on as
+    changed. The engine adds the rows it changes, a frontend that lost
+    its frame asks for all of them with ttm_dirty_rows(gs, 0, gs->height).
+*/
+void ttm_dirty_rows(GameState *gs, int low, int high);
+
+/*
+    Updates what is derived from the board after it was set, all rows
+    are dirty. The tetriminos of the cells are not known any more.
+*/
+void update_stack_shape(GameState *gs);
+void collapse_rows(GameState *gs, int rl, int rh);
+int check_and_collapse_rows(GameState *gs);
+
+int check_collision_at(GameState *gs, int x, int y);
+int check_collision(GameState *gs, int landing);
+int check_landing(GameState *gs);
+int ttm_drop_distance(GameState *gs);
+int advance_tetrimino(GameState *gs);
+void rotate_tetrimino(GameState *gs, int angle);
+
+/*
+    SRS wall and floor kicks of tetrimino index from orientation rot to
+    (rot + dir) & 3: pos_x, pos_y offsets in the order they are tried.
+    Returns their number, TTM_KICKS at most.
+*/
+int ttm_kicks(int index, int rot, int dir, signed char (*kicks)[2]);
+int ttm_rotate(GameState *gs, int dir);
+void move_tetrimino(GameState *gs, int offset);
+int draw_tetrimino(GameState *gs);
+void spawn_new_tetrimino(GameState *gs);
+int ttm_preview(const GameState *gs, int *pieces, int n);
+void place_tetrimino(GameState *gs);
+
+/* Stack cell at column x, row y as a TTM_CELL_ value. */
+int ttm_cell(const GameState *gs, int x, int y);
+void ttm_snapshot(const GameState *gs, TtmSnapshot *snap);
+void ttm_restore(GameState *gs, const TtmSnapshot *snap);
+void ttm_undo_init(TtmUndo *undo);
+void ttm_undo_track(TtmUndo *undo, const GameState *gs);
+int ttm_undo_move(TtmUndo *undo, GameState *gs);
+void lock_tetrimino(GameState *gs);
+
+/*
+    Empties the queue and sets its auto shift, arr under a tick is a
+    tick so a held key repeats at most once a tick.
+*/
+void ttm_input_init(TtmInput *in, unsigned int das_ms, unsigned int arr_ms);
+
+/* Queues a key at time ms, returns 0 or -1 if the queue is full. */
+int ttm_input_push(TtmInput *in, int key, unsigned int ms);
+
+/* Takes the next command due at now_ms, NOTHING if there is none. */
+UserCommand ttm_input_read(TtmInput *in, unsigned int now_ms);
+
+/*
+    Milliseconds from now_ms until ttm_input_read has a command, 0 if
+    it has one, TTM_WAIT_FOREVER until a key comes.
+*/
+unsigned int ttm_input_wait_ms(const TtmInput *in, unsigned int now_ms);
+
+int apply_command(GameState *gs, UserCommand cmd);
+int process_user_input(GameState *gs);
+void render_gameboard(GameState *gs);
+PlayCycleResult run_command_cycle(GameState *gs, UserCommand cmd);
+PlayCycleResult run_cycle(GameState *gs);
+PlayCycleResult ttm_step(GameState *gs, UserCommand cmd);
+PlayCycleResult ttm_step_idle(GameState *gs, unsigned int n);
+void init_game(GameState *gs);
+PlayCycleResult play_loop(GameState *gs);
+
+/* Runs games one after another on a single internal GameState. */
+void game_loop();
+
+#endif
@@ -0,0 +1,293 @@
+/* ctetris_ai.c */
+#include "ctetris_ai.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AI_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Shifts a row mask by x columns, negative x shifts towards column 0. */
+#define shift_mask(m, x) \
+    ((x) >= 0 ? (ttm_row_t)((ttm_row_t)(m) << (x)) : (ttm_row_t)((m) >> -(x)))
+
+/*
+    Dellacherie's weights for holes, wells and transitions, the others
+    tuned with ctetris_sim -a. In thousandths.
+*/
+const TtmAiWeights ttm_ai_default_weights = {
+    -20,    /* height */
+    -7899,  /* holes */
+    -20,    /* bumpiness */
+    -3385,  /* wells */
+    -3218,  /* row_transitions */
+    -9349,  /* col_transitions */
+    6000    /* lines */
+};
+
+void ttm_ai_init(TtmAi *ai, const TtmAiWeights *weights) {
+    ai->weights = weights ? *weights : ttm_ai_default_weights;
+    ai->width = WIDTH;
+    ai->height = HEIGHT;
+}
+
+static int score(const TtmAiWeights *w, int height, int holes, int bumpiness,
+        int wells, int row_transitions, int col_transitions, int lines) {
+    return w->height * height + w->holes * holes + w->bumpiness * bumpiness +
+        w->wells * wells + w->row_transitions * row_transitions +
+        w->col_transitions * col_transitions + w->lines * lines;
+}
+
+#ifdef AI_SSE2
+
+#define vand(a, b)      _mm_and_si128((a), (b))
+#define vandnot(a, b)   _mm_andnot_si128((a), (b))     /* ~a & b */
+#define vor(a, b)       _mm_or_si128((a), (b))
+#define vxor(a, b)      _mm_xor_si128((a), (b))
+
+#define AI_CAT(a, b)    AI_CAT2(a, b)
+#define AI_CAT2(a, b)   a##b
+
+#if ROW_BITS > 32
+/* Low halves of the 64-bit lanes of a, then of b, as 32-bit lanes. */
+static __m128i pack64to32(__m128i a, __m128i b) {
+    return _mm_unpacklo_epi64(_mm_shuffle_epi32(a, _MM_SHUFFLE(3, 3, 2, 0)),
+        _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 3, 2, 0)));
+}
+#endif
+
+#if ROW_BITS > 16
+/*
+    32-bit lanes of a, then of b, that fit 16 bits as 16-bit lanes.
+    SSE2 only packs with signed saturation, so they are moved into the
+    signed range and back.
+*/
+static __m128i pack32to16(__m128i a, __m128i b) {
+    const __m128i bias = _mm_set1_epi32(0x8000);
+
+    return _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(a, bias),
+        _mm_sub_epi32(b, bias)), _mm_set1_epi16((short)0x8000));
+}
+#endif
+
+#define LANE_BITS       16
+#include "ctetris_ai_kernel.h"
+#undef LANE_BITS
+
+#if ROW_BITS > 16
+#define LANE_BITS       32
+#include "ctetris_ai_kernel.h"
+#undef LANE_BITS
+#endif
+
+#if ROW_BITS > 32
+#define LANE_BITS       64
+#include "ctetris_ai_kernel.h"
+#undef LANE_BITS
+#endif
+
+/* Runs the kernel of the narrowest lanes the boards of the batch fit. */
+void ttm_ai_evaluate(TtmAi *ai, int count, int rows) {
+#if ROW_BITS > 32
+    if (ai->width > 32)
+        evaluate64(ai, count, rows);
+    else
+#endif
+#if ROW_BITS > 16
+    if (ai->width > 16)
+        evaluate32(ai, count, rows);
+    else
+#endif
+        evaluate16(ai, count, rows);
+}
+
+#else
+
+static int popcount(ttm_row_t v) {
+    int n = 0;
+
+    for (; v; v &= v - 1)
+        ++n;
+
+    return n;
+}
+
+void ttm_ai_evaluate(TtmAi *ai, int count, int rows) {
+    const ttm_row_t full = TTM_FULL_ROW(ai->width);
+    const ttm_row_t top = (ttm_row_t)1 << (ai->width - 1);
+    int j, r;
+
+    for (j = 0; j < count; ++j) {
+        ttm_row_t above = 0, prev = 0;
+        int height = 0, holes = 0, bumpiness = 0, wells = 0;
+        int row_tr = 2 * (ai->height - rows), col_tr = 0;
+
+        for (r = rows - 1; r >= 0; --r) {
+            ttm_row_t row = ai->boards[r][j];
+
+            holes += popcount(~row & above);
+            col_tr += popcount(row ^ prev);
+            row_tr += popcount((row ^ (ttm_row_t)(row << 1 | 1)) & full);
+            row_tr += !(row & top);
+
+            above |= row;
+            height += popcount(above);
+            bumpiness += popcount((above ^ above >> 1) & full >> 1);
+            wells += popcount(~above & (ttm_row_t)(above << 1 | 1) &
+                (above >> 1 | top) & full);
+
+            prev = row;
+        }
+        col_tr += popcount(prev ^ full);
+
+        ai->scores[j] = score(&ai->weights, height, holes, bumpiness, wells,
+            row_tr, col_tr, ai->lines[j]);
+    }
+}
+
+#endif
+
+/*
+    Puts the board placement p leaves into slot j of the batch. Rows
+    from rows up stay empty.
+*/
+static void build_candidate(TtmAi *ai, const GameState *gs,
+        const TtmPlacement *p, int j, int rows) {
+    const TetriminoShape *shape = &tetrimino_shapes[gs->index][p->rot];
+    int r, k, lines = 0;
+    int lo = p->y + shape->bottom, hi = p->y + shape->top;
+
+    for (r = 0; r < rows; ++r)
+        ai->boards[r][j] = gs->board[r];
+
+    for (k = shape->bottom; k <= shape->top; ++k)
+        if (p->y + k < rows)
+            ai->boards[p->y + k][j] |= shift_mask(shape->rows[k], p->x);
+
+    if (hi >= rows)
+        hi = rows - 1;
+
+    /* From the top, so rows below keep their index. */
+    for (r = hi; r >= lo; --r) {
+        if (ai->boards[r][j] == TTM_FULL_ROW(gs->width)) {
+            for (k = r; k < rows - 1; ++k)
+                ai->boards[k][j] = ai->boards[k + 1][j];
+            ai->boards[rows - 1][j] = 0;
+            ++lines;
+        }
+    }
+
+    ai->lines[j] = lines;
+}
+
+int ttm_ai_rows(const GameState *gs) {
+    /* A resting tetrimino reaches at most 4 rows above the stack. */
+    return gs->stack_height + 4 < gs->height ? gs->stack_height + 4 : gs->height;
+}
+
+void ttm_ai_score_batch(TtmAi *ai, const GameState *gs, int first, int count,
+        int lines) {
+    int rows = ttm_ai_rows(gs);
+    int i;
+
+    ai->width = gs->width;
+    ai->height = gs->height;
+
+    for (i = 0; i < count; ++i) {
+        build_candidate(ai, gs, &ai->placements[first + i], i, rows);
+        ai->lines[i] += lines;
+    }
+
+    /* Unused slots of the last SIMD group. */
+    for (; i < TTM_AI_BATCH && (i & 7); ++i) {
+        int r;
+        for (r = 0; r < rows; ++r)
+            ai->boards[r][i] = 0;
+        ai->lines[i] = 0;
+    }
+
+    ttm_ai_evaluate(ai, count, rows);
+}
+
+int ttm_ai_choose(TtmAi *ai, const GameState *gs, TtmPlacement *best) {
+    int n, first, i, found = -1, best_score = 0;
+
+    n = ttm_gen_placements(&ai->gen, gs, ai->placements);
+
+    for (first = 0; first < n; first += TTM_AI_BATCH) {
+        int count = n - first < TTM_AI_BATCH ? n - first : TTM_AI_BATCH;
+
+        ttm_ai_score_batch(ai, gs, first, count, 0);
+
+        for (i = 0; i < count; ++i) {
+            if (found < 0 || ai->scores[i] > best_score) {
+                found = first + i;
+                best_score = ai->scores[i];
+            }
+        }
+    }
+
+    if (found < 0)
+        return -1;
+
+    *best = ai->placements[found];
+    return 0;
+}
+
+void ttm_ai_player_init(TtmAiPlayer *player) {
+    player->len = 0;
+    player->pos = 0;
+    player->pieces = ~0U;
+    player->choose = 0;
+    player->choose_ctx = 0;
+}
+
+/* Makes a path from where the tetrimino is, choosing a target if asked. */
+static int plan(TtmAi *ai, TtmAiPlayer *player, GameState *gs, int choose) {
+    if (choose && player->choose) {
+        if (player->choose(player->choose_ctx, gs, &player->target))
+            return -1;
+        ttm_gen_placements(&ai->gen, gs, ai->placements);
+    } else if (choose) {
+        if (ttm_ai_choose(ai, gs, &player->target))
+            return -1;
+    } else {
+        ttm_gen_placements(&ai->gen, gs, ai->placements);
+    }
+
+    player->len = ttm_placement_path(&ai->gen, gs, &player->target,
+        player->path, TTM_AI_MAX_PATH);
+    player->pos = 0;
+    player->pieces = gs->pieces;
+    player->x = gs->pos_x;
+    player->y = gs->pos_y;
+    player->rot = gs->rot;
+
+    return player->len > 0 ? 0 : -1;
+}
+
+UserCommand ttm_ai_command(TtmAi *ai, TtmAiPlayer *player, GameState *gs) {
+    UserCommand cmd;
+
+    if (player->pieces != gs->pieces) {
+        if (plan(ai, player, gs, 1))
+            return DROP;
+    } else if (player->pos >= player->len || player->x != gs->pos_x ||
+            player->y != gs->pos_y || player->rot != gs->rot) {
+        if (plan(ai, player, gs, 0) && plan(ai, player, gs, 1))
+            return DROP;
+    }
+
+    /* Commands of the path never collide. */
+    cmd = player->path[player->pos++];
+    switch (cmd) {
+        case ROTATE_CW:  player->rot = (player->rot + 1) & 3; break;
+        case ROTATE_CCW: player->rot = (player->rot + 3) & 3; break;
+        case MOVE_LEFT:  --player->x; break;
+        case MOVE_RIGHT: ++player->x; break;
+        case SPEEDUP:    --player->y; break;
+        default: break;
+    }
+
+    return cmd;
+}
@@ -0,0 +1,124 @@
+/* ctetris_ai.h */
+#ifndef CTETRIS_AI_H
+#define CTETRIS_AI_H
+
+#include "ctetris.h"
+#include "ctetris_moves.h"
+
+/*
+    Heuristic player. Every placement of the active tetrimino is scored
+    by a weighted sum of features of the board it leaves, and the best
+    one is played with the commands ttm_placement_path finds.
+
+    Candidate boards are kept a batch at a time with row r of candidate
+    j at boards[r][j], so the features of a whole batch come from the
+    same row operations, one SIMD lane per candidate.
+
+    A frontend plays with it by defining
+        #define ttm_read_command_callback(gs) ttm_ai_command(ai, player, gs)
+*/
+
+/* Candidates scored at once, a multiple of every SIMD lane count. */
+#define TTM_AI_BATCH        64
+
+/* Longest command sequence the player follows. */
+#define TTM_AI_MAX_PATH     (2 * (WIDTH + HEIGHT) + 8)
+
+/*
+    Feature weights, higher scores are better. Features of a board:
+        height              sum of column heights
+        holes               empty cells below the top of their column
+        bumpiness           sum of height differences of neighbouring columns
+        wells               empty cells above the top of their column with
+                            both neighbours, or a wall, higher
+        row_transitions     filled/empty changes along the rows, walls
+                            count as filled
+        col_transitions     filled/empty changes up the columns, from the
+                            floor, which counts as filled, to the top
+        lines               rows removed by the placement
+*/
+typedef struct TtmAiWeightsTag {
+    int height;
+    int holes;
+    int bumpiness;
+    int wells;
+    int row_transitions;
+    int col_transitions;
+    int lines;
+} TtmAiWeights;
+
+extern const TtmAiWeights ttm_ai_default_weights;
+
+/* Weights and work space, can be shared by games run in turn. */
+typedef struct TtmAiTag {
+    TtmAiWeights weights;
+    TtmMoveGen gen;
+    TtmPlacement placements[TTM_MAX_PLACEMENTS];
+
+    /* Batch of candidate boards, see ttm_ai_evaluate. */
+    ttm_row_t boards[HEIGHT][TTM_AI_BATCH];
+    int width;              /* of the boards, WIDTH x HEIGHT until set */
+    int height;
+    int lines[TTM_AI_BATCH];
+    int scores[TTM_AI_BATCH];
+} TtmAi;
+
+/* Per game state of the player. */
+typedef struct TtmAiPlayerTag {
+    TtmPlacement target;
+    UserCommand path[TTM_AI_MAX_PATH];
+    int len;
+    int pos;
+    unsigned int pieces;    /* gs->pieces the path was made for */
+    int x;                  /* where the path has the tetrimino now */
+    int y;
+    int rot;
+
+    /* Picks targets instead of ttm_ai_choose when set. */
+    int (*choose)(void *ctx, const GameState *gs, TtmPlacement *best);
+    void *choose_ctx;
+} TtmAiPlayer;
+
+/* Sets the weights, ttm_ai_default_weights if NULL, and the largest board. */
+void ttm_ai_init(TtmAi *ai, const TtmAiWeights *weights);
+
+/*
+    Scores candidates [0, count) of ai->boards, ai->width x ai->height
+    boards, into ai->scores. Rows from rows up must be empty on all of
+    them. ai->lines holds rows each one removed.
+
+    With SSE2 the kernel is the one of the narrowest lanes, 16, 32 or
+    64 bits, that ai->width fits, whatever the row word of the build.
+*/
+void ttm_ai_evaluate(TtmAi *ai, int count, int rows);
+
+/* Rows the boards placements on gs leave can occupy. */
+int ttm_ai_rows(const GameState *gs);
+
+/*
+    Scores placements [first, first + count) of ai->placements on gs,
+    count at most TTM_AI_BATCH, and sets the board size of the batch.
+    Slot j of the batch gets the board of placement first + j, ai->lines
+    gets lines plus the rows it removed, which is what the lines weight
+    scores.
+*/
+void ttm_ai_score_batch(TtmAi *ai, const GameState *gs, int first, int count,
+    int lines);
+
+/*
+    Picks the best placement of the active tetrimino of gs, leaves
+    ai->gen ready for ttm_placement_path.
+    Returns 0 or -1 if the tetrimino has no placement.
+*/
+int ttm_ai_choose(TtmAi *ai, const GameState *gs, TtmPlacement *best);
+
+/* Starts a new game. */
+void ttm_ai_player_init(TtmAiPlayer *player);
+
+/*
+    Next command of the player. The path is made when a tetrimino spawns
+    and made again to the same target if gravity moved the tetrimino.
+*/
+UserCommand ttm_ai_command(TtmAi *ai, TtmAiPlayer *player, GameState *gs);
+
+#endif
@@ -0,0 +1,145 @@
+/* ctetris_ai_kernel.h */
+
+/*
+    SSE2 kernel of ttm_ai_evaluate on LANE_BITS wide lanes, included by
+    ctetris_ai.c once for every lane width up to ROW_BITS. It defines
+    evaluate16, evaluate32 or evaluate64.
+
+    Rows of the batch are ttm_row_t. A kernel narrower than that packs
+    them into its lanes as it loads them, so a 10 column board of a 64
+    column build is scored 8 candidates an instruction instead of 2.
+*/
+
+#if LANE_BITS == 16
+#define LANES           8
+#define lane_t          unsigned short
+#define vset1(x)        _mm_set1_epi16((short)(x))
+#define vadd(a, b)      _mm_add_epi16((a), (b))
+#define vsub(a, b)      _mm_sub_epi16((a), (b))
+#define vsrl(a, n)      _mm_srli_epi16((a), (n))
+#define vsll(a, n)      _mm_slli_epi16((a), (n))
+#define vsrlv(a, n)     _mm_srl_epi16((a), (n))
+#elif LANE_BITS == 32
+#define LANES           4
+#define lane_t          unsigned int
+#define vset1(x)        _mm_set1_epi32((int)(x))
+#define vadd(a, b)      _mm_add_epi32((a), (b))
+#define vsub(a, b)      _mm_sub_epi32((a), (b))
+#define vsrl(a, n)      _mm_srli_epi32((a), (n))
+#define vsll(a, n)      _mm_slli_epi32((a), (n))
+#define vsrlv(a, n)     _mm_srl_epi32((a), (n))
+#else
+#define LANES           2
+#define lane_t          unsigned long long
+#define vset1(x)        _mm_set1_epi64x((long long)(x))
+#define vadd(a, b)      _mm_add_epi64((a), (b))
+#define vsub(a, b)      _mm_sub_epi64((a), (b))
+#define vsrl(a, n)      _mm_srli_epi64((a), (n))
+#define vsll(a, n)      _mm_slli_epi64((a), (n))
+#define vsrlv(a, n)     _mm_srl_epi64((a), (n))
+#endif
+
+/* Rows of candidates [first, first + LANES) in the lanes. */
+static __m128i AI_CAT(vload, LANE_BITS)(const ttm_row_t *p) {
+#if LANE_BITS == ROW_BITS
+    return _mm_loadu_si128((const __m128i *)p);
+#elif LANE_BITS == 32
+    return pack64to32(_mm_loadu_si128((const __m128i *)p),
+        _mm_loadu_si128((const __m128i *)(p + 2)));
+#elif ROW_BITS == 32
+    return pack32to16(_mm_loadu_si128((const __m128i *)p),
+        _mm_loadu_si128((const __m128i *)(p + 4)));
+#else
+    return pack32to16(
+        pack64to32(_mm_loadu_si128((const __m128i *)p),
+            _mm_loadu_si128((const __m128i *)(p + 2))),
+        pack64to32(_mm_loadu_si128((const __m128i *)(p + 4)),
+            _mm_loadu_si128((const __m128i *)(p + 6))));
+#endif
+}
+
+/* Set bits of every lane, bit-sliced. */
+static __m128i AI_CAT(vpopcount, LANE_BITS)(__m128i v) {
+    v = vsub(v, vand(vsrl(v, 1), vset1(0x5555555555555555ULL)));
+    v = vadd(vand(v, vset1(0x3333333333333333ULL)),
+        vand(vsrl(v, 2), vset1(0x3333333333333333ULL)));
+    v = vand(vadd(v, vsrl(v, 4)), vset1(0x0F0F0F0F0F0F0F0FULL));
+#if LANE_BITS == 16
+    v = vand(vadd(v, vsrl(v, 8)), vset1(0xFF));
+#elif LANE_BITS == 32
+    v = vadd(v, vsrl(v, 8));
+    v = vand(vadd(v, vsrl(v, 16)), vset1(0xFF));
+#else
+    v = _mm_sad_epu8(v, _mm_setzero_si128());
+#endif
+    return v;
+}
+
+#define vload       AI_CAT(vload, LANE_BITS)
+#define vpopcount   AI_CAT(vpopcount, LANE_BITS)
+
+static void AI_CAT(evaluate, LANE_BITS)(TtmAi *ai, int count, int rows) {
+    const __m128i full = vset1(TTM_FULL_ROW(ai->width));
+    const __m128i inner = vset1(TTM_FULL_ROW(ai->width) >> 1);
+    const __m128i top = vset1((ttm_row_t)1 << (ai->width - 1));
+    const __m128i top_shift = _mm_cvtsi32_si128(ai->width - 1);
+    const __m128i one = vset1(1);
+    int first, r, i;
+
+    for (first = 0; first < count; first += LANES) {
+        __m128i above = _mm_setzero_si128();   /* OR of rows above */
+        __m128i prev = _mm_setzero_si128();    /* row above */
+        __m128i height = _mm_setzero_si128();
+        __m128i holes = _mm_setzero_si128();
+        __m128i bumpiness = _mm_setzero_si128();
+        __m128i wells = _mm_setzero_si128();
+        __m128i row_tr = _mm_setzero_si128();
+        __m128i col_tr = _mm_setzero_si128();
+        lane_t f[6][LANES];
+
+        for (r = rows - 1; r >= 0; --r) {
+            __m128i row = vload(&ai->boards[r][first]);
+
+            holes = vadd(holes, vpopcount(vandnot(row, above)));
+            col_tr = vadd(col_tr, vpopcount(vxor(row, prev)));
+            row_tr = vadd(row_tr, vpopcount(vand(vxor(row, vor(vsll(row, 1), one)), full)));
+            row_tr = vadd(row_tr, vsrlv(vandnot(row, top), top_shift));
+
+            /* Column c is below its top in every row where bit c is set. */
+            above = vor(above, row);
+            height = vadd(height, vpopcount(above));
+            bumpiness = vadd(bumpiness,
+                vpopcount(vand(vxor(above, vsrl(above, 1)), inner)));
+            wells = vadd(wells, vpopcount(vand(vandnot(above,
+                vand(vor(vsll(above, 1), one), vor(vsrl(above, 1), top))), full)));
+
+            prev = row;
+        }
+        col_tr = vadd(col_tr, vpopcount(vxor(prev, full)));
+
+        _mm_storeu_si128((__m128i *)f[0], height);
+        _mm_storeu_si128((__m128i *)f[1], holes);
+        _mm_storeu_si128((__m128i *)f[2], bumpiness);
+        _mm_storeu_si128((__m128i *)f[3], wells);
+        _mm_storeu_si128((__m128i *)f[4], row_tr);
+        _mm_storeu_si128((__m128i *)f[5], col_tr);
+
+        /* Rows above are empty and have a transition at each wall. */
+        for (i = 0; i < LANES; ++i)
+            ai->scores[first + i] = score(&ai->weights, (int)f[0][i],
+                (int)f[1][i], (int)f[2][i], (int)f[3][i],
+                (int)f[4][i] + 2 * (ai->height - rows), (int)f[5][i],
+                ai->lines[first + i]);
+    }
+}
+
+#undef LANES
+#undef lane_t
+#undef vset1
+#undef vadd
+#undef vsub
+#undef vsrl
+#undef vsll
+#undef vsrlv
+#undef vload
+#undef vpopcount
@@ -0,0 +1,610 @@
+/* ctetris_bench.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HAVE_RDTSC      1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC      1
+#else
+#define HAVE_RDTSC      0
+#endif
+
+#include "ctetris.h"
+#include "ctetris_ai.h"
+#include "ctetris_moves.h"
+#include "ctetris_pool.h"
+#include "ctetris_search.h"
+
+UserCommand bench_script(GameState *gs);
+
+#define ttm_read_command_callback(gs) bench_script(gs)
+
+#include "ctetris.c"
+
+/* Inputs a benchmark cycles through, a power of two. */
+#define BENCH_CASES     1024
+
+/* Minimum time of one measurement and measurements per benchmark. */
+#define BENCH_MIN_SECONDS   0.05
+#define BENCH_RUNS          5
+
+typedef struct BenchCaseTag {
+    int x;
+    int y;
+    int index;
+    int rot;
+    int reset;                      /* clear the board before this one */
+} BenchCase;
+
+typedef struct BenchTag {
+    const char *name;
+    void (*setup)();
+    long (*run)(long n);           /* returns ops done, at least n */
+} Bench;
+
+/* Board of the benchmarks, WIDTH x HEIGHT unless set with -s. */
+int bench_width = WIDTH;
+int bench_height = HEIGHT;
+
+GameState bench_game;
+GameState bench_saved;
+BenchCase bench_cases[BENCH_CASES];
+volatile unsigned int bench_sink;
+
+unsigned int bench_rng = 2463534242U;
+
+unsigned int bench_random(unsigned int n) {
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 17;
+    bench_rng ^= bench_rng << 5;
+    return bench_rng % n;
+}
+
+/* Fills rows [0, rows) at random, no row is left full. */
+void fill_board(GameState *gs, int rows) {
+    int i, c;
+
+    for (i = 0; i < HEIGHT; ++i) {
+        gs->board[i] = 0;
+        if (i >= rows)
+            continue;
+        for (c = 0; c < bench_width; ++c)
+            if (bench_random(2))
+                gs->board[i] |= (ttm_row_t)1 << c;
+        gs->board[i] &= ~((ttm_row_t)1 << bench_random(bench_width));
+    }
+
+    update_stack_shape(gs);
+}
+
+void set_case(GameState *gs, const BenchCase *c) {
+    gs->pos_x = c->x;
+    gs->pos_y = c->y;
+    gs->index = c->index;
+    gs->rot = c->rot;
+    gs->shape = &tetrimino_shapes[c->index][c->rot];
+}
+
+/* Any position, including ones past the walls and the floor. */
+void random_cases() {
+    int i;
+
+    for (i = 0; i < BENCH_CASES; ++i) {
+        bench_cases[i].x = (int)bench_random(bench_width + 2) - 2;
+        bench_cases[i].y = (int)bench_random(bench_height) - 2;
+        bench_cases[i].index = bench_random(7);
+        bench_cases[i].rot = bench_random(4);
+        bench_cases[i].reset = 0;
+    }
+}
+
+void setup_sparse() {
+    ttm_seed(&bench_game, 1);
+    init_game(&bench_game);
+    fill_board(&bench_game, bench_height / 3);
+    random_cases();
+}
+
+long run_check_collision(long n) {
+    GameState *gs = &bench_game;
+    unsigned int hits = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        const BenchCase *c = &bench_cases[i & (BENCH_CASES - 1)];
+        gs->shape = &tetrimino_shapes[c->index][c->rot];
+        hits += check_collision_at(gs, c->x, c->y);
+    }
+
+    bench_sink += hits;
+    return n;
+}
+
+long run_drop_distance(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        set_case(gs, &bench_cases[i & (BENCH_CASES - 1)]);
+        if (!check_collision(gs, 0))
+            sum += ttm_drop_distance(gs);
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/* Rotation as a command does it, trying kicks until one is free. */
+long run_rotate_tetrimino(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        set_case(gs, &bench_cases[i & (BENCH_CASES - 1)]);
+        sum += apply_command(gs, ROTATE_CW);
+        sum += gs->rot;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/* No full rows, only the rows under the piece are checked. */
+long run_collapse_sparse(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        set_case(gs, &bench_cases[i & (BENCH_CASES - 1)]);
+        sum += check_and_collapse_rows(gs);
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/* Bottom four rows full under a vertical I, removed every time. */
+void setup_dense() {
+    int i;
+
+    setup_sparse();
+    fill_board(&bench_game, bench_height * 2 / 3);
+    for (i = 0; i < 4; ++i)
+        bench_game.board[i] = TTM_FULL_ROW(bench_width);
+    update_stack_shape(&bench_game);
+
+    for (i = 0; i < BENCH_CASES; ++i) {
+        bench_cases[i].x = (int)bench_random(bench_width) - 2;
+        bench_cases[i].y = 0;
+        bench_cases[i].index = 0;
+        bench_cases[i].rot = 1;
+    }
+
+    bench_saved = bench_game;
+}
+
+/* Includes restoring the board, compare with state_copy. */
+long run_collapse_dense(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        *gs = bench_saved;
+        set_case(gs, &bench_cases[i & (BENCH_CASES - 1)]);
+        sum += check_and_collapse_rows(gs);
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+long run_state_copy(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        *gs = bench_saved;
+        set_case(gs, &bench_cases[i & (BENCH_CASES - 1)]);
+        sum += gs->stack_height;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/*
+    Pieces dropped in random columns, as a game would stack them.
+    The board is cleared once the stack gets near the top.
+*/
+void setup_place() {
+    GameState *gs = &bench_game;
+    int i;
+
+    ttm_seed(gs, 1);
+    init_game(gs);
+
+    for (i = 0; i < BENCH_CASES; ++i) {
+        BenchCase *c = &bench_cases[i];
+
+        c->reset = gs->stack_height > bench_height - 6;
+        if (c->reset)
+            init_game(gs);
+
+        c->index = bench_random(7);
+        c->rot = bench_random(4);
+        do {
+            c->x = (int)bench_random(bench_width + 2) - 2;
+            c->y = bench_height - 4;
+            set_case(gs, c);
+        } while (check_collision(gs, 0));
+
+        c->y -= ttm_drop_distance(gs);
+        set_case(gs, c);
+        place_tetrimino(gs);
+    }
+
+    /* Replays from an empty board. */
+    bench_cases[0].reset = 1;
+}
+
+long run_place_tetrimino(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+    int r;
+
+    for (i = 0; i < n; ++i) {
+        const BenchCase *c = &bench_cases[i & (BENCH_CASES - 1)];
+        if (c->reset) {
+            for (r = 0; r < HEIGHT; ++r)
+                gs->board[r] = 0;
+            update_stack_shape(gs);
+        }
+        set_case(gs, c);
+        place_tetrimino(gs);
+        sum += gs->stack_height;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+void setup_spawn() {
+    ttm_seed(&bench_game, 1);
+    init_game(&bench_game);
+}
+
+long run_spawn_new_tetrimino(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        spawn_new_tetrimino(gs);
+        sum += gs->index;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/* All placements of a spawned piece on a third-full board. */
+long run_gen_placements(long n) {
+    static TtmMoveGen gen;
+    static TtmPlacement placements[TTM_MAX_PLACEMENTS];
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        const BenchCase *c = &bench_cases[i & (BENCH_CASES - 1)];
+        gs->index = c->index;
+        gs->rot = 0;
+        gs->pos_x = (bench_width - tetriminos[c->index].box) / 2;
+        gs->pos_y = bench_height - 2;
+        sum += ttm_gen_placements(&gen, gs, placements);
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+TtmAi bench_ai;
+int bench_ai_rows;
+
+/* A batch of third-full candidate boards. */
+void setup_ai_batch() {
+    GameState *gs = &bench_game;
+    int i, r;
+
+    setup_sparse();
+    ttm_ai_init(&bench_ai, NULL);
+    bench_ai.width = bench_width;
+    bench_ai.height = bench_height;
+    bench_ai_rows = bench_height / 3 + 4 < bench_height ?
+        bench_height / 3 + 4 : bench_height;
+
+    for (i = 0; i < TTM_AI_BATCH; ++i) {
+        fill_board(gs, bench_height / 3);
+        for (r = 0; r < bench_ai_rows; ++r)
+            bench_ai.boards[r][i] = gs->board[r];
+        bench_ai.lines[i] = 0;
+    }
+}
+
+/* One op is one candidate. */
+long run_ai_evaluate(long n) {
+    unsigned int sum = 0;
+    long done;
+
+    for (done = 0; done < n; done += TTM_AI_BATCH) {
+        ttm_ai_evaluate(&bench_ai, TTM_AI_BATCH, bench_ai_rows);
+        sum += bench_ai.scores[done & (TTM_AI_BATCH - 1)];
+    }
+
+    bench_sink += sum;
+    return done;
+}
+
+void setup_ai_choose() {
+    setup_sparse();
+    ttm_ai_init(&bench_ai, NULL);
+}
+
+/* Best placement of a spawned piece, one op is one piece. */
+long run_ai_choose(long n) {
+    GameState *gs = &bench_game;
+    TtmPlacement best;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        const BenchCase *c = &bench_cases[i & (BENCH_CASES - 1)];
+        gs->index = c->index;
+        gs->rot = 0;
+        gs->pos_x = (bench_width - tetriminos[c->index].box) / 2;
+        gs->pos_y = bench_height - 2;
+        if (!ttm_ai_choose(&bench_ai, gs, &best))
+            sum += best.x;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+TtmSearch bench_search;
+int bench_search_ready;
+
+void setup_search() {
+    TtmSearchConfig config;
+
+    setup_sparse();
+    if (bench_search_ready)
+        return;
+
+    /* Narrow and on one thread, so a run of 1000 ops stays short. */
+    ttm_search_default_config(&config);
+    config.beam = 8;
+    config.preview = 1;
+    config.threads = 1;
+    config.budget = 0;
+    if (ttm_search_init(&bench_search, &config, NULL))
+        exit(1);
+    bench_search_ready = 1;
+}
+
+/* Lookahead placement of a spawned piece, one op is one piece. */
+long run_search_choose(long n) {
+    GameState *gs = &bench_game;
+    TtmPlacement best;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        const BenchCase *c = &bench_cases[i & (BENCH_CASES - 1)];
+        gs->index = c->index;
+        gs->next_tetrimino = bench_cases[(i + 1) & (BENCH_CASES - 1)].index;
+        gs->rot = 0;
+        gs->pos_x = (bench_width - tetriminos[c->index].box) / 2;
+        gs->pos_y = bench_height - 2;
+        if (!ttm_search_choose(&bench_search, gs, &best))
+            sum += best.x;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+TtmSnapshot bench_snaps[2];
+
+void setup_snapshot() {
+    setup_dense();
+    ttm_snapshot(&bench_game, &bench_snaps[0]);
+    bench_game.board[bench_height / 2] = 0;
+    ttm_snapshot(&bench_game, &bench_snaps[1]);
+}
+
+long run_snapshot(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        gs->pos_x = (int)(i & 3);
+        ttm_snapshot(gs, &bench_snaps[i & 1]);
+        sum += bench_snaps[i & 1].board[0];
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/* Includes rebuilding the stack shape and the key. */
+long run_restore(long n) {
+    GameState *gs = &bench_game;
+    unsigned int sum = 0;
+    long i;
+
+    for (i = 0; i < n; ++i) {
+        ttm_restore(gs, &bench_snaps[i & 1]);
+        sum += gs->stack_height;
+    }
+
+    bench_sink += sum;
+    return n;
+}
+
+/*
+    Fixed input: a command every few ticks, mostly moves towards one
+    side and rotations, then a drop.
+*/
+UserCommand bench_script(GameState *gs) {
+    static const UserCommand script[16] = {
+        ROTATE_CW, MOVE_LEFT, NOTHING, MOVE_LEFT, MOVE_LEFT, SPEEDUP, DROP,
+        NOTHING, MOVE_RIGHT, ROTATE_CCW, MOVE_RIGHT, MOVE_RIGHT, MOVE_RIGHT,
+        SPEEDUP, SPEEDUP, DROP
+    };
+    unsigned int t = gs->ticks + gs->pieces * 5;
+
+    return t & 3 ? NOTHING : script[(t >> 2) & 15];
+}
+
+/* Whole games through play_loop, one op is one tick. */
+long run_game(long n) {
+    GameState *gs = &bench_game;
+    unsigned int games = 0;
+    long ticks = 0;
+
+    while (ticks < n) {
+        ttm_seed_stream(gs, 1, games++);
+        play_loop(gs);
+        ticks += gs->ticks;
+    }
+
+    bench_sink += games;
+    return ticks;
+}
+
+Bench benches[] = {
+    { "check_collision",              setup_sparse, run_check_collision },
+    { "ttm_drop_distance",            setup_sparse, run_drop_distance },
+    { "rotate_tetrimino",             setup_sparse, run_rotate_tetrimino },
+    { "check_and_collapse_rows/sparse", setup_sparse, run_collapse_sparse },
+    { "check_and_collapse_rows/dense",  setup_dense, run_collapse_dense },
+    { "state_copy",                   setup_dense, run_state_copy },
+    { "ttm_snapshot",                 setup_snapshot, run_snapshot },
+    { "ttm_restore",                  setup_snapshot, run_restore },
+    { "place_tetrimino",              setup_place, run_place_tetrimino },
+    { "spawn_new_tetrimino",          setup_spawn, run_spawn_new_tetrimino },
+    { "ttm_gen_placements",           setup_sparse, run_gen_placements },
+    { "ttm_ai_evaluate",              setup_ai_batch, run_ai_evaluate },
+    { "ttm_ai_choose",                setup_ai_choose, run_ai_choose },
+    { "ttm_search_choose/beam8",      setup_search, run_search_choose },
+    { "game/tick",                    setup_spawn, run_game },
+};
+
+unsigned long long read_cycles() {
+#if HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+void run_bench(const Bench *b, double min_seconds) {
+    double t, best = 0, best_cycles = 0;
+    unsigned long long cycles;
+    long n = 1000, ops;
+    int i;
+
+    b->setup();
+
+    /* Grow n until one run takes long enough to time. */
+    while (1) {
+        t = ttm_seconds();
+        b->run(n);
+        t = ttm_seconds() - t;
+        if (t >= min_seconds || n > (1L << 30))
+            break;
+        n *= t > 0 ? (t * 4 < min_seconds ? 4 : 2) : 8;
+    }
+
+    for (i = 0; i < BENCH_RUNS; ++i) {
+        b->setup();
+        t = ttm_seconds();
+        cycles = read_cycles();
+        ops = b->run(n);
+        cycles = read_cycles() - cycles;
+        t = ttm_seconds() - t;
+        if (!i || t / ops < best) {
+            best = t / ops;
+            best_cycles = (double)cycles / ops;
+        }
+    }
+
+    if (HAVE_RDTSC)
+        printf("%-32s %10.2f %10.1f\n", b->name, best * 1e9, best_cycles);
+    else
+        printf("%-32s %10.2f %10s\n", b->name, best * 1e9, "-");
+}
+
+void usage() {
+    fprintf(stderr,
+        "usage: ctetris_bench [-m seconds] [-s WIDTHxHEIGHT] [name...]\n"
+        "  -m  minimum time of a measurement (default %.2f)\n"
+        "  -s  board size, at most the largest of the build (default %dx%d)\n"
+        "  runs benchmarks whose names start with one of the names, or all\n"
+        "  the largest board is set at build time with -DWIDTH= -DHEIGHT=\n",
+        BENCH_MIN_SECONDS, WIDTH, HEIGHT);
+}
+
+int main(int argc, char **argv) {
+    double min_seconds = BENCH_MIN_SECONDS;
+    int i, j, names = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            min_seconds = atof(argv[++i]);
+            argv[i - 1] = argv[i] = NULL;
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc &&
+                sscanf(argv[i + 1], "%dx%d", &bench_width, &bench_height) == 2) {
+            argv[i] = argv[i + 1] = NULL;
+            ++i;
+        } else if (argv[i][0] == '-') {
+            usage();
+            return 2;
+        } else {
+            ++names;
+        }
+    }
+
+    /* init_game keeps the size of bench_game. */
+    if (ttm_set_size(&bench_game, bench_width, bench_height)) {
+        usage();
+        return 2;
+    }
+
+    printf("board %dx%d of a %dx%d build, best of %d, %s\n", bench_width,
+        bench_height, WIDTH, HEIGHT, BENCH_RUNS,
+        HAVE_RDTSC ? "cycles by rdtsc" : "no cycle counter");
+    printf("%-32s %10s %10s\n", "benchmark", "ns/op", "cycles/op");
+
+    for (j = 0; j < (int)(sizeof(benches) / sizeof(benches[0])); ++j) {
+        int run = !names;
+        for (i = 1; i < argc && !run; ++i)
+            run = argv[i] && !strncmp(benches[j].name, argv[i], strlen(argv[i]));
+        if (run)
+            run_bench(&benches[j], min_seconds);
+    }
+
+    return 0;
+}
@@ -0,0 +1,391 @@
+/* ctetris_moves.c */
+#include "ctetris_moves.h"
+
+/* Shifts a position mask by x columns, negative x shifts towards 0. */
+#define shift_mask(m, x) \
+    ((x) >= 0 ? (ttm_row_t)((ttm_row_t)(m) << (x)) : (ttm_row_t)((m) >> -(x)))
+
+#define SHAPE(g, r)     (&tetrimino_shapes[(g)->index][(r)])
+
+/*
+    Positions of orientation r on piece row Y that collide with
+    neither walls, floor nor stack.
+*/
+static ttm_row_t valid_positions(const GameState *gs, const TetriminoShape *shape,
+        int Y) {
+    ttm_row_t m = TTM_FULL_ROW(gs->width) >> (shape->right - shape->left);
+    int pos_y = Y - TTM_MOVES_Y0;
+    int k, j;
+
+    for (k = shape->bottom; k <= shape->top; ++k) {
+        int row = pos_y + k;
+        if (row < 0)
+            return 0;
+        if (row >= gs->height)
+            break;
+        for (j = shape->left; j <= shape->right; ++j)
+            if (shape->rows[k] >> j & 1)
+                m &= ~(ttm_row_t)(gs->board[row] >> (j - shape->left));
+    }
+
+    return m;
+}
+
+/* Everything m can reach on one row by moving left and right. */
+static ttm_row_t spread(ttm_row_t m, ttm_row_t valid) {
+    ttm_row_t prev;
+
+    do {
+        prev = m;
+        m |= (ttm_row_t)((m << 1) | (m >> 1)) & valid;
+    } while (m != prev);
+
+    return m;
+}
+
+static int same_cells(const TetriminoShape *a, const TetriminoShape *b) {
+    int k;
+
+    if (a->top - a->bottom != b->top - b->bottom ||
+            a->right - a->left != b->right - b->left)
+        return 0;
+
+    for (k = 0; k <= a->top - a->bottom; ++k)
+        if (a->rows[a->bottom + k] >> a->left != b->rows[b->bottom + k] >> b->left)
+            return 0;
+
+    return 1;
+}
+
+/*
+    Rotates positions m of orientation r on row Y one step, d is 0 for
+    ROTATE_CW and 1 for ROTATE_CCW. Every position goes to the first of
+    its kicks that is valid, out[t] gets those of kick t, on row
+    Y + kicks[t][1]. Rows past the last are not valid, like ttm_rotate.
+*/
+static void rotate_positions(const TtmMoveGen *g, int r, int Y, int d,
+        ttm_row_t m, ttm_row_t *out) {
+    const ttm_row_t *valid = g->valid[(r + (d ? 3 : 1)) & 3];
+    int t;
+
+    for (t = 0; t < g->kick_count; ++t) {
+        int x = g->kicks[r][d][t][0], Y2 = Y + g->kicks[r][d][t][1];
+
+        if (!m || Y2 < 0 || Y2 >= g->rows) {
+            out[t] = 0;
+            continue;
+        }
+
+        out[t] = shift_mask(m, x) & valid[Y2];
+        m &= ~shift_mask(valid[Y2], -x);
+    }
+}
+
+int ttm_gen_placements(TtmMoveGen *g, const GameState *gs, TtmPlacement *out) {
+    const TetriminoShape *start = &tetrimino_shapes[gs->index][gs->rot];
+    ttm_row_t kicked[TTM_KICKS];
+    unsigned char dirty[TTM_MOVES_ROWS];
+    int r, s, d, k, Y, i, count = 0;
+    int start_y = gs->pos_y + TTM_MOVES_Y0;
+    int start_i = gs->pos_x + start->left;
+
+    g->index = gs->index;
+    g->rows = gs->height + 2;
+
+    for (r = 0; r < 4; ++r) {
+        g->same[r] = 0;
+        for (d = 0; d < 2; ++d) {
+            /* Rotation keeps pos_x, so the leftmost cell moves too. */
+            int x = SHAPE(g, (r + (d ? 3 : 1)) & 3)->left - SHAPE(g, r)->left;
+
+            g->kick_count = ttm_kicks(g->index, r, d ? -1 : 1, g->kicks[r][d]);
+            for (k = 0; k < g->kick_count; ++k)
+                g->kicks[r][d][k][0] = (signed char)(g->kicks[r][d][k][0] + x);
+        }
+        for (s = 0; s < 4; ++s)
+            if (s != r && same_cells(SHAPE(g, r), SHAPE(g, s)))
+                g->same[r] |= 1 << s;
+
+        for (Y = 0; Y < g->rows; ++Y) {
+            g->valid[r][Y] = valid_positions(gs, SHAPE(g, r), Y);
+            g->reach[r][Y] = 0;
+        }
+    }
+
+    if (start_y < 0 || start_y >= g->rows || start_i < 0 ||
+            start_i >= WIDTH || !(g->valid[gs->rot][start_y] >> start_i & 1))
+        return 0;
+
+    g->reach[gs->rot][start_y] = (ttm_row_t)1 << start_i;
+
+    /*
+        Each row is closed under moves and rotations and then handed
+        down to the row below. Only a kick moves a piece up, then the
+        rows from the one it reached down are gone over again, skipping
+        those that did not change.
+    */
+    for (Y = 0; Y < g->rows; ++Y)
+        dirty[Y] = 0;
+    dirty[start_y] = 1;
+
+    Y = start_y;
+    while (Y >= 0) {
+        int changed, up = -1;
+
+        if (!dirty[Y]) {
+            --Y;
+            continue;
+        }
+        dirty[Y] = 0;
+
+        do {
+            changed = 0;
+            for (r = 0; r < 4; ++r) {
+                ttm_row_t m = g->reach[r][Y];
+                if (!m)
+                    continue;
+
+                m = spread(m, g->valid[r][Y]);
+                if (m != g->reach[r][Y]) {
+                    g->reach[r][Y] = m;
+                    changed = 1;
+                }
+
+                for (d = 0; d < 2; ++d) {
+                    s = (r + (d ? 3 : 1)) & 3;
+                    rotate_positions(g, r, Y, d, m, kicked);
+                    for (k = 0; k < g->kick_count; ++k) {
+                        int Y2 = Y + g->kicks[r][d][k][1];
+                        if (!kicked[k] || !(kicked[k] & ~g->reach[s][Y2]))
+                            continue;
+                        g->reach[s][Y2] |= kicked[k];
+                        if (Y2 == Y) {
+                            changed = 1;
+                        } else {
+                            dirty[Y2] = 1;
+                            if (Y2 > up)
+                                up = Y2;
+                        }
+                    }
+                }
+            }
+        } while (changed);
+
+        if (Y > 0) {
+            for (r = 0; r < 4; ++r) {
+                ttm_row_t m = g->reach[r][Y] & g->valid[r][Y - 1];
+                if (m & ~g->reach[r][Y - 1]) {
+                    g->reach[r][Y - 1] |= m;
+                    dirty[Y - 1] = 1;
+                }
+            }
+        }
+
+        Y = up > Y ? up : Y - 1;
+    }
+
+    for (r = 0; r < 4; ++r) {
+        const TetriminoShape *shape = SHAPE(g, r);
+
+        for (Y = 0; Y < g->rows; ++Y) {
+            ttm_row_t rest = g->reach[r][Y];
+            if (Y > 0)
+                rest &= ~g->valid[r][Y - 1];
+
+            /* Reported already by a lower orientation with the same cells. */
+            for (s = 0; s < r; ++s) {
+                int y2 = Y + shape->bottom - SHAPE(g, s)->bottom;
+                if ((g->same[r] >> s & 1) && y2 >= 0 && y2 < g->rows)
+                    rest &= ~g->reach[s][y2];
+            }
+
+            for (i = 0; rest; ++i, rest >>= 1) {
+                if (rest & 1) {
+                    out[count].x = (signed char)(i - shape->left);
+                    out[count].y = (short)(Y - TTM_MOVES_Y0);
+                    out[count].rot = (signed char)r;
+                    ++count;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/* Marks the command that reached each new position of a layer. */
+static void mark_via(TtmMoveGen *g, int r, int Y, ttm_row_t m, int via) {
+    int i;
+
+    for (i = 0; m; ++i, m >>= 1)
+        if (m & 1)
+            g->via[r][Y][i] = (unsigned char)via;
+}
+
+int ttm_placement_path(TtmMoveGen *g, const GameState *gs,
+        const TtmPlacement *p, UserCommand *cmds, int max) {
+    ttm_row_t goal[4][TTM_MOVES_ROWS];
+    ttm_row_t kicked[TTM_KICKS];
+    const TetriminoShape *target;
+    int r, s, d, k, Y, i, depth;
+    int target_y, target_i;
+
+    if (p->rot < 0 || p->rot > 3 || g->index != gs->index)
+        return -1;
+
+    target = SHAPE(g, p->rot);
+    target_y = p->y + TTM_MOVES_Y0;
+    target_i = p->x + target->left;
+
+    if (target_y < 0 || target_y >= g->rows || target_i < 0 ||
+            target_i >= WIDTH || !(g->valid[p->rot][target_y] >> target_i & 1) ||
+            (target_y > 0 && (g->valid[p->rot][target_y - 1] >> target_i & 1)))
+        return -1;
+
+    /*
+        Goal is any position DROP takes to the same cells: the column of
+        free positions above the target, in every orientation that
+        covers the same cells.
+    */
+    for (r = 0; r < 4; ++r) {
+        int y2 = target_y + target->bottom - SHAPE(g, r)->bottom;
+
+        for (Y = 0; Y < g->rows; ++Y)
+            goal[r][Y] = 0;
+
+        if (r != p->rot && !(g->same[p->rot] >> r & 1))
+            continue;
+        for (Y = y2; Y >= 0 && Y < g->rows &&
+                (g->valid[r][Y] >> target_i & 1); ++Y)
+            goal[r][Y] = (ttm_row_t)1 << target_i;
+    }
+
+    for (r = 0; r < 4; ++r) {
+        for (Y = 0; Y < g->rows; ++Y) {
+            g->seen[r][Y] = 0;
+            g->front[r][Y] = 0;
+        }
+    }
+
+    r = gs->rot;
+    Y = gs->pos_y + TTM_MOVES_Y0;
+    i = gs->pos_x + SHAPE(g, r)->left;
+    if (Y < 0 || Y >= g->rows || i < 0 || i >= WIDTH ||
+            !(g->valid[r][Y] >> i & 1))
+        return -1;
+
+    g->seen[r][Y] = g->front[r][Y] = (ttm_row_t)1 << i;
+
+    /* Breadth first, one layer of positions a command. */
+    for (depth = 0; ; ++depth) {
+        int found = 0, any = 0;
+
+        for (r = 0; r < 4 && !found; ++r) {
+            for (Y = 0; Y < g->rows; ++Y) {
+                if (g->front[r][Y] & goal[r][Y]) {
+                    ttm_row_t m = g->front[r][Y] & goal[r][Y];
+                    for (i = 0; !(m & 1); ++i, m >>= 1)
+                        ;
+                    found = 1;
+                    break;
+                }
+            }
+        }
+
+        if (found) {
+            --r;
+            break;
+        }
+
+        if (depth + 1 >= max)
+            return -1;
+
+        for (r = 0; r < 4; ++r)
+            for (Y = 0; Y < g->rows; ++Y)
+                g->next[r][Y] = 0;
+
+        /* Rotations first, they can land on other rows. */
+        for (r = 0; r < 4; ++r) {
+            for (Y = 0; Y < g->rows; ++Y) {
+                if (!g->front[r][Y])
+                    continue;
+
+                for (d = 0; d < 2; ++d) {
+                    s = (r + (d ? 3 : 1)) & 3;
+                    rotate_positions(g, r, Y, d, g->front[r][Y], kicked);
+                    for (k = 0; k < g->kick_count; ++k) {
+                        int Y2 = Y + g->kicks[r][d][k][1];
+                        ttm_row_t m;
+
+                        if (!kicked[k])
+                            continue;
+                        m = kicked[k] & ~g->seen[s][Y2] & ~g->next[s][Y2];
+                        mark_via(g, s, Y2, m, (d ? ROTATE_CCW : ROTATE_CW) | k << 4);
+                        g->next[s][Y2] |= m;
+                    }
+                }
+            }
+        }
+
+        for (r = 0; r < 4; ++r) {
+            for (Y = 0; Y < g->rows; ++Y) {
+                ttm_row_t avail = g->valid[r][Y] & ~g->seen[r][Y] & ~g->next[r][Y];
+                ttm_row_t m, all = 0;
+
+                m = (ttm_row_t)(g->front[r][Y] >> 1) & avail;
+                mark_via(g, r, Y, m, MOVE_LEFT);
+                all |= m;
+
+                m = (ttm_row_t)(g->front[r][Y] << 1) & avail & ~all;
+                mark_via(g, r, Y, m, MOVE_RIGHT);
+                all |= m;
+
+                if (Y + 1 < g->rows) {
+                    m = g->front[r][Y + 1] & avail & ~all;
+                    mark_via(g, r, Y, m, SPEEDUP);
+                    all |= m;
+                }
+
+                g->next[r][Y] |= all;
+                any |= g->next[r][Y] != 0;
+            }
+        }
+
+        if (!any)
+            return -1;
+
+        for (r = 0; r < 4; ++r) {
+            for (Y = 0; Y < g->rows; ++Y) {
+                g->front[r][Y] = g->next[r][Y];
+                g->seen[r][Y] |= g->next[r][Y];
+            }
+        }
+    }
+
+    /* Walk back from the goal position found on layer depth. */
+    cmds[depth] = DROP;
+    for (s = depth - 1; s >= 0; --s) {
+        UserCommand cmd = (UserCommand)(g->via[r][Y][i] & 15);
+        const signed char *kick;
+        int from;
+
+        cmds[s] = cmd;
+        switch (cmd) {
+            case MOVE_LEFT:  ++i; break;
+            case MOVE_RIGHT: --i; break;
+            case SPEEDUP:    ++Y; break;
+            case ROTATE_CW:
+            case ROTATE_CCW:
+                from = (r + (cmd == ROTATE_CW ? 3 : 1)) & 3;
+                kick = g->kicks[from][cmd == ROTATE_CCW][g->via[r][Y][i] >> 4];
+                i -= kick[0];
+                Y -= kick[1];
+                r = from;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return depth + 1;
+}
@@ -0,0 +1,67 @@
+/* ctetris_moves.h */
+#ifndef CTETRIS_MOVES_H
+#define CTETRIS_MOVES_H
+
+#include "ctetris.h"
+
+/*
+    Move generation: every placement the active tetrimino can reach
+    from where it is with MOVE_LEFT, MOVE_RIGHT, ROTATE_CW, ROTATE_CCW
+    and SPEEDUP, without gravity getting in between.
+
+    States are kept as bitsets, one row word per orientation and piece
+    row where bit i means the leftmost occupied cell is in column i, so
+    moves and collision checks run on a whole row of positions at once.
+    Rotations try the kicks of ttm_rotate in order on the whole row too,
+    each position taking the first kick that is free.
+*/
+
+/* Rows of piece positions, pos_y from -3 to height - 2 of the largest board. */
+#define TTM_MOVES_ROWS          (HEIGHT + 2)
+#define TTM_MOVES_Y0            3
+
+/* Bound of placements for any board and piece. */
+#define TTM_MAX_PLACEMENTS      (4 * WIDTH * TTM_MOVES_ROWS)
+
+/* Resting position, lock it with DROP or by placing it there. */
+typedef struct TtmPlacementTag {
+    signed char x;          /* pos_x */
+    short y;                /* pos_y, beyond a byte on boards over 127 rows */
+    signed char rot;
+} TtmPlacement;
+
+typedef struct TtmMoveGenTag {
+    int index;
+    int rows;               /* position rows of the board, height + 2 */
+    ttm_row_t valid[4][TTM_MOVES_ROWS];     /* positions free of collisions */
+    ttm_row_t reach[4][TTM_MOVES_ROWS];     /* positions reachable */
+    int same[4];            /* other orientations with the same cells, bit each */
+    /* Kicks of ROTATE_CW and ROTATE_CCW: position shift, row offset */
+    signed char kicks[4][2][TTM_KICKS][2];
+    int kick_count;
+
+    /* ttm_placement_path work space */
+    ttm_row_t seen[4][TTM_MOVES_ROWS];
+    ttm_row_t front[4][TTM_MOVES_ROWS];
+    ttm_row_t next[4][TTM_MOVES_ROWS];
+    unsigned char via[4][TTM_MOVES_ROWS][WIDTH];    /* command | kick << 4 */
+} TtmMoveGen;
+
+/*
+    Fills out with placements reachable by the active tetrimino of gs,
+    TTM_MAX_PLACEMENTS at most, and returns their number. Orientations
+    that cover the same cells, like all four of O, are reported once.
+    gs is not changed.
+*/
+int ttm_gen_placements(TtmMoveGen *g, const GameState *gs, TtmPlacement *out);
+
+/*
+    Finds a shortest command sequence that takes the active tetrimino
+    of gs to p and locks it there, ending with DROP. g must hold
+    ttm_gen_placements for the same gs.
+    Returns number of commands or -1 if p is not reachable in max.
+*/
+int ttm_placement_path(TtmMoveGen *g, const GameState *gs,
+        const TtmPlacement *p, UserCommand *cmds, int max);
+
+#endif
@@ -0,0 +1,784 @@
+/* ctetris_perft.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctetris.h"
+#include "ctetris_moves.h"
+#include "ctetris_pool.h"
+
+#define ttm_read_command_callback(gs) NOTHING
+
+#include "ctetris.c"
+
+/*
+    Counts the distinct boards a seeded piece sequence can leave after
+    each of its first N pieces, the way chess engines count positions to
+    validate and time their move generators.
+
+    Boards are expanded a depth at a time. Every board of a depth is a
+    pool item, so the work splits across threads from the root on, and
+    the children go to shards by hash where they are deduplicated in
+    parallel too. Boards the piece cannot spawn on end the game and have
+    no children.
+*/
+
+#define PERFT_SHARD_BITS    6
+#define PERFT_SHARDS        (1 << PERFT_SHARD_BITS)
+
+#define PERFT_MAX_DEPTH     16
+
+typedef struct PerftBoardTag {
+    ttm_row_t rows[HEIGHT];
+} PerftBoard;
+
+typedef struct PerftPieceTag {
+    int index;
+    int rot;
+} PerftPiece;
+
+typedef struct PerftBucketTag {
+    PerftBoard *boards;
+    size_t len;
+    size_t size;
+} PerftBucket;
+
+/*
+    Slow reference: the int per cell board and the 4x4 tetrimino matrix
+    with check_collision, place_tetrimino and check_and_collapse_rows as
+    they were before the board became row bitmasks, with only the fixes
+    the engine has since: walls are checked above the board, mirror_y
+    keeps the box offset and every full row is removed.
+*/
+typedef struct RefGameTag {
+    int gameboard[WIDTH * HEIGHT];
+    int tetrimino[4 * 4];
+    int ttm_x, ttm_y, ttm_box;
+    int ttm_pos_x, ttm_pos_y;
+    int ttm_index, ttm_rot;
+} RefGame;
+
+/* Piece positions of the reference search, x and y offset by 3. */
+#define REF_ROWS    (HEIGHT + 2)
+#define REF_COLS    (WIDTH + 3)
+
+typedef struct RefSearchTag {
+    RefGame game;
+    int matrices[4][4 * 4];                 /* tetrimino in each orientation */
+    unsigned char visited[4 * REF_ROWS * REF_COLS];  /* by REF_STATE */
+    int stack[4 * REF_ROWS * REF_COLS];
+    int keys[TTM_MAX_PLACEMENTS][8];        /* cells of placements found */
+} RefSearch;
+
+typedef struct PerftWorkerTag {
+    TtmMoveGen gen;
+    RefSearch *ref;
+    PerftBucket buckets[PERFT_SHARDS];
+    unsigned long long nodes;
+    unsigned long long ended;
+    int failed;
+} PerftWorker;
+
+typedef struct PerftShardTag {
+    PerftBoard *boards;
+    size_t len;
+    unsigned long long checksum;
+    int failed;
+} PerftShard;
+
+typedef struct PerftLevelTag {
+    unsigned long long boards;      /* distinct boards after the piece */
+    unsigned long long nodes;       /* placements generated */
+    unsigned long long ended;       /* boards the piece could not spawn on */
+    unsigned long long checksum;    /* sum of board hashes, any order */
+    double seconds;
+} PerftLevel;
+
+typedef void (*PerftExpand)(PerftWorker *w, const PerftBoard *parent,
+    const PerftPiece *piece);
+
+typedef struct PerftTag {
+    int threads;
+    int depth;
+    PerftPiece sequence[PERFT_MAX_DEPTH];
+    PerftExpand expand;
+    const PerftBoard *frontier;
+    const PerftPiece *piece;
+    PerftWorker **workers;
+    PerftShard shards[PERFT_SHARDS];
+} Perft;
+
+unsigned long long hash_board(const PerftBoard *b) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    int r;
+
+    for (r = 0; r < HEIGHT; ++r) {
+        h = (h ^ (unsigned long long)b->rows[r]) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+void emit_board(PerftWorker *w, const PerftBoard *b) {
+    PerftBucket *bucket = &w->buckets[hash_board(b) >> (64 - PERFT_SHARD_BITS)];
+
+    if (bucket->len == bucket->size) {
+        size_t size = bucket->size * 2 + 256;
+        PerftBoard *p = (PerftBoard *)realloc(bucket->boards,
+            size * sizeof(PerftBoard));
+        if (!p) {
+            w->failed = 1;
+            return;
+        }
+        bucket->boards = p;
+        bucket->size = size;
+    }
+
+    bucket->boards[bucket->len++] = *b;
+}
+
+/* Fast path: move generator and the engine's own place and collapse. */
+void expand_fast(PerftWorker *w, const PerftBoard *parent,
+        const PerftPiece *piece) {
+    GameState gs, child;
+    TtmPlacement placements[TTM_MAX_PLACEMENTS];
+    PerftBoard b;
+    int i, n;
+
+    memset(&gs, 0, sizeof(gs));
+    ttm_set_size(&gs, WIDTH, HEIGHT);
+    for (i = 0; i < HEIGHT; ++i)
+        gs.board[i] = parent->rows[i];
+    update_stack_shape(&gs);
+
+    gs.index = piece->index;
+    gs.rot = piece->rot;
+    gs.shape = &tetrimino_shapes[gs.index][gs.rot];
+    gs.pos_y = HEIGHT - 2;
+    gs.pos_x = (WIDTH - tetriminos[gs.index].box) / 2;
+
+    if (check_collision(&gs, 0)) {
+        ++w->ended;
+        return;
+    }
+
+    n = ttm_gen_placements(&w->gen, &gs, placements);
+    w->nodes += n;
+
+    for (i = 0; i < n; ++i) {
+        child = gs;
+        child.pos_x = placements[i].x;
+        child.pos_y = placements[i].y;
+        child.rot = placements[i].rot;
+        child.shape = &tetrimino_shapes[child.index][child.rot];
+        place_tetrimino(&child);
+        check_and_collapse_rows(&child);
+        memcpy(b.rows, child.board, sizeof(b.rows));
+        emit_board(w, &b);
+    }
+}
+
+void ref_collapse_rows(RefGame *g, int rl, int rh) {
+    int i;
+    int laddr = rl * WIDTH;
+    int haddr = rh * WIDTH;
+    int size = WIDTH * HEIGHT - haddr;
+
+    for (i = 0; i < size; ++i)
+        g->gameboard[laddr + i] = g->gameboard[haddr + i];
+
+    for (i = (HEIGHT - (rh - rl)) * WIDTH; i < (HEIGHT * WIDTH); ++i)
+        g->gameboard[i] = 0;
+}
+
+/*
+    Runs of full rows are removed whole; the original ended the run one
+    row early and left it to a rescan that the empty row check cut short.
+*/
+void ref_check_and_collapse_rows(RefGame *g) {
+    int r, c;
+    int rl = -1;
+
+    for (r = 0; r < HEIGHT; ++r) {
+        int full = 1;
+        int empty = 0;
+        for (c = 0; c < WIDTH; ++c) {
+            int cell = g->gameboard[r * WIDTH + c];
+            full &= cell;
+            empty |= cell;
+        }
+
+        if (full) {
+            if (rl == -1)
+                rl = r;
+        } else if (rl != -1) {
+            /* [rl, r) - interval */
+            ref_collapse_rows(g, rl, r);
+            r = rl - 1;
+            rl = -1;
+            continue;
+        }
+
+        if (!empty)
+            break;
+    }
+
+    /* Full rows up to the top were left in place too. */
+    if (rl != -1)
+        ref_collapse_rows(g, rl, HEIGHT);
+}
+
+int ref_check_collision(RefGame *g, int landing) {
+    int r, c;
+
+    landing = landing ? 1 : 0;
+
+    for (r = 0; r < 4; ++r) {
+        int row = g->ttm_pos_y - landing + r;
+        int row_offset = row * WIDTH;
+
+        if (row < 0) {
+            for (c = 0; c < 4; ++c) {
+                if (g->tetrimino[r * 4 + c])
+                    return 1;
+            }
+        }
+
+        if (row < 0)
+            continue;
+
+        /* Walls also for rows above the board, as the engine has it now. */
+        for (c = 0; c < 4; ++c) {
+            int col = g->ttm_pos_x + c;
+            int pfcell, tmcell;
+
+            if (col < 0 || col >= WIDTH) {
+                if (g->tetrimino[r * 4 + c])
+                    return 1;
+                continue;
+            }
+
+            if (row >= HEIGHT)
+                continue;
+
+            pfcell = g->gameboard[row_offset + col];
+            tmcell = g->tetrimino[r * 4 + c];
+            if (pfcell && tmcell)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+int ref_advance_tetrimino(RefGame *g) {
+    int landed = ref_check_collision(g, 1);
+    if (!landed)
+        --g->ttm_pos_y;
+
+    return landed;
+}
+
+void ref_transpose(int *m, int bs, int x_off, int y_off, int ms) {
+    int x, y;
+
+    for (y = 0; y < ms; ++y) {
+        for (x = y + 1; x < ms; ++x) {
+            int *mrx = &m[(y + y_off) * bs + x + x_off];
+            int *mry = &m[(x + x_off) * bs + y + y_off];
+            swap_int(*mrx, *mry);
+        }
+    }
+}
+
+/* With the box offset fix the engine has, O keeps its shape. */
+void ref_mirror_y(int *m, int bs, int x_off, int y_off, int ms) {
+    int x, y;
+
+    for (y = 0; y < ms; ++y) {
+        for (x = 0; x < ms / 2; ++x) {
+            int *row = &m[(y + y_off) * bs];
+            int *mrl = &row[x + x_off];
+            int *mrr = &row[ms - 1 - x + x_off];
+            swap_int(*mrl, *mrr);
+        }
+    }
+}
+
+void ref_rotate_tetrimino(RefGame *g, int angle) {
+    switch (angle) {
+        case 90:
+            ref_transpose(g->tetrimino, 4, g->ttm_x, g->ttm_y, g->ttm_box);
+            ref_mirror_y(g->tetrimino, 4, g->ttm_x, g->ttm_y, g->ttm_box);
+            break;
+
+        case -90:
+            ref_mirror_y(g->tetrimino, 4, g->ttm_x, g->ttm_y, g->ttm_box);
+            ref_transpose(g->tetrimino, 4, g->ttm_x, g->ttm_y, g->ttm_box);
+            break;
+    }
+}
+
+void ref_place_tetrimino(RefGame *g) {
+    int r, c;
+    for (r = 0; r < 4; ++r) {
+        for (c = 0; c < 4; ++c) {
+            int row = g->ttm_pos_y + r;
+            /* Empty cells of the matrix can be outside the board. */
+            if (row < HEIGHT && g->tetrimino[r * 4 + c]) {
+                int *pfcell = &g->gameboard[row * WIDTH + g->ttm_pos_x + c];
+                *pfcell ^= g->tetrimino[r * 4 + c];
+            }
+        }
+    }
+}
+
+/*
+    Rotates at the first kick of ttm_kicks that does not collide and
+    is not above the spawn row. Returns 1 if it rotated.
+*/
+int ref_rotate_kicked(RefGame *g, int dir) {
+    signed char kicks[TTM_KICKS][2];
+    int t, n = ttm_kicks(g->ttm_index, g->ttm_rot, dir, kicks);
+
+    ref_rotate_tetrimino(g, dir > 0 ? 90 : -90);
+    for (t = 0; t < n; ++t) {
+        g->ttm_pos_x += kicks[t][0];
+        g->ttm_pos_y += kicks[t][1];
+        if (g->ttm_pos_y <= HEIGHT - 2 && !ref_check_collision(g, 0)) {
+            g->ttm_rot = (g->ttm_rot + dir) & 3;
+            return 1;
+        }
+        g->ttm_pos_x -= kicks[t][0];
+        g->ttm_pos_y -= kicks[t][1];
+    }
+    ref_rotate_tetrimino(g, dir > 0 ? -90 : 90);
+
+    return 0;
+}
+
+/* Returns 1 if the command moved or rotated the tetrimino. */
+int ref_apply_command(RefGame *g, UserCommand cmd) {
+    switch (cmd) {
+        case ROTATE_CW:
+            return ref_rotate_kicked(g, 1);
+
+        case ROTATE_CCW:
+            return ref_rotate_kicked(g, -1);
+
+        case MOVE_LEFT:
+        case MOVE_RIGHT:
+            g->ttm_pos_x += cmd == MOVE_LEFT ? -1 : 1;
+            if (ref_check_collision(g, 0)) {
+                g->ttm_pos_x -= cmd == MOVE_LEFT ? -1 : 1;
+                return 0;
+            }
+            return 1;
+
+        case SPEEDUP:
+            return !ref_advance_tetrimino(g);
+
+        default:
+            return 0;
+    }
+}
+
+#define REF_STATE(r, x, y)  (((r) * REF_ROWS + (y) + 3) * REF_COLS + (x) + 3)
+
+void ref_load_board(RefGame *g, const PerftBoard *b) {
+    int i;
+
+    for (i = 0; i < HEIGHT * WIDTH; ++i)
+        g->gameboard[i] = (b->rows[i / WIDTH] >> (i % WIDTH)) & 1;
+}
+
+void ref_load(RefSearch *s, int state) {
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        s->game.tetrimino[i] = s->matrices[state / (REF_ROWS * REF_COLS)][i];
+    s->game.ttm_pos_x = state % REF_COLS - 3;
+    s->game.ttm_pos_y = state / REF_COLS % REF_ROWS - 3;
+    s->game.ttm_rot = state / (REF_ROWS * REF_COLS);
+}
+
+/*
+    Reference expansion: every position reachable with the commands is
+    searched one at a time, and each landed one with cells not seen yet
+    is a placement.
+*/
+void expand_ref(PerftWorker *w, const PerftBoard *parent,
+        const PerftPiece *piece) {
+    static const UserCommand commands[5] = {
+        ROTATE_CW, ROTATE_CCW, MOVE_LEFT, MOVE_RIGHT, SPEEDUP
+    };
+    RefSearch *s = w->ref;
+    RefGame *g = &s->game;
+    const Tetrimino *tmdef = &tetriminos[piece->index];
+    PerftBoard b;
+    int sp = 0, keys = 0;
+    int i, r, c, k;
+
+    for (i = 0; i < 16; ++i)
+        g->tetrimino[i] = 0;
+    for (i = 0; i < 4; ++i)
+        g->tetrimino[tmdef->defy[i] * 4 + tmdef->defx[i]] = 1;
+    g->ttm_x = tmdef->x;
+    g->ttm_y = tmdef->y;
+    g->ttm_box = tmdef->box;
+    g->ttm_index = piece->index;
+    for (r = 0; r < 4; ++r) {
+        for (i = 0; i < 16; ++i)
+            s->matrices[(piece->rot + r) & 3][i] = g->tetrimino[i];
+        ref_rotate_tetrimino(g, 90);
+    }
+
+    memset(s->visited, 0, sizeof(s->visited));
+    s->stack[sp++] = REF_STATE(piece->rot, (WIDTH - tmdef->box) / 2, HEIGHT - 2);
+    ref_load_board(g, parent);
+    ref_load(s, s->stack[0]);
+    if (ref_check_collision(g, 0)) {
+        ++w->ended;
+        return;
+    }
+    s->visited[s->stack[0]] = 1;
+
+    while (sp) {
+        int state = s->stack[--sp];
+        int rot = state / (REF_ROWS * REF_COLS);
+        int key[8];
+
+        for (k = 0; k < 5; ++k) {
+            int next;
+
+            ref_load(s, state);
+            if (!ref_apply_command(g, commands[k]))
+                continue;
+            r = commands[k] == ROTATE_CW ? (rot + 1) & 3 :
+                commands[k] == ROTATE_CCW ? (rot + 3) & 3 : rot;
+            next = REF_STATE(r, g->ttm_pos_x, g->ttm_pos_y);
+            if (!s->visited[next]) {
+                s->visited[next] = 1;
+                s->stack[sp++] = next;
+            }
+        }
+
+        ref_load(s, state);
+        if (!ref_check_collision(g, 1))
+            continue;
+
+        /* Cells in row major order, the same for any orientation. */
+        i = 0;
+        for (r = 0; r < 4; ++r) {
+            for (c = 0; c < 4; ++c) {
+                if (g->tetrimino[r * 4 + c]) {
+                    key[i++] = g->ttm_pos_x + c;
+                    key[i++] = g->ttm_pos_y + r;
+                }
+            }
+        }
+
+        for (i = 0; i < keys; ++i)
+            if (!memcmp(s->keys[i], key, sizeof(key)))
+                break;
+        if (i < keys)
+            continue;
+        memcpy(s->keys[keys++], key, sizeof(key));
+
+        ref_place_tetrimino(g);
+        ref_check_and_collapse_rows(g);
+        for (r = 0; r < HEIGHT; ++r) {
+            b.rows[r] = 0;
+            for (c = 0; c < WIDTH; ++c)
+                if (g->gameboard[r * WIDTH + c])
+                    b.rows[r] |= (ttm_row_t)1 << c;
+        }
+        emit_board(w, &b);
+        ref_load_board(g, parent);
+    }
+
+    w->nodes += keys;
+}
+
+void expand_task(void *ctx, int worker, long item) {
+    Perft *p = (Perft *)ctx;
+    p->expand(p->workers[worker], &p->frontier[item], p->piece);
+}
+
+/* Pool task: deduplicates the children of one shard. */
+void merge_task(void *ctx, int worker, long item) {
+    Perft *p = (Perft *)ctx;
+    PerftShard *shard = &p->shards[item];
+    unsigned int *table;
+    size_t n = 0, size = 16, len = 0;
+    int i;
+
+    (void)worker;
+
+    for (i = 0; i < p->threads; ++i)
+        n += p->workers[i]->buckets[item].len;
+    while (size < 2 * n)
+        size *= 2;
+
+    shard->boards = (PerftBoard *)malloc(n * sizeof(PerftBoard) + 1);
+    table = (unsigned int *)calloc(size, sizeof(unsigned int));
+    shard->checksum = 0;
+    shard->failed = !shard->boards || !table;
+
+    if (!shard->failed) {
+        for (i = 0; i < p->threads; ++i) {
+            const PerftBucket *bucket = &p->workers[i]->buckets[item];
+            size_t j;
+
+            for (j = 0; j < bucket->len; ++j) {
+                const PerftBoard *b = &bucket->boards[j];
+                unsigned long long h = hash_board(b);
+                size_t slot = (size_t)h & (size - 1);
+
+                while (table[slot] && memcmp(&shard->boards[table[slot] - 1], b,
+                        sizeof(PerftBoard)))
+                    slot = (slot + 1) & (size - 1);
+                if (table[slot])
+                    continue;
+
+                shard->boards[len] = *b;
+                table[slot] = (unsigned int)++len;
+                shard->checksum += h;
+            }
+        }
+    }
+
+    shard->len = len;
+    free(table);
+}
+
+/*
+    Expands the empty board depth times with p->expand.
+    Returns 0 or -1 if memory ran out.
+*/
+int run_perft(Perft *p, PerftLevel *levels) {
+    PerftBoard *frontier;
+    size_t count = 1;
+    int d, i, s;
+
+    frontier = (PerftBoard *)calloc(1, sizeof(PerftBoard));
+    if (!frontier)
+        return -1;
+
+    for (d = 0; d < p->depth; ++d) {
+        PerftLevel *level = &levels[d];
+        double start = ttm_seconds();
+        int failed = 0;
+
+        p->frontier = frontier;
+        p->piece = &p->sequence[d];
+        for (i = 0; i < p->threads; ++i) {
+            p->workers[i]->nodes = 0;
+            p->workers[i]->ended = 0;
+            for (s = 0; s < PERFT_SHARDS; ++s)
+                p->workers[i]->buckets[s].len = 0;
+        }
+
+        ttm_pool_run(p->threads, (long)count, expand_task, p);
+        ttm_pool_run(p->threads, PERFT_SHARDS, merge_task, p);
+        free(frontier);
+
+        memset(level, 0, sizeof(*level));
+        for (i = 0; i < p->threads; ++i) {
+            level->nodes += p->workers[i]->nodes;
+            level->ended += p->workers[i]->ended;
+            failed |= p->workers[i]->failed;
+        }
+        for (s = 0; s < PERFT_SHARDS; ++s) {
+            level->boards += p->shards[s].len;
+            level->checksum += p->shards[s].checksum;
+            failed |= p->shards[s].failed;
+        }
+
+        count = (size_t)level->boards;
+        frontier = failed ? NULL :
+            (PerftBoard *)malloc(count * sizeof(PerftBoard) + 1);
+        if (frontier) {
+            PerftBoard *out = frontier;
+            for (s = 0; s < PERFT_SHARDS; ++s) {
+                memcpy(out, p->shards[s].boards, p->shards[s].len * sizeof(PerftBoard));
+                out += p->shards[s].len;
+            }
+        }
+        for (s = 0; s < PERFT_SHARDS; ++s)
+            free(p->shards[s].boards);
+
+        level->seconds = ttm_seconds() - start;
+        if (!frontier)
+            return -1;
+    }
+
+    free(frontier);
+    return 0;
+}
+
+void print_levels(const PerftLevel *levels, int depth) {
+    double total = 0;
+    unsigned long long nodes = 0;
+    int d;
+
+    printf("depth         boards      placements   ended     seconds    nodes/sec\n");
+    for (d = 0; d < depth; ++d) {
+        const PerftLevel *l = &levels[d];
+        total += l->seconds;
+        nodes += l->nodes;
+        printf("%5d %14llu  %14llu %7llu %11.3f %12.0f\n", d + 1, l->boards,
+            l->nodes, l->ended, l->seconds,
+            l->nodes / (l->seconds > 0 ? l->seconds : 1e-9));
+    }
+    printf("total                %14llu         %11.3f %12.0f\n", nodes, total,
+        nodes / (total > 0 ? total : 1e-9));
+}
+
+double total_seconds(const PerftLevel *levels, int depth) {
+    double total = 0;
+    int d;
+
+    for (d = 0; d < depth; ++d)
+        total += levels[d].seconds;
+
+    return total;
+}
+
+void usage() {
+    fprintf(stderr,
+        "usage: ctetris_perft [-d depth] [-t threads] [-s seed] [-b] [-c]\n"
+        "  -d  number of pieces, at most %d (default 4)\n"
+        "  -t  worker threads (default: all processors)\n"
+        "  -s  seed of the piece sequence (default 1)\n"
+        "  -b  draw pieces from a 7-bag instead of uniformly\n"
+        "  -c  check the counts against the slow reference\n",
+        PERFT_MAX_DEPTH);
+}
+
+int main(int argc, char **argv) {
+    Perft perft;
+    PerftLevel fast[PERFT_MAX_DEPTH], ref[PERFT_MAX_DEPTH];
+    GameState gs;
+    unsigned int seed = 1;
+    int randomizer = TTM_UNIFORM;
+    int check = 0, result = 0;
+    int i, d;
+
+    memset(&perft, 0, sizeof(perft));
+    perft.threads = ttm_cpu_count();
+    perft.depth = 4;
+
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || !arg[1] || arg[2]) {
+            usage();
+            return 2;
+        }
+        if (arg[1] == 'b') {
+            randomizer = TTM_BAG7;
+            continue;
+        }
+        if (arg[1] == 'c') {
+            check = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        switch (arg[1]) {
+            case 'd': perft.depth = atoi(argv[++i]); break;
+            case 't': perft.threads = atoi(argv[++i]); break;
+            case 's': seed = (unsigned int)strtoul(argv[++i], NULL, 0); break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+
+    if (perft.depth < 1 || perft.depth > PERFT_MAX_DEPTH) {
+        usage();
+        return 2;
+    }
+    if (perft.threads < 1)
+        perft.threads = 1;
+
+    /* The pieces a game with this seed spawns. */
+    memset(&gs, 0, sizeof(gs));
+    gs.randomizer = (unsigned char)randomizer;
+    ttm_seed(&gs, seed);
+    init_game(&gs);
+    for (d = 0; d < perft.depth; ++d) {
+        perft.sequence[d].index = gs.index;
+        perft.sequence[d].rot = gs.rot;
+        spawn_new_tetrimino(&gs);
+    }
+
+    perft.workers = (PerftWorker **)calloc(perft.threads, sizeof(PerftWorker *));
+    if (!perft.workers)
+        return 1;
+    for (i = 0; i < perft.threads; ++i) {
+        perft.workers[i] = (PerftWorker *)calloc(1, sizeof(PerftWorker));
+        if (!perft.workers[i])
+            return 1;
+        if (check) {
+            perft.workers[i]->ref = (RefSearch *)malloc(sizeof(RefSearch));
+            if (!perft.workers[i]->ref)
+                return 1;
+        }
+    }
+
+    printf("board        %dx%d\n", WIDTH, HEIGHT);
+    printf("threads      %d\n", perft.threads);
+    printf("seed         %u%s\n", seed, randomizer == TTM_BAG7 ? ", 7-bag" : "");
+    printf("sequence     ");
+    for (d = 0; d < perft.depth; ++d)
+        printf("%c", "IJLOSTZ"[perft.sequence[d].index]);
+    printf("\n\n");
+
+    perft.expand = expand_fast;
+    if (run_perft(&perft, fast)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    print_levels(fast, perft.depth);
+
+    if (check) {
+        perft.expand = expand_ref;
+        if (run_perft(&perft, ref)) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+
+        for (d = 0; d < perft.depth; ++d) {
+            if (fast[d].boards != ref[d].boards || fast[d].nodes != ref[d].nodes ||
+                    fast[d].ended != ref[d].ended ||
+                    fast[d].checksum != ref[d].checksum) {
+                printf("\nreference    MISMATCH at depth %d: boards %llu, "
+                    "placements %llu, ended %llu\n", d + 1, ref[d].boards,
+                    ref[d].nodes, ref[d].ended);
+                result = 1;
+                break;
+            }
+        }
+        if (!result)
+            printf("\nreference    ok, %.3f s, %.1fx slower\n",
+                total_seconds(ref, perft.depth),
+                total_seconds(ref, perft.depth) /
+                    (total_seconds(fast, perft.depth) > 0 ?
+                        total_seconds(fast, perft.depth) : 1e-9));
+    }
+
+    for (i = 0; i < perft.threads; ++i) {
+        int s;
+        for (s = 0; s < PERFT_SHARDS; ++s)
+            free(perft.workers[i]->buckets[s].boards);
+        free(perft.workers[i]->ref);
+        free(perft.workers[i]);
+    }
+    free(perft.workers);
+
+    return result;
+}
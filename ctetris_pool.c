@@ -0,0 +1,389 @@
+/* ctetris_pool.c */
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "ctetris_pool.h"
+
+/* Claimed items per fetch, keeps queue traffic low for cheap items. */
+#define POOL_CHUNK      4
+
+#ifdef _WIN32
+#define atomic_fetch_add_long(p, v) InterlockedExchangeAdd((p), (v))
+#else
+#define atomic_fetch_add_long(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
+/*
+    Range of items [next, end) owned by one worker. next only grows,
+    whoever moves it past an item owns that item. Each queue sits on
+    its own cache line.
+*/
+typedef struct PoolQueueTag {
+    volatile long next;
+    long end;
+    char pad[64 - 2 * sizeof(long)];
+} PoolQueue;
+
+typedef struct PoolTag {
+    PoolQueue *queues;
+    int workers;
+    TtmPoolTask task;
+    void *ctx;
+} Pool;
+
+typedef struct PoolWorkerTag {
+    Pool *pool;
+    int index;
+} PoolWorker;
+
+/*
+    A batch starts when generation changes, busy counts the threads
+    still running it.
+*/
+struct TtmPoolTag {
+    Pool pool;
+    PoolWorker *w;
+    int size;
+    unsigned int generation;
+    int busy;
+    int stop;
+#ifdef _WIN32
+    HANDLE *threads;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE start;
+    CONDITION_VARIABLE done;
+#else
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+#endif
+};
+
+#ifdef _WIN32
+#define pool_lock(p)        EnterCriticalSection(&(p)->lock)
+#define pool_unlock(p)      LeaveCriticalSection(&(p)->lock)
+#define pool_wait(p, c)     SleepConditionVariableCS(&(p)->c, &(p)->lock, INFINITE)
+#define pool_signal(p, c)   WakeConditionVariable(&(p)->c)
+#define pool_broadcast(p, c) WakeAllConditionVariable(&(p)->c)
+#else
+#define pool_lock(p)        pthread_mutex_lock(&(p)->lock)
+#define pool_unlock(p)      pthread_mutex_unlock(&(p)->lock)
+#define pool_wait(p, c)     pthread_cond_wait(&(p)->c, &(p)->lock)
+#define pool_signal(p, c)   pthread_cond_signal(&(p)->c)
+#define pool_broadcast(p, c) pthread_cond_broadcast(&(p)->c)
+#endif
+
+/*
+    Claims up to POOL_CHUNK items from a queue.
+    Returns number of items claimed, first one in *first.
+*/
+static long claim(PoolQueue *q, long *first) {
+    long n;
+
+    if (q->next >= q->end)
+        return 0;
+
+    *first = atomic_fetch_add_long(&q->next, POOL_CHUNK);
+    n = q->end - *first;
+    if (n <= 0)
+        return 0;
+
+    return n < POOL_CHUNK ? n : POOL_CHUNK;
+}
+
+static void run_worker(PoolWorker *w) {
+    Pool *pool = w->pool;
+    int victim = w->index;
+    int tries = 0;
+
+    /* Own queue first, then the others in turn until all are empty. */
+    while (tries < pool->workers) {
+        long first, n, i;
+
+        n = claim(&pool->queues[victim], &first);
+        if (!n) {
+            victim = (victim + 1) % pool->workers;
+            ++tries;
+            continue;
+        }
+
+        for (i = 0; i < n; ++i)
+            pool->task(pool->ctx, w->index, first + i);
+        tries = 0;
+    }
+}
+
+/* Thread of a TtmPool, runs its share of every batch until stopped. */
+static void serve(PoolWorker *w) {
+    TtmPool *p = (TtmPool *)w->pool;
+    unsigned int seen = 0;
+
+    pool_lock(p);
+    for (;;) {
+        while (p->generation == seen && !p->stop)
+            pool_wait(p, start);
+        if (p->stop)
+            break;
+        seen = p->generation;
+
+        /* Workers past those of the batch sit it out. */
+        if (w->index >= p->pool.workers)
+            continue;
+
+        pool_unlock(p);
+        run_worker(w);
+        pool_lock(p);
+        if (!--p->busy)
+            pool_signal(p, done);
+    }
+    pool_unlock(p);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(void *arg) {
+    run_worker((PoolWorker *)arg);
+    return 0;
+}
+
+static DWORD WINAPI pool_thread(void *arg) {
+    serve((PoolWorker *)arg);
+    return 0;
+}
+#else
+static void *worker_thread(void *arg) {
+    run_worker((PoolWorker *)arg);
+    return NULL;
+}
+
+static void *pool_thread(void *arg) {
+    serve((PoolWorker *)arg);
+    return NULL;
+}
+#endif
+
+int ttm_pool_run(int workers, long items, TtmPoolTask task, void *ctx) {
+    Pool pool;
+    PoolWorker *w;
+    int i, started, result = 0;
+#ifdef _WIN32
+    HANDLE *threads;
+#else
+    pthread_t *threads;
+#endif
+
+    if (workers < 1)
+        workers = 1;
+
+    pool.queues = (PoolQueue *)calloc(workers, sizeof(PoolQueue));
+    w = (PoolWorker *)calloc(workers, sizeof(PoolWorker));
+    threads = calloc(workers, sizeof(*threads));
+    if (!pool.queues || !w || !threads) {
+        free(pool.queues);
+        free(w);
+        free(threads);
+        return -1;
+    }
+
+    pool.workers = workers;
+    pool.task = task;
+    pool.ctx = ctx;
+
+    for (i = 0; i < workers; ++i) {
+        pool.queues[i].next = items * i / workers;
+        pool.queues[i].end = items * (i + 1) / workers;
+        w[i].pool = &pool;
+        w[i].index = i;
+    }
+
+    /* Worker 0 runs on the calling thread. */
+    for (started = 1; started < workers; ++started) {
+#ifdef _WIN32
+        threads[started] = CreateThread(NULL, 0, worker_thread, &w[started], 0, NULL);
+        if (!threads[started])
+            break;
+#else
+        if (pthread_create(&threads[started], NULL, worker_thread, &w[started]))
+            break;
+#endif
+    }
+
+    if (started < workers)
+        result = -1;
+
+    /* Workers that failed to start leave their items to be stolen. */
+    run_worker(&w[0]);
+
+    for (i = 1; i < started; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    free(pool.queues);
+    free(w);
+    free(threads);
+
+    return result;
+}
+
+/* Stops the first started threads of p, joins them and frees p. */
+static void pool_destroy(TtmPool *p, int started) {
+    int i;
+
+    pool_lock(p);
+    p->stop = 1;
+    pool_broadcast(p, start);
+    pool_unlock(p);
+
+    for (i = 1; i < started; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(p->threads[i], INFINITE);
+        CloseHandle(p->threads[i]);
+#else
+        pthread_join(p->threads[i], NULL);
+#endif
+    }
+
+#ifdef _WIN32
+    DeleteCriticalSection(&p->lock);
+#else
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+#endif
+    free(p->pool.queues);
+    free(p->w);
+    free(p->threads);
+    free(p);
+}
+
+TtmPool *ttm_pool_create(int workers) {
+    TtmPool *p;
+    int i, started;
+
+    if (workers < 1)
+        workers = 1;
+
+    p = (TtmPool *)calloc(1, sizeof(TtmPool));
+    if (!p)
+        return NULL;
+    p->pool.queues = (PoolQueue *)calloc(workers, sizeof(PoolQueue));
+    p->w = (PoolWorker *)calloc(workers, sizeof(PoolWorker));
+    p->threads = calloc(workers, sizeof(*p->threads));
+    if (!p->pool.queues || !p->w || !p->threads) {
+        free(p->pool.queues);
+        free(p->w);
+        free(p->threads);
+        free(p);
+        return NULL;
+    }
+
+    p->size = workers;
+#ifdef _WIN32
+    InitializeCriticalSection(&p->lock);
+    InitializeConditionVariable(&p->start);
+    InitializeConditionVariable(&p->done);
+#else
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+#endif
+
+    /* The pool is first in TtmPool, workers find the rest from it. */
+    for (i = 0; i < workers; ++i) {
+        p->w[i].pool = &p->pool;
+        p->w[i].index = i;
+    }
+
+    for (started = 1; started < workers; ++started) {
+#ifdef _WIN32
+        p->threads[started] = CreateThread(NULL, 0, pool_thread, &p->w[started], 0, NULL);
+        if (!p->threads[started])
+            break;
+#else
+        if (pthread_create(&p->threads[started], NULL, pool_thread, &p->w[started]))
+            break;
+#endif
+    }
+
+    if (started < workers) {
+        pool_destroy(p, started);
+        return NULL;
+    }
+
+    return p;
+}
+
+void ttm_pool_submit(TtmPool *p, int workers, long items,
+        TtmPoolTask task, void *ctx) {
+    int i;
+
+    if (workers < 1)
+        workers = 1;
+    if (workers > p->size)
+        workers = p->size;
+
+    for (i = 0; i < workers; ++i) {
+        p->pool.queues[i].next = items * i / workers;
+        p->pool.queues[i].end = items * (i + 1) / workers;
+    }
+    p->pool.task = task;
+    p->pool.ctx = ctx;
+
+    /* Threads that sat the last batch out may still look at workers. */
+    pool_lock(p);
+    p->pool.workers = workers;
+    if (workers > 1) {
+        p->busy = workers - 1;
+        ++p->generation;
+        pool_broadcast(p, start);
+    }
+    pool_unlock(p);
+
+    run_worker(&p->w[0]);
+
+    pool_lock(p);
+    while (p->busy)
+        pool_wait(p, done);
+    pool_unlock(p);
+}
+
+void ttm_pool_free(TtmPool *p) {
+    if (p)
+        pool_destroy(p, p->size);
+}
+
+int ttm_cpu_count() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+double ttm_seconds() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
@@ -0,0 +1,51 @@
+/* ctetris_pool.h */
+#ifndef CTETRIS_POOL_H
+#define CTETRIS_POOL_H
+
+/*
+    Runs task(ctx, worker, item) for every item in [0, items) on
+    the given number of worker threads.
+
+    Items are split into one contiguous range per worker. A worker takes
+    items from the front of its own range and, once that is empty,
+    steals from the ranges of other workers, so uneven item costs do
+    not leave threads idle.
+
+    worker is in [0, workers) and can be used to index per-thread data.
+    Returns 0 on success or -1 if threads could not be started.
+*/
+typedef void (*TtmPoolTask)(void *ctx, int worker, long item);
+
+int ttm_pool_run(int workers, long items, TtmPoolTask task, void *ctx);
+
+/*
+    Workers that stay alive between runs, for callers that run many
+    small batches such as the plies of a search. Between batches the
+    threads sleep on a condition variable.
+*/
+typedef struct TtmPoolTag TtmPool;
+
+/*
+    Starts workers - 1 threads, worker 0 is the thread that submits.
+    Returns NULL if out of memory or threads could not be started.
+*/
+TtmPool *ttm_pool_create(int workers);
+
+/*
+    Runs task(ctx, worker, item) for every item in [0, items) like
+    ttm_pool_run, on the first workers of the pool at most, and returns
+    once all items are done. One batch at a time.
+*/
+void ttm_pool_submit(TtmPool *pool, int workers, long items,
+    TtmPoolTask task, void *ctx);
+
+/* Stops and joins the threads of the pool, NULL is ignored. */
+void ttm_pool_free(TtmPool *pool);
+
+/* Number of online processors, at least 1. */
+int ttm_cpu_count();
+
+/* Monotonic time in seconds. */
+double ttm_seconds();
+
+#endif
@@ -0,0 +1,520 @@
+/* ctetris_replay.c */
+#include "ctetris_replay.h"
+
+#define REPLAY_OPTIONS  ((SHOW_NEXT ? 1 : 0) | (RANDOM_ROTATE ? 2 : 0))
+
+/* Header options bit, the replay ends with a keyframe table. */
+#define REPLAY_KEYFRAMES    4
+
+/* Keyframe bytes before the board. */
+#define KEYFRAME_HEAD   41
+
+/* TTM_REPLAY_KEYFRAME_SIZE for any board. */
+#define KEYFRAME_SIZE(width, height) \
+    (KEYFRAME_HEAD + (height) * (((width) + 7) / 8))
+#define TRAILER_SIZE    12
+
+typedef struct ReplayPlayerTag {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;                     /* next record */
+    const unsigned char *keys;      /* keyframe table or NULL */
+    unsigned int key_count;
+    unsigned int next_key;          /* first keyframe not yet checked */
+    unsigned int commands;
+    PlayCycleResult result;
+    int ended;                      /* end record was played */
+} ReplayPlayer;
+
+static void put_byte(TtmReplayWriter *w, unsigned int b) {
+    if (w->len < w->size)
+        w->buf[w->len++] = (unsigned char)b;
+    else
+        w->overflow = 1;
+}
+
+static void put_varint(TtmReplayWriter *w, unsigned int v) {
+    while (v >= 0x80) {
+        put_byte(w, (v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    put_byte(w, v);
+}
+
+static void put_u32(unsigned char *p, unsigned int v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned int get_u32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/*
+    Reads a varint at *pos. Returns 0 if it runs past len or does not
+    fit 32 bits.
+*/
+static int get_varint(const unsigned char *data, size_t len, size_t *pos,
+        unsigned int *v) {
+    unsigned int result = 0;
+    int shift = 0;
+
+    while (*pos < len && shift < 35) {
+        unsigned int b = data[(*pos)++];
+        result |= (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *v = result;
+            return 1;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/*
+    FNV-1a over the final board, catches games that end alike by chance.
+    Rows are hashed as the bytes keyframes store them in.
+*/
+static unsigned int board_hash(const GameState *gs) {
+    unsigned int h = 2166136261U;
+    int i, b;
+
+    for (i = 0; i < gs->height; ++i) {
+        ttm_row_t row = gs->board[i];
+        for (b = 0; b < gs->width; b += 8) {
+            h = (h ^ (unsigned int)(row & 0xFF)) * 16777619U;
+            row >>= 8;
+        }
+    }
+
+    return h;
+}
+
+/*
+    Keyframe record, little endian:
+        tick pieces lines offset rng[4]         4 bytes each
+        pos_x                                   1 byte
+        pos_y                                   2 bytes
+        index rot next_tetrimino
+        timer_counter time_is_up bag            1 byte each
+        board                                   (width + 7) / 8 bytes a row
+
+    It holds the state after the timer of tick ran and before the
+    command at offset was applied. The stack shape is rebuilt on restore.
+*/
+static void encode_keyframe(const GameState *gs, size_t offset,
+        unsigned char *k) {
+    int i, b;
+
+    put_u32(k, gs->ticks);
+    put_u32(k + 4, gs->pieces);
+    put_u32(k + 8, gs->lines);
+    put_u32(k + 12, (unsigned int)offset);
+    for (i = 0; i < 4; ++i)
+        put_u32(k + 16 + i * 4, gs->rng[i]);
+
+    k[32] = (unsigned char)gs->pos_x;
+    k[33] = (unsigned char)gs->pos_y;
+    k[34] = (unsigned char)((unsigned int)gs->pos_y >> 8);
+    k[35] = (unsigned char)gs->index;
+    k[36] = (unsigned char)gs->rot;
+    k[37] = (unsigned char)gs->next_tetrimino;
+    k[38] = (unsigned char)gs->timer_counter;
+    k[39] = (unsigned char)gs->time_is_up;
+    k[40] = gs->bag;
+
+    k += KEYFRAME_HEAD;
+    for (i = 0; i < gs->height; ++i) {
+        ttm_row_t row = gs->board[i];
+        for (b = 0; b < gs->width; b += 8) {
+            *k++ = (unsigned char)row;
+            row >>= 8;
+        }
+    }
+}
+
+static void restore_keyframe(GameState *gs, const unsigned char *k) {
+    int i, b;
+
+    gs->ticks = get_u32(k);
+    gs->pieces = get_u32(k + 4);
+    gs->lines = get_u32(k + 8);
+    for (i = 0; i < 4; ++i)
+        gs->rng[i] = get_u32(k + 16 + i * 4);
+
+    gs->pos_x = (signed char)k[32];
+    gs->pos_y = (short)(k[33] | k[34] << 8);
+    gs->index = k[35] % 7;
+    gs->rot = k[36] & 3;
+    gs->next_tetrimino = (signed char)k[37];
+    gs->timer_counter = k[38];
+    gs->time_is_up = k[39];
+    gs->bag = k[40];
+    gs->shape = &tetrimino_shapes[gs->index][gs->rot];
+
+    k += KEYFRAME_HEAD;
+    for (i = 0; i < gs->height; ++i) {
+        ttm_row_t row = 0;
+        for (b = 0; b < gs->width; b += 8)
+            row |= (ttm_row_t)*k++ << b;
+        gs->board[i] = row & TTM_FULL_ROW(gs->width);
+    }
+
+    update_stack_shape(gs);
+}
+
+static void replay_record(GameState *gs, UserCommand cmd) {
+    TtmReplayWriter *w = (TtmReplayWriter *)gs->record_ctx;
+
+    if (w->key_interval && gs->pieces >= w->next_key) {
+        if (w->keys_len + KEYFRAME_SIZE(gs->width, gs->height) <= w->keys_size) {
+            encode_keyframe(gs, w->len, w->keys + w->keys_len);
+            w->keys_len += KEYFRAME_SIZE(gs->width, gs->height);
+        } else {
+            w->overflow = 1;
+        }
+        w->next_key = gs->pieces + w->key_interval;
+    }
+
+    put_varint(w, ((gs->ticks - w->last_tick) << 3) | (unsigned int)cmd);
+    w->last_tick = gs->ticks;
+}
+
+void ttm_replay_record_start(TtmReplayWriter *w, GameState *gs,
+        unsigned char *buf, size_t size,
+        unsigned int seed, unsigned int stream) {
+    w->buf = buf;
+    w->size = size;
+    w->len = 0;
+    w->last_tick = 0;
+    w->overflow = 0;
+    w->keys = 0;
+    w->keys_size = 0;
+    w->keys_len = 0;
+    w->key_interval = 0;
+    w->next_key = 0;
+
+    put_byte(w, 'c');
+    put_byte(w, 't');
+    put_byte(w, 'r');
+    ttm_set_size(gs, gs->width, gs->height);
+    put_byte(w, TTM_REPLAY_VERSION);
+    put_byte(w, gs->width);
+    put_byte(w, gs->height);
+    put_byte(w, gs->randomizer);
+    put_byte(w, REPLAY_OPTIONS);
+    put_varint(w, seed);
+    put_varint(w, stream);
+
+    ttm_seed_stream(gs, seed, stream);
+    gs->record = replay_record;
+    gs->record_ctx = w;
+}
+
+void ttm_replay_record_keyframes(TtmReplayWriter *w, unsigned char *keys,
+        size_t size, unsigned int interval) {
+    if (w->len < 8 || !interval)
+        return;
+
+    w->buf[7] |= REPLAY_KEYFRAMES;
+    w->keys = keys;
+    w->keys_size = size;
+    w->keys_len = 0;
+    w->key_interval = interval;
+    w->next_key = interval;
+}
+
+size_t ttm_replay_record_end(TtmReplayWriter *w, GameState *gs) {
+    put_varint(w, (gs->ticks - w->last_tick) << 3);
+    put_varint(w, gs->pieces);
+    put_varint(w, gs->lines);
+    put_varint(w, board_hash(gs));
+
+    if (w->key_interval) {
+        unsigned int count = (unsigned int)(w->keys_len /
+            KEYFRAME_SIZE(gs->width, gs->height));
+        unsigned char trailer[TRAILER_SIZE];
+        size_t i;
+
+        put_varint(w, count);
+        for (i = 0; i < w->keys_len; ++i)
+            put_byte(w, w->keys[i]);
+
+        put_u32(trailer, count);
+        put_u32(trailer + 4, KEYFRAME_SIZE(gs->width, gs->height));
+        trailer[8] = 'c';
+        trailer[9] = 't';
+        trailer[10] = 'k';
+        trailer[11] = TTM_REPLAY_VERSION;
+        for (i = 0; i < TRAILER_SIZE; ++i)
+            put_byte(w, trailer[i]);
+    }
+
+    gs->record = 0;
+    gs->record_ctx = 0;
+
+    return w->overflow ? 0 : w->len;
+}
+
+size_t ttm_replay_size(const unsigned char *data, size_t len) {
+    size_t pos = 8;
+    unsigned int v;
+    int i;
+
+    if (len < 8)
+        return 0;
+
+    /* seed, stream */
+    for (i = 0; i < 2; ++i)
+        if (!get_varint(data, len, &pos, &v))
+            return 0;
+
+    do {
+        if (!get_varint(data, len, &pos, &v))
+            return 0;
+    } while (v & 7);
+
+    /* pieces, lines, board hash */
+    for (i = 0; i < 3; ++i)
+        if (!get_varint(data, len, &pos, &v))
+            return 0;
+
+    if (data[7] & REPLAY_KEYFRAMES) {
+        size_t size = KEYFRAME_SIZE(data[4], data[5]);
+        if (!get_varint(data, len, &pos, &v) || len - pos < TRAILER_SIZE ||
+                (len - pos - TRAILER_SIZE) / size < v)
+            return 0;
+        pos += v * size + TRAILER_SIZE;
+    }
+
+    return pos;
+}
+
+/*
+    Parses the header and sets gs up for the start of the game.
+    len is the exact size of the replay.
+*/
+static int start_replay(GameState *gs, ReplayPlayer *p,
+        const unsigned char *data, size_t len, TtmReplayInfo *info) {
+    p->data = data;
+    p->len = len;
+    p->pos = 8;
+    p->keys = 0;
+    p->key_count = 0;
+    p->next_key = 0;
+    p->commands = 0;
+    p->result = CONTINUE_PLAY;
+    p->ended = 0;
+
+    info->keyframes = 0;
+    if (!len || data[0] != 'c' || data[1] != 't' || data[2] != 'r')
+        return TTM_REPLAY_CORRUPT;
+
+    info->width = data[4];
+    info->height = data[5];
+    info->randomizer = data[6];
+    info->options = data[7] & ~REPLAY_KEYFRAMES;
+
+    if (!get_varint(data, len, &p->pos, &info->seed) ||
+            !get_varint(data, len, &p->pos, &info->stream))
+        return TTM_REPLAY_CORRUPT;
+
+    if (data[3] != TTM_REPLAY_VERSION || info->options != REPLAY_OPTIONS ||
+            ttm_set_size(gs, info->width, info->height))
+        return TTM_REPLAY_UNSUPPORTED;
+
+    if (data[7] & REPLAY_KEYFRAMES) {
+        const unsigned char *trailer = data + len - TRAILER_SIZE;
+        unsigned int count = get_u32(trailer);
+
+        if (trailer[8] != 'c' || trailer[9] != 't' || trailer[10] != 'k' ||
+                get_u32(trailer + 4) != KEYFRAME_SIZE(gs->width, gs->height) ||
+                (len - TRAILER_SIZE) / KEYFRAME_SIZE(gs->width, gs->height) < count)
+            return TTM_REPLAY_CORRUPT;
+
+        p->keys = trailer - count * KEYFRAME_SIZE(gs->width, gs->height);
+        p->key_count = count;
+        info->keyframes = count;
+    }
+
+    ttm_seed_stream(gs, info->seed, info->stream);
+    gs->randomizer = (unsigned char)info->randomizer;
+    gs->record = 0;
+    init_game(gs);
+
+    return TTM_REPLAY_OK;
+}
+
+/* Checks the state before the command at offset against its keyframe. */
+static int check_keyframe(GameState *gs, ReplayPlayer *p, size_t offset) {
+    unsigned char state[KEYFRAME_SIZE(WIDTH, HEIGHT)];
+    const unsigned char *k;
+    int i;
+
+    if (p->next_key >= p->key_count)
+        return TTM_REPLAY_OK;
+
+    k = p->keys + p->next_key * KEYFRAME_SIZE(gs->width, gs->height);
+    if (get_u32(k + 12) != offset)
+        return TTM_REPLAY_OK;
+
+    encode_keyframe(gs, offset, state);
+    for (i = 0; i < KEYFRAME_SIZE(gs->width, gs->height); ++i)
+        if (state[i] != k[i])
+            return TTM_REPLAY_MISMATCH;
+
+    ++p->next_key;
+    return TTM_REPLAY_OK;
+}
+
+/*
+    Plays records until gs->ticks reaches until or the game ends.
+    A command past until is left for the next call.
+*/
+static int play_until(GameState *gs, ReplayPlayer *p, unsigned int until) {
+    while (!p->ended) {
+        size_t at = p->pos;
+        unsigned int v, tick;
+        UserCommand cmd;
+        int status;
+
+        if (!get_varint(p->data, p->len, &p->pos, &v))
+            return TTM_REPLAY_CORRUPT;
+
+        cmd = (UserCommand)(v & 7);
+        tick = gs->ticks + (v >> 3);
+
+        /* Only the end record may follow the end of the game. */
+        if (p->result != CONTINUE_PLAY) {
+            if (cmd != NOTHING || tick != gs->ticks)
+                return TTM_REPLAY_MISMATCH;
+            p->ended = 1;
+            break;
+        }
+
+        if (tick > until) {
+            p->pos = at;
+            p->result = ttm_step_idle(gs, until - gs->ticks);
+            return p->result == CONTINUE_PLAY ?
+                TTM_REPLAY_OK : TTM_REPLAY_MISMATCH;
+        }
+
+        if (cmd == NOTHING) {
+            p->result = ttm_step_idle(gs, tick - gs->ticks);
+            p->ended = 1;
+            break;
+        }
+
+        /*
+            Same as ttm_step, with the keyframe taken in between. More
+            commands on the same tick run without the timer.
+        */
+        if (tick != gs->ticks) {
+            p->result = ttm_step_idle(gs, tick - 1 - gs->ticks);
+            if (p->result != CONTINUE_PLAY)
+                return TTM_REPLAY_MISMATCH;
+            run_game_timer(gs);
+        }
+        status = check_keyframe(gs, p, at);
+        if (status != TTM_REPLAY_OK)
+            return status;
+
+        p->result = run_command_cycle(gs, cmd);
+        ++p->commands;
+    }
+
+    return TTM_REPLAY_OK;
+}
+
+/* Reads the footer once the end record was played and checks it. */
+static int finish_replay(GameState *gs, ReplayPlayer *p, TtmReplayInfo *info) {
+    unsigned int hash;
+
+    if (!get_varint(p->data, p->len, &p->pos, &info->pieces) ||
+            !get_varint(p->data, p->len, &p->pos, &info->lines) ||
+            !get_varint(p->data, p->len, &p->pos, &hash))
+        return TTM_REPLAY_CORRUPT;
+
+    if (info->pieces != gs->pieces || info->lines != gs->lines ||
+            hash != board_hash(gs) || p->next_key != p->key_count)
+        return TTM_REPLAY_MISMATCH;
+
+    return TTM_REPLAY_OK;
+}
+
+int ttm_replay_play(GameState *gs, const unsigned char *data, size_t len,
+        TtmReplayInfo *info) {
+    TtmReplayInfo local;
+    ReplayPlayer p;
+    int status;
+
+    if (!info)
+        info = &local;
+
+    len = ttm_replay_size(data, len);
+    status = start_replay(gs, &p, data, len, info);
+    if (status == TTM_REPLAY_OK)
+        status = play_until(gs, &p, ~0U);
+
+    info->ticks = gs->ticks;
+    info->commands = p.commands;
+    info->size = len;
+
+    if (status == TTM_REPLAY_OK)
+        status = finish_replay(gs, &p, info);
+
+    return status;
+}
+
+int ttm_replay_seek(GameState *gs, const unsigned char *data, size_t len,
+        unsigned int tick, TtmReplayInfo *info) {
+    TtmReplayInfo local;
+    ReplayPlayer p;
+    int status;
+
+    if (!info)
+        info = &local;
+
+    len = ttm_replay_size(data, len);
+    status = start_replay(gs, &p, data, len, info);
+
+    if (status == TTM_REPLAY_OK && p.key_count) {
+        /* Keyframes are in tick order, find the last one at or before tick. */
+        unsigned int lo = 0, hi = p.key_count;
+        while (lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            if (get_u32(p.keys + mid * KEYFRAME_SIZE(gs->width, gs->height)) <= tick)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo) {
+            const unsigned char *k = p.keys + (lo - 1) * KEYFRAME_SIZE(gs->width, gs->height);
+            unsigned int v;
+
+            p.pos = get_u32(k + 12);
+            p.next_key = lo;
+            if (!get_varint(data, len, &p.pos, &v) || (v & 7) == NOTHING)
+                return TTM_REPLAY_CORRUPT;
+
+            restore_keyframe(gs, k);
+            p.result = run_command_cycle(gs, (UserCommand)(v & 7));
+        }
+    }
+
+    if (status == TTM_REPLAY_OK)
+        status = play_until(gs, &p, tick);
+
+    info->ticks = gs->ticks;
+    info->commands = p.commands;
+    info->size = len;
+
+    if (status == TTM_REPLAY_OK && p.ended)
+        status = finish_replay(gs, &p, info);
+
+    return status;
+}
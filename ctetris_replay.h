@@ -0,0 +1,121 @@
+/* ctetris_replay.h */
+#ifndef CTETRIS_REPLAY_H
+#define CTETRIS_REPLAY_H
+
+#include <stddef.h>
+
+#include "ctetris.h"
+
+/*
+    Replay format, all numbers are LEB128 varints unless noted:
+
+        header      'c' 't' 'r' version         4 bytes
+                    width height randomizer     1 byte each
+                    options                     1 byte, bit 0 SHOW_NEXT,
+                                                bit 1 RANDOM_ROTATE,
+                                                bit 2 keyframes follow
+                    seed stream                 of ttm_seed_stream
+        commands    (ticks since previous command << 3) | UserCommand
+        end         (ticks since last command << 3) | NOTHING
+        footer      pieces lines board_hash
+        keyframes   count, then count fixed size records in tick order
+        trailer     count, record size          4 bytes each, little endian
+                    'c' 't' 'k' version         4 bytes
+
+    A command is recorded with the tick number on which its cycle ran,
+    so playback does not need the idle ticks in between. Commands read
+    on the same tick follow each other with 0 ticks in between. Replays
+    are self-delimiting and can be concatenated.
+
+    A keyframe is the full game state before a command, taken on the
+    first command after every interval pieces. The trailer ends the
+    replay so the table can be found from the end of a mapped file and
+    binary searched by tick, see ttm_replay_seek.
+*/
+#define TTM_REPLAY_VERSION  4
+
+/* Keyframe of the largest board, smaller boards take less. */
+#define TTM_REPLAY_KEYFRAME_SIZE    (41 + HEIGHT * ((WIDTH + 7) / 8))
+
+typedef struct TtmReplayWriterTag {
+    unsigned char *buf;     /* caller provided */
+    size_t size;
+    size_t len;             /* bytes written */
+    unsigned int last_tick;
+    int overflow;           /* a buffer was too small, replay is incomplete */
+    unsigned char *keys;    /* caller provided keyframe table */
+    size_t keys_size;
+    size_t keys_len;
+    unsigned int key_interval;
+    unsigned int next_key;  /* pieces of the next keyframe */
+} TtmReplayWriter;
+
+typedef struct TtmReplayInfoTag {
+    unsigned int seed;
+    unsigned int stream;
+    int width;
+    int height;
+    int randomizer;
+    int options;
+    unsigned int ticks;     /* tick at which the game ended */
+    unsigned int commands;
+    unsigned int pieces;
+    unsigned int lines;
+    unsigned int keyframes;
+    size_t size;            /* bytes taken by the replay */
+} TtmReplayInfo;
+
+/* ttm_replay_play results */
+#define TTM_REPLAY_OK           0
+#define TTM_REPLAY_CORRUPT      -1  /* malformed or truncated */
+#define TTM_REPLAY_UNSUPPORTED  -2  /* other version, options or a board over the build's */
+#define TTM_REPLAY_MISMATCH     -3  /* game did not play out as recorded */
+
+/*
+    Seeds the game and starts recording its commands into buf. The
+    board size has to be set before, see ttm_set_size. Call init_game
+    (or play_loop) afterwards, as usual.
+*/
+void ttm_replay_record_start(TtmReplayWriter *w, GameState *gs,
+        unsigned char *buf, size_t size,
+        unsigned int seed, unsigned int stream);
+
+/*
+    Adds a keyframe every interval pieces. keys holds the table until
+    ttm_replay_record_end copies it after the commands, each keyframe
+    takes TTM_REPLAY_KEYFRAME_SIZE bytes at most. Call after
+    ttm_replay_record_start.
+*/
+void ttm_replay_record_keyframes(TtmReplayWriter *w, unsigned char *keys,
+        size_t size, unsigned int interval);
+
+/*
+    Stops recording and writes the end of the replay.
+    Returns size of the replay or 0 if buf was too small.
+*/
+size_t ttm_replay_record_end(TtmReplayWriter *w, GameState *gs);
+
+/*
+    Plays a replay on gs as fast as possible and checks that the game
+    ends on the recorded tick with the recorded pieces, lines and board,
+    and that it passes through every keyframe. info may be NULL.
+*/
+int ttm_replay_play(GameState *gs, const unsigned char *data, size_t len,
+        TtmReplayInfo *info);
+
+/*
+    Leaves gs in the state after the given tick of the replay, or at the
+    end of the game if it ended earlier. Starts from the last keyframe
+    at or before tick, so it costs at most one keyframe interval of
+    playback. The footer is only checked if the end was reached.
+*/
+int ttm_replay_seek(GameState *gs, const unsigned char *data, size_t len,
+        unsigned int tick, TtmReplayInfo *info);
+
+/*
+    Returns size of the replay at the start of data without playing it,
+    or 0 if it is truncated. Used to split concatenated replays.
+*/
+size_t ttm_replay_size(const unsigned char *data, size_t len);
+
+#endif
@@ -0,0 +1,363 @@
+/* ctetris_search.c */
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctetris_pool.h"
+#include "ctetris_search.h"
+#include "ctetris_tt.h"
+
+/* Value of a board no piece fits on. */
+#define SEARCH_LOST     (-0x3FFFFFFF)
+
+struct TtmSearchWorkerTag {
+    TtmAi ai;
+    int top[TTM_SEARCH_MAX_BEAM];       /* best placements of a board */
+    int top_score[TTM_SEARCH_MAX_BEAM];
+    long nodes;
+    long hits;
+};
+
+void ttm_search_default_config(TtmSearchConfig *config) {
+    config->beam = 64;
+    config->preview = SHOW_NEXT ? 1 : 0;
+    config->chance = 1;
+    config->threads = ttm_cpu_count();
+    config->budget = TTM_SEARCH_DEFAULT_BUDGET;
+    config->table = NULL;
+}
+
+int ttm_search_init(TtmSearch *s, const TtmSearchConfig *config,
+        const TtmAiWeights *weights) {
+    size_t nodes;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+    s->config = *config;
+    s->weights = weights ? *weights : ttm_ai_default_weights;
+
+    if (s->config.beam < 1)
+        s->config.beam = 1;
+    if (s->config.beam > TTM_SEARCH_MAX_BEAM)
+        s->config.beam = TTM_SEARCH_MAX_BEAM;
+    if (s->config.preview < 0)
+        s->config.preview = 0;
+    if (s->config.preview > TTM_SEARCH_MAX_PREVIEW)
+        s->config.preview = TTM_SEARCH_MAX_PREVIEW;
+    if (s->config.threads < 1)
+        s->config.threads = 1;
+
+    /* GameState wants 64-byte alignment that malloc does not promise. */
+    nodes = (size_t)s->config.beam * (s->config.beam + 1);
+    s->mem = malloc(nodes * sizeof(TtmSearchNode) + 64);
+    s->counts = (int *)calloc(s->config.beam, sizeof(int));
+    s->order = (unsigned long long *)calloc(
+        (size_t)s->config.beam * s->config.beam, sizeof(unsigned long long));
+    s->values = (long long *)calloc(s->config.beam, sizeof(long long));
+    s->workers = (TtmSearchWorker *)calloc(s->config.threads,
+        sizeof(TtmSearchWorker));
+    s->pool = ttm_pool_create(s->config.threads);
+    if (!s->mem || !s->counts || !s->order || !s->values || !s->workers ||
+            !s->pool) {
+        ttm_search_free(s);
+        return -1;
+    }
+
+    s->beam = (TtmSearchNode *)((char *)s->mem +
+        (64 - (size_t)s->mem % 64) % 64);
+    s->children = s->beam + s->config.beam;
+
+    for (i = 0; i < s->config.threads; ++i)
+        ttm_ai_init(&s->workers[i].ai, &s->weights);
+
+    return 0;
+}
+
+void ttm_search_free(TtmSearch *s) {
+    free(s->mem);
+    free(s->counts);
+    free(s->order);
+    free(s->values);
+    free(s->workers);
+    ttm_pool_free(s->pool);
+    s->mem = NULL;
+    s->counts = NULL;
+    s->order = NULL;
+    s->values = NULL;
+    s->workers = NULL;
+    s->pool = NULL;
+}
+
+/*
+    Puts a piece where it spawns, with no next one, so the key is of the
+    board and this piece. Returns 0 or -1 if it does not fit.
+*/
+static int spawn_piece(GameState *gs, int index) {
+    gs->key ^= ttm_piece_key(gs->index, gs->next_tetrimino) ^
+        ttm_piece_key(index, -1);
+    gs->next_tetrimino = -1;
+    gs->index = index;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[index][0];
+    gs->pos_y = gs->height - 2;
+    gs->pos_x = (gs->width - tetriminos[index].box) / 2;
+
+    return check_collision(gs, 0) ? -1 : 0;
+}
+
+static int out_of_time(TtmSearch *s) {
+    if (s->timed_out)
+        return 1;
+    if (s->config.budget > 0 && ttm_seconds() > s->deadline)
+        s->timed_out = 1;
+    return s->timed_out;
+}
+
+/*
+    Places s->piece on board item of the beam and keeps its best
+    config.beam placements as children item * config.beam and on.
+*/
+static void expand_task(void *ctx, int worker, long item) {
+    TtmSearch *s = (TtmSearch *)ctx;
+    TtmSearchWorker *w = &s->workers[worker];
+    TtmAi *ai = &w->ai;
+    const TtmSearchNode *parent = &s->beam[item];
+    TtmSearchNode *out = &s->children[item * s->config.beam];
+    GameState gs;
+    int n, first, i, k, kept = 0;
+
+    /* The first ply is made whatever the time, it is the fallback. */
+    s->counts[item] = 0;
+    if (s->piece >= 0 && out_of_time(s))
+        return;
+
+    gs = parent->gs;
+    if (s->piece >= 0 && spawn_piece(&gs, s->piece))
+        return;
+
+    n = ttm_gen_placements(&ai->gen, &gs, ai->placements);
+    w->nodes += n;
+
+    for (first = 0; first < n; first += TTM_AI_BATCH) {
+        int count = n - first < TTM_AI_BATCH ? n - first : TTM_AI_BATCH;
+
+        /* Between batches too, one board can take longer than the budget. */
+        if (first && s->piece >= 0 && out_of_time(s))
+            return;
+
+        ttm_ai_score_batch(ai, &gs, first, count, parent->lines);
+
+        /* Insertion into the best so far, earlier placements win ties. */
+        for (i = 0; i < count; ++i) {
+            int score = ai->scores[i];
+
+            if (kept == s->config.beam && score <= w->top_score[kept - 1])
+                continue;
+            k = kept < s->config.beam ? kept++ : kept - 1;
+            for (; k > 0 && w->top_score[k - 1] < score; --k) {
+                w->top[k] = w->top[k - 1];
+                w->top_score[k] = w->top_score[k - 1];
+            }
+            w->top[k] = first + i;
+            w->top_score[k] = score;
+        }
+    }
+
+    for (k = 0; k < kept; ++k) {
+        const TtmPlacement *p = &ai->placements[w->top[k]];
+        TtmSearchNode *child = &out[k];
+
+        child->gs = gs;
+        child->gs.rot = p->rot;
+        child->gs.shape = &tetrimino_shapes[gs.index][p->rot];
+        child->gs.pos_x = p->x;
+        child->gs.pos_y = p->y;
+        place_tetrimino(&child->gs);
+        child->lines = parent->lines + check_and_collapse_rows(&child->gs);
+        child->score = w->top_score[k];
+        child->first = s->piece >= 0 ? parent->first : *p;
+    }
+
+    s->counts[item] = kept;
+}
+
+/*
+    Sums the best score of every piece on board item of the beam. Best
+    scores are cached in config.table without the lines removed before
+    the board, so they hold for any line of play that leads to it.
+*/
+static void chance_task(void *ctx, int worker, long item) {
+    TtmSearch *s = (TtmSearch *)ctx;
+    TtmSearchWorker *w = &s->workers[worker];
+    TtmAi *ai = &w->ai;
+    const TtmSearchNode *node = &s->beam[item];
+    int lines_score = node->lines * s->weights.lines;
+    GameState gs;
+    TtmTtData cached;
+    long long value = 0;
+    int piece, n, first, i;
+
+    for (piece = 0; piece < 7; ++piece) {
+        int best = SEARCH_LOST;
+
+        if (out_of_time(s))
+            return;
+
+        gs = node->gs;
+        if (spawn_piece(&gs, piece)) {
+            value += best;
+            continue;
+        }
+
+        if (s->config.table && ttm_tt_probe(s->config.table, gs.key, &cached)) {
+            ++w->hits;
+            value += cached.value + lines_score;
+            continue;
+        }
+
+        n = ttm_gen_placements(&ai->gen, &gs, ai->placements);
+        w->nodes += n;
+
+        for (first = 0; first < n; first += TTM_AI_BATCH) {
+            int count = n - first < TTM_AI_BATCH ? n - first : TTM_AI_BATCH;
+
+            if (first && out_of_time(s))
+                return;
+
+            ttm_ai_score_batch(ai, &gs, first, count, node->lines);
+            for (i = 0; i < count; ++i)
+                if (ai->scores[i] > best)
+                    best = ai->scores[i];
+        }
+
+        if (s->config.table) {
+            cached.value = best - lines_score;
+            cached.depth = 0;
+            cached.aux = 0;
+            ttm_tt_store(s->config.table, gs.key, &cached);
+        }
+
+        value += best;
+    }
+
+    s->values[item] = value;
+}
+
+/* Runs a ply over the whole beam. Returns 0 or -1 if out of time. */
+static int run_ply(TtmSearch *s, TtmPoolTask task) {
+    int threads = s->config.threads < s->beam_len ?
+        s->config.threads : s->beam_len;
+
+    ttm_pool_submit(s->pool, threads, s->beam_len, task, s);
+
+    return s->timed_out ? -1 : 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Makes the best config.beam children the new beam, one of each
+    board. Returns its size.
+*/
+static int select_beam(TtmSearch *s) {
+    int n = 0, kept = 0, i, j;
+
+    /* Best score first, then in the order the boards were made in. */
+    for (i = 0; i < s->beam_len; ++i)
+        for (j = 0; j < s->counts[i]; ++j)
+            s->order[n++] = (unsigned long long)
+                ((unsigned int)s->children[i * s->config.beam + j].score ^
+                    0x7FFFFFFFU) << 32 | (unsigned int)(i * s->config.beam + j);
+
+    qsort(s->order, n, sizeof(*s->order), compare_keys);
+
+    for (i = 0; i < n && kept < s->config.beam; ++i) {
+        const TtmSearchNode *c = &s->children[(unsigned int)s->order[i]];
+
+        for (j = 0; j < kept; ++j) {
+            const TtmSearchNode *k = &s->beam[j];
+            if (k->gs.key == c->gs.key &&
+                    !memcmp(k->gs.board, c->gs.board, sizeof(c->gs.board)))
+                break;
+        }
+        if (j == kept)
+            s->beam[kept++] = *c;
+    }
+
+    return kept;
+}
+
+int ttm_search_choose(TtmSearch *s, const GameState *gs, TtmPlacement *best) {
+    double start = ttm_seconds();
+    int ply, i, found = 0, known;
+
+    s->deadline = start + s->config.budget;
+    s->timed_out = 0;
+    s->stats.plies = 0;
+    s->stats.nodes = 0;
+    s->stats.table_hits = 0;
+    for (i = 0; i < s->config.threads; ++i) {
+        s->workers[i].nodes = 0;
+        s->workers[i].hits = 0;
+    }
+
+    /* Only what the game shows, the rest is hidden from the player. */
+    known = ttm_preview(gs, s->pieces, s->config.preview);
+
+    /* Boards of the search are not the game's, they do not count. */
+    s->beam[0].gs = *gs;
+    s->beam[0].gs.stats = NULL;
+    s->beam[0].score = 0;
+    s->beam[0].lines = 0;
+    s->beam_len = 1;
+
+    for (ply = 0; ply <= known; ++ply) {
+        int len;
+
+        s->piece = ply ? s->pieces[ply - 1] : -1;
+        if (run_ply(s, expand_task))
+            break;
+
+        len = select_beam(s);
+        if (!len)
+            break;
+        s->beam_len = len;
+        ++s->stats.plies;
+    }
+
+    if (!s->stats.plies)
+        found = -1;
+    else if (s->config.chance && ply > known &&
+            !run_ply(s, chance_task)) {
+        for (i = 1; i < s->beam_len; ++i)
+            if (s->values[i] > s->values[found])
+                found = i;
+        ++s->stats.plies;
+    }
+
+    if (found >= 0)
+        *best = s->beam[found].first;
+
+    for (i = 0; i < s->config.threads; ++i) {
+        s->stats.nodes += s->workers[i].nodes;
+        s->stats.table_hits += s->workers[i].hits;
+    }
+    s->stats.timed_out = s->timed_out;
+    s->stats.seconds = ttm_seconds() - start;
+
+    return found < 0 ? -1 : 0;
+}
+
+static int search_choose(void *ctx, const GameState *gs, TtmPlacement *best) {
+    return ttm_search_choose((TtmSearch *)ctx, gs, best);
+}
+
+void ttm_search_player_init(TtmSearch *s, TtmAiPlayer *player) {
+    ttm_ai_player_init(player);
+    player->choose = search_choose;
+    player->choose_ctx = s;
+}
@@ -0,0 +1,118 @@
+/* ctetris_search.h */
+#ifndef CTETRIS_SEARCH_H
+#define CTETRIS_SEARCH_H
+
+#include "ctetris.h"
+#include "ctetris_ai.h"
+#include "ctetris_pool.h"
+#include "ctetris_tt.h"
+
+/*
+    Lookahead player. Placements are chosen by a beam search over the
+    pieces known in advance: the active one, then the preview that
+    ttm_preview gives. Every ply places the next known piece on each
+    board of the beam, scores the boards with the weights of ttm_ai, and
+    keeps the best beam of them. After the known pieces an expectimax
+    ply scores every board of the beam by the mean over all 7 pieces of
+    the best placement of that piece.
+
+    The boards of a ply are spread over the threads of a TtmPool that
+    lives as long as the search. Results do not depend on the number of
+    threads.
+
+    Every move has a time budget. A ply that does not finish in it is
+    thrown away and the move is taken from the last ply that did, down
+    to the first one, which is the choice of ttm_ai_choose and is always
+    made. To play from the 50 Hz loop the budget has to be under a tick.
+
+    A frontend plays with it by setting up a player with
+    ttm_search_player_init and calling ttm_ai_command as usual.
+*/
+
+/* Widest beam. */
+#define TTM_SEARCH_MAX_BEAM     256
+
+/* Longest preview. */
+#define TTM_SEARCH_MAX_PREVIEW  8
+
+/* Half a tick of the play loop, leaves time for the rest of it. */
+#define TTM_SEARCH_DEFAULT_BUDGET   0.010
+
+typedef struct TtmSearchConfigTag {
+    int beam;               /* boards kept per ply */
+    int preview;            /* pieces after the active one to plan for,
+                               as far as the game shows them */
+    int chance;             /* add the expectimax ply */
+    int threads;
+    double budget;          /* seconds per move, 0 for no limit */
+
+    /*
+        Best scores of the expectimax ply, or NULL. Can be shared by
+        searches on any threads that use the same weights.
+    */
+    TtmTt *table;
+} TtmSearchConfig;
+
+/* Of the last move. */
+typedef struct TtmSearchStatsTag {
+    int plies;              /* finished, the expectimax one included */
+    int timed_out;
+    long nodes;             /* boards scored */
+    long table_hits;        /* pieces of the expectimax ply found in table */
+    double seconds;
+} TtmSearchStats;
+
+/* Board of the beam, with the first placement of its line of play. */
+typedef struct TtmSearchNodeTag {
+    GameState gs;
+    int score;
+    int lines;              /* removed since the root */
+    TtmPlacement first;
+} TtmSearchNode;
+
+typedef struct TtmSearchWorkerTag TtmSearchWorker;
+
+typedef struct TtmSearchTag {
+    TtmSearchConfig config;
+    TtmAiWeights weights;
+
+    TtmSearchNode *beam;
+    int beam_len;
+    TtmSearchNode *children;    /* config.beam slots per board of the beam */
+    int *counts;                /* children of each board */
+    unsigned long long *order;  /* sort keys of the children */
+    long long *values;          /* of the expectimax ply */
+    TtmSearchWorker *workers;
+    TtmPool *pool;              /* config.threads workers */
+    void *mem;
+
+    int pieces[TTM_SEARCH_MAX_PREVIEW + 1];
+    int piece;                  /* of the ply being searched, -1 at the root */
+    double deadline;
+    volatile int timed_out;
+
+    TtmSearchStats stats;
+} TtmSearch;
+
+/* beam 64, preview 1 with SHOW_NEXT or else 0, all processors, no table. */
+void ttm_search_default_config(TtmSearchConfig *config);
+
+/*
+    Allocates the search and starts its threads, weights are
+    ttm_ai_default_weights if NULL. Returns 0 or -1 if out of memory or
+    threads could not be started.
+*/
+int ttm_search_init(TtmSearch *s, const TtmSearchConfig *config,
+    const TtmAiWeights *weights);
+void ttm_search_free(TtmSearch *s);
+
+/*
+    Picks a placement of the active tetrimino of gs within the budget.
+    Returns 0 or -1 if the tetrimino has no placement.
+*/
+int ttm_search_choose(TtmSearch *s, const GameState *gs, TtmPlacement *best);
+
+/* Starts a new game of a player that picks its targets with s. */
+void ttm_search_player_init(TtmSearch *s, TtmAiPlayer *player);
+
+#endif
@@ -0,0 +1,508 @@
+/* ctetris_sim.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctetris.h"
+#include "ctetris_ai.h"
+#include "ctetris_pool.h"
+#include "ctetris_replay.h"
+#include "ctetris_search.h"
+#include "ctetris_stats.h"
+
+#define ttm_read_command_callback(gs) NOTHING
+
+#include "ctetris.c"
+
+/* Games a worker runs side by side from its own pool of states. */
+#define SIM_LANES       8
+
+/* Commands a piece gets before it is dropped where it is. */
+#define SIM_MAX_MOVES   8
+
+/* Replay bytes a piece can take at most: its commands, 2 bytes each. */
+#define SIM_REPLAY_PER_PIECE    (2 * (SIM_MAX_MOVES + 1))
+
+/* Replay buffer of a game without a piece limit. */
+#define SIM_REPLAY_UNLIMITED    (1 << 20)
+
+typedef struct SimGameTag {
+    GameState gs;
+    unsigned int policy_rng;
+    unsigned int last_pieces;
+    int target_rot;
+    int target_x;
+    int moves;
+    int running;
+    TtmReplayWriter replay;
+    TtmAiPlayer ai_player;
+} SimGame;
+
+typedef struct SimStatsTag {
+    unsigned long long games;
+    unsigned long long pieces;
+    unsigned long long ticks;
+    unsigned long long lines;
+    unsigned long long clears[5];   /* placements by number of rows removed */
+    unsigned long long lost_replays;
+} SimStats;
+
+typedef struct SimWorkerTag {
+    SimGame *lanes;
+    void *lanes_mem;
+    unsigned char *replay_bufs;     /* one per lane */
+    unsigned char *key_bufs;        /* one per lane */
+    TtmAi *ai;                      /* shared by the lanes */
+    TtmSearch *search;              /* shared by the lanes, with -l */
+    unsigned char *replays;         /* finished games */
+    size_t replays_len;
+    size_t replays_size;
+    SimStats stats;
+} SimWorker;
+
+typedef struct SimTag {
+    long games;
+    unsigned int seed;
+    unsigned int max_pieces;
+    int width;                      /* board of every game */
+    int height;
+    int randomizer;
+    int ai;                         /* play with ttm_ai_command */
+    int preview;                    /* of the lookahead search, -1 for none */
+    TtmTt *table;                   /* shared by the searches */
+    size_t replay_size;             /* per game, 0 if not recording */
+    size_t keys_size;               /* per game, 0 without keyframes */
+    unsigned int key_interval;
+    TtmStats *game_stats;           /* one per game with -i, else NULL */
+    SimWorker *workers;
+} Sim;
+
+unsigned int xorshift32(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+/* Spreads seed bits so that neighbouring game ids give unrelated moves. */
+unsigned int mix32(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x ? x : 1;
+}
+
+void start_game(Sim *sim, SimWorker *w, SimGame *game,
+        unsigned char *replay_buf, unsigned char *key_buf, long id) {
+    ttm_set_size(&game->gs, sim->width, sim->height);
+    game->gs.randomizer = (unsigned char)sim->randomizer;
+    game->gs.preview = (unsigned char)(sim->preview > SHOW_NEXT ?
+        sim->preview - SHOW_NEXT : 0);
+    game->gs.record = NULL;
+    game->gs.stats = sim->game_stats ? &sim->game_stats[id] : NULL;
+
+    /* Game id selects the stream so results do not depend on threads. */
+    if (sim->replay_size) {
+        ttm_replay_record_start(&game->replay, &game->gs, replay_buf,
+            sim->replay_size, sim->seed, (unsigned int)id);
+        ttm_replay_record_keyframes(&game->replay, key_buf, sim->keys_size,
+            sim->key_interval);
+    } else {
+        ttm_seed_stream(&game->gs, sim->seed, (unsigned int)id);
+    }
+
+    game->policy_rng = mix32(mix32(sim->seed) ^ (unsigned int)id);
+    game->gs.user = game;
+    init_game(&game->gs);
+    game->last_pieces = ~0U;
+    if (w->search)
+        ttm_search_player_init(w->search, &game->ai_player);
+    else
+        ttm_ai_player_init(&game->ai_player);
+    game->running = 1;
+}
+
+/* Appends the finished game's replay to the worker's output. */
+int save_replay(SimWorker *worker, SimGame *game) {
+    size_t len = ttm_replay_record_end(&game->replay, &game->gs);
+
+    if (!len)
+        return 0;
+
+    if (worker->replays_len + len > worker->replays_size) {
+        size_t size = worker->replays_size * 2 + len;
+        unsigned char *p = (unsigned char *)realloc(worker->replays, size);
+        if (!p)
+            return 0;
+        worker->replays = p;
+        worker->replays_size = size;
+    }
+
+    memcpy(worker->replays + worker->replays_len, game->replay.buf, len);
+    worker->replays_len += len;
+    return 1;
+}
+
+/*
+    Random placement policy: for every new piece pick an orientation
+    and a column, rotate and shift towards them, then drop.
+*/
+UserCommand sim_policy(SimGame *game) {
+    GameState *gs = &game->gs;
+
+    if (gs->pieces != game->last_pieces) {
+        game->last_pieces = gs->pieces;
+        game->target_rot = xorshift32(&game->policy_rng) % 4;
+        game->target_x = (int)(xorshift32(&game->policy_rng) % (gs->width + 2)) - 2;
+        game->moves = 0;
+    }
+
+    if (++game->moves > SIM_MAX_MOVES)
+        return DROP;
+    if (gs->rot != game->target_rot)
+        return ROTATE_CW;
+    if (gs->pos_x < game->target_x)
+        return MOVE_RIGHT;
+    if (gs->pos_x > game->target_x)
+        return MOVE_LEFT;
+    return DROP;
+}
+
+/*
+    Pool task: runs games [batch * SIM_LANES, batch * SIM_LANES + SIM_LANES)
+    to the end, stepping them in turn on the worker's own game states.
+*/
+void run_batch(void *ctx, int worker, long batch) {
+    Sim *sim = (Sim *)ctx;
+    SimWorker *w = &sim->workers[worker];
+    SimStats *stats = &w->stats;
+    SimGame *pool = w->lanes;
+    SimStats st;
+    long first = batch * SIM_LANES;
+    int lanes = 0, running, i;
+
+    /* Counted locally, workers' stats share cache lines. */
+    memset(&st, 0, sizeof(st));
+
+    for (i = 0; i < SIM_LANES && first + i < sim->games; ++i, ++lanes)
+        start_game(sim, w, &pool[i], w->replay_bufs + i * sim->replay_size,
+            w->key_bufs + i * sim->keys_size, first + i);
+
+    running = lanes;
+    while (running) {
+        for (i = 0; i < lanes; ++i) {
+            SimGame *game = &pool[i];
+            unsigned int lines;
+            UserCommand cmd;
+            PlayCycleResult result;
+
+            if (!game->running)
+                continue;
+
+            /* The player is the input of the game. */
+            stats_time(&game->gs, TTM_TIMER_INPUT, cmd = sim->ai ?
+                ttm_ai_command(w->ai, &game->ai_player, &game->gs) :
+                sim_policy(game));
+
+            lines = game->gs.lines;
+            result = ttm_step(&game->gs, cmd);
+            ++st.ticks;
+
+            if (game->gs.lines != lines)
+                ++st.clears[game->gs.lines - lines];
+
+            if (result != CONTINUE_PLAY ||
+                    (sim->max_pieces && game->gs.pieces >= sim->max_pieces)) {
+                game->running = 0;
+                --running;
+                ++st.games;
+                st.pieces += game->gs.pieces;
+                st.lines += game->gs.lines;
+                if (sim->replay_size && !save_replay(w, game))
+                    ++st.lost_replays;
+            }
+        }
+    }
+
+    stats->games += st.games;
+    stats->pieces += st.pieces;
+    stats->ticks += st.ticks;
+    stats->lines += st.lines;
+    for (i = 0; i < 5; ++i)
+        stats->clears[i] += st.clears[i];
+    stats->lost_replays += st.lost_replays;
+}
+
+void print_timer(const char *name, const TtmTimer *t) {
+    printf("%-12s %.0f cycles mean, %llu max\n", name,
+        t->count ? (double)t->cycles / t->count : 0.0, t->max);
+}
+
+void usage() {
+    fprintf(stderr,
+        "usage: ctetris_sim [-g games] [-t threads] [-s seed] [-p max_pieces] [-b] [-a]\n"
+        "                   [-w width] [-h height] [-l preview [-m megabytes]]\n"
+        "                   [-r replay_file [-k interval]] [-i stats_file]\n"
+        "  -g  number of games to run (default 100000)\n"
+        "  -t  worker threads (default: all processors)\n"
+        "  -s  seed of the piece and move sequences (default 1)\n"
+        "  -p  end a game after this many pieces, 0 for no limit (default 10000)\n"
+        "  -b  draw pieces from a 7-bag instead of uniformly\n"
+        "  -w  board columns, %d at most (default %d)\n"
+        "  -h  board rows, %d at most (default %d)\n"
+        "  -a  play with the heuristic player instead of random moves\n"
+        "  -l  show preview pieces and play with the heuristic player looking\n"
+        "      that far ahead, see ctetris_search.h\n"
+        "  -m  cache of the lookahead searches shared by all threads, 0 for none (default 0)\n"
+        "  -r  record all games into replay_file, see ctetris_verify\n"
+        "  -k  add a keyframe to replays every interval pieces\n"
+        "  -i  write the counters of every game into stats_file, as CSV if its\n"
+        "      name ends in .csv, see ctetris_stats.h. Needs a build with\n"
+        "      -DTTM_STATS=1\n",
+        WIDTH, WIDTH, HEIGHT, HEIGHT);
+}
+
+int main(int argc, char **argv) {
+    Sim sim;
+    SimStats total;
+    TtmTt table;
+    size_t table_mb = 0;
+    int threads = ttm_cpu_count();
+    long batches;
+    const char *replay_file = NULL;
+    FILE *replay_out = NULL;
+    int replay_error = 0;
+    const char *stats_file = NULL;
+    TtmStats stats_total;
+    double start, elapsed;
+    int i, j;
+
+    sim.games = 100000;
+    sim.seed = 1;
+    sim.max_pieces = 10000;
+    sim.width = WIDTH;
+    sim.height = HEIGHT;
+    sim.randomizer = TTM_UNIFORM;
+    sim.key_interval = 0;
+    sim.ai = 0;
+    sim.preview = -1;
+
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || !arg[1] || arg[2]) {
+            usage();
+            return 2;
+        }
+        if (arg[1] == 'b') {
+            sim.randomizer = TTM_BAG7;
+            continue;
+        }
+        if (arg[1] == 'a') {
+            sim.ai = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return 2;
+        }
+        switch (arg[1]) {
+            case 'g': sim.games = strtol(argv[++i], NULL, 0); break;
+            case 't': threads = atoi(argv[++i]); break;
+            case 's': sim.seed = (unsigned int)strtoul(argv[++i], NULL, 0); break;
+            case 'p': sim.max_pieces = (unsigned int)strtoul(argv[++i], NULL, 0); break;
+            case 'r': replay_file = argv[++i]; break;
+            case 'k': sim.key_interval = (unsigned int)strtoul(argv[++i], NULL, 0); break;
+            case 'l': sim.preview = atoi(argv[++i]); sim.ai = 1; break;
+            case 'm': table_mb = (size_t)strtoul(argv[++i], NULL, 0); break;
+            case 'w': sim.width = atoi(argv[++i]); break;
+            case 'h': sim.height = atoi(argv[++i]); break;
+            case 'i': stats_file = argv[++i]; break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    if (sim.width < TTM_MIN_SIZE || sim.width > WIDTH ||
+            sim.height < TTM_MIN_SIZE || sim.height > HEIGHT) {
+        fprintf(stderr, "board has to be from %dx%d to %dx%d\n",
+            TTM_MIN_SIZE, TTM_MIN_SIZE, WIDTH, HEIGHT);
+        return 2;
+    }
+
+    sim.game_stats = NULL;
+    if (stats_file) {
+        if (!TTM_STATS) {
+            fprintf(stderr, "-i needs a build with -DTTM_STATS=1\n");
+            return 2;
+        }
+        sim.game_stats = (TtmStats *)calloc(sim.games, sizeof(TtmStats));
+        if (!sim.game_stats)
+            return 1;
+    }
+
+    sim.replay_size = 0;
+    sim.keys_size = 0;
+    if (replay_file) {
+        unsigned int pieces = sim.max_pieces ? sim.max_pieces :
+            SIM_REPLAY_UNLIMITED / SIM_REPLAY_PER_PIECE;
+
+        replay_out = fopen(replay_file, "wb");
+        if (!replay_out) {
+            perror(replay_file);
+            return 1;
+        }
+        if (sim.key_interval)
+            sim.keys_size = (pieces / sim.key_interval + 1) *
+                TTM_REPLAY_KEYFRAME_SIZE;
+        /* The keyframe table is copied after the commands on the end. */
+        sim.replay_size = 64 + (size_t)pieces * SIM_REPLAY_PER_PIECE +
+            sim.keys_size;
+    }
+
+    sim.table = NULL;
+    if (sim.preview >= 0 && table_mb) {
+        if (ttm_tt_init(&table, table_mb << 20))
+            return 1;
+        sim.table = &table;
+    }
+
+    sim.workers = (SimWorker *)calloc(threads, sizeof(SimWorker));
+    if (!sim.workers)
+        return 1;
+
+    for (i = 0; i < threads; ++i) {
+        /* GameState wants 64-byte alignment that malloc does not promise. */
+        char *mem = (char *)malloc(SIM_LANES * sizeof(SimGame) + 64);
+        if (!mem)
+            return 1;
+        sim.workers[i].lanes_mem = mem;
+        sim.workers[i].lanes = (SimGame *)(mem + (64 - (size_t)mem % 64) % 64);
+        if (sim.replay_size) {
+            sim.workers[i].replay_bufs =
+                (unsigned char *)malloc(SIM_LANES * sim.replay_size);
+            sim.workers[i].key_bufs =
+                (unsigned char *)malloc(SIM_LANES * sim.keys_size + 1);
+            if (!sim.workers[i].replay_bufs || !sim.workers[i].key_bufs)
+                return 1;
+        }
+        if (sim.ai) {
+            sim.workers[i].ai = (TtmAi *)malloc(sizeof(TtmAi));
+            if (!sim.workers[i].ai)
+                return 1;
+            ttm_ai_init(sim.workers[i].ai, NULL);
+        }
+        if (sim.preview >= 0) {
+            /* Games are spread over the threads, not the search. */
+            TtmSearchConfig config;
+            ttm_search_default_config(&config);
+            config.preview = sim.preview;
+            config.threads = 1;
+            config.budget = 0;
+            config.table = sim.table;
+            sim.workers[i].search = (TtmSearch *)malloc(sizeof(TtmSearch));
+            if (!sim.workers[i].search ||
+                    ttm_search_init(sim.workers[i].search, &config, NULL))
+                return 1;
+        }
+    }
+
+    batches = (sim.games + SIM_LANES - 1) / SIM_LANES;
+
+    start = ttm_seconds();
+    if (ttm_pool_run(threads, batches, run_batch, &sim))
+        fprintf(stderr, "warning: not all worker threads started\n");
+    elapsed = ttm_seconds() - start;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < threads; ++i) {
+        SimStats *st = &sim.workers[i].stats;
+        total.games += st->games;
+        total.pieces += st->pieces;
+        total.ticks += st->ticks;
+        total.lines += st->lines;
+        for (j = 0; j < 5; ++j)
+            total.clears[j] += st->clears[j];
+        total.lost_replays += st->lost_replays;
+        /* Replays are in worker order, which depends on scheduling. */
+        if (replay_out && sim.workers[i].replays_len &&
+                fwrite(sim.workers[i].replays, sim.workers[i].replays_len, 1,
+                    replay_out) != 1)
+            replay_error = 1;
+        free(sim.workers[i].replays);
+        free(sim.workers[i].replay_bufs);
+        free(sim.workers[i].key_bufs);
+        free(sim.workers[i].ai);
+        if (sim.workers[i].search) {
+            ttm_search_free(sim.workers[i].search);
+            free(sim.workers[i].search);
+        }
+        free(sim.workers[i].lanes_mem);
+    }
+    free(sim.workers);
+    if (sim.table)
+        ttm_tt_free(sim.table);
+
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    printf("board        %dx%d\n", sim.width, sim.height);
+    printf("threads      %d\n", threads);
+    printf("games        %llu\n", total.games);
+    printf("pieces       %llu\n", total.pieces);
+    printf("ticks        %llu\n", total.ticks);
+    printf("time         %.3f s\n", elapsed);
+    printf("games/sec    %.0f\n", total.games / elapsed);
+    printf("pieces/sec   %.0f\n", total.pieces / elapsed);
+    printf("ticks/sec    %.0f\n", total.ticks / elapsed);
+    printf("lines        %llu (%.2f per game)\n", total.lines,
+        total.games ? (double)total.lines / total.games : 0.0);
+    printf("clears       single %llu, double %llu, triple %llu, tetris %llu\n",
+        total.clears[1], total.clears[2], total.clears[3], total.clears[4]);
+
+    if (stats_file) {
+        size_t len = strlen(stats_file);
+        int format = len >= 4 && !strcmp(stats_file + len - 4, ".csv") ?
+            TTM_STATS_CSV : TTM_STATS_BINARY;
+        FILE *out = fopen(stats_file, format == TTM_STATS_CSV ? "w" : "wb");
+        int error = !out || ttm_stats_write_header(out, format);
+
+        memset(&stats_total, 0, sizeof(stats_total));
+        for (i = 0; i < sim.games; ++i) {
+            ttm_stats_add(&stats_total, &sim.game_stats[i]);
+            if (!error)
+                error = ttm_stats_write(out, format, (unsigned long)i,
+                    &sim.game_stats[i]);
+        }
+        if ((out && fclose(out)) || error) {
+            perror(stats_file);
+            return 1;
+        }
+        free(sim.game_stats);
+
+        printf("collisions   %llu of %llu checks\n", stats_total.collisions,
+            stats_total.collision_checks);
+        printf("rotations    %llu rejected\n", stats_total.rotations_rejected);
+        print_timer("cycle", &stats_total.timers[TTM_TIMER_CYCLE]);
+        print_timer("input", &stats_total.timers[TTM_TIMER_INPUT]);
+    }
+
+    if (replay_out) {
+        if (fclose(replay_out) || replay_error) {
+            perror(replay_file);
+            return 1;
+        }
+        printf("replays      %llu written, %llu lost\n",
+            total.games - total.lost_replays, total.lost_replays);
+        if (total.lost_replays)
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,277 @@
+/* ctetris_stats.c */
+#include <string.h>
+
+#include "ctetris_stats.h"
+
+#define TIMER_VALUES    (3 + TTM_STATS_BUCKETS)
+#define HDRS            2
+#define STATS_VALUES    (9 + TTM_TIMERS * TIMER_VALUES + HDRS * 3)
+
+static const char *const timer_names[TTM_TIMERS] = {
+    "cycle", "render", "input"
+};
+
+static const char *const hdr_names[HDRS] = { "latency", "lateness" };
+
+/* Histogram h of stats, in the order of hdr_names. */
+#define get_hdr(stats, h)   ((h) ? &(stats)->lateness : &(stats)->latency)
+
+/* Values of a record in file order, without the id. */
+static void get_values(const TtmStats *stats, unsigned long long *v) {
+    int i, t;
+
+    *v++ = stats->collision_checks;
+    *v++ = stats->collisions;
+    *v++ = stats->rotations_rejected;
+    *v++ = stats->spawns;
+    for (i = 0; i < 5; ++i)
+        *v++ = stats->clears[i];
+
+    for (t = 0; t < TTM_TIMERS; ++t) {
+        const TtmTimer *timer = &stats->timers[t];
+        *v++ = timer->count;
+        *v++ = timer->cycles;
+        *v++ = timer->max;
+        for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+            *v++ = timer->hist[i];
+    }
+
+    for (t = 0; t < HDRS; ++t) {
+        const TtmHdr *hdr = get_hdr(stats, t);
+        *v++ = hdr->count;
+        *v++ = hdr->total;
+        *v++ = hdr->max;
+    }
+}
+
+static void set_values(TtmStats *stats, const unsigned long long *v) {
+    int i, t;
+
+    stats->collision_checks = *v++;
+    stats->collisions = *v++;
+    stats->rotations_rejected = *v++;
+    stats->spawns = *v++;
+    for (i = 0; i < 5; ++i)
+        stats->clears[i] = *v++;
+
+    for (t = 0; t < TTM_TIMERS; ++t) {
+        TtmTimer *timer = &stats->timers[t];
+        timer->count = *v++;
+        timer->cycles = *v++;
+        timer->max = *v++;
+        for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+            timer->hist[i] = *v++;
+    }
+
+    for (t = 0; t < HDRS; ++t) {
+        TtmHdr *hdr = get_hdr(stats, t);
+        hdr->count = *v++;
+        hdr->total = *v++;
+        hdr->max = *v++;
+    }
+}
+
+static int put_varint(FILE *f, unsigned long long v) {
+    while (v >= 0x80) {
+        if (putc((int)(v & 0x7F) | 0x80, f) == EOF)
+            return -1;
+        v >>= 7;
+    }
+    return putc((int)v, f) == EOF ? -1 : 0;
+}
+
+/*
+    Reads a varint. Returns 1, 0 at the end of the file or -1 if it is
+    truncated or does not fit 64 bits.
+*/
+static int get_varint(FILE *f, unsigned long long *v) {
+    int c, shift = 0;
+
+    *v = 0;
+    while ((c = getc(f)) != EOF) {
+        if (shift > 63 || (shift == 63 && (c & 0x7E)))
+            return -1;
+        *v |= (unsigned long long)(c & 0x7F) << shift;
+        if (!(c & 0x80))
+            return 1;
+        shift += 7;
+    }
+
+    return shift ? -1 : 0;
+}
+
+int ttm_stats_write_header(FILE *f, int format) {
+    int t, i;
+
+    if (format == TTM_STATS_BINARY) {
+        unsigned char header[7] = { 'c', 't', 's', TTM_STATS_VERSION,
+            TTM_TIMERS, TTM_STATS_BUCKETS, TTM_HDR_BUCKETS };
+        return fwrite(header, sizeof(header), 1, f) == 1 ? 0 : -1;
+    }
+
+    fprintf(f, "game,collision_checks,collisions,rotations_rejected,spawns,"
+        "clears0,clears1,clears2,clears3,clears4");
+    for (t = 0; t < TTM_TIMERS; ++t) {
+        fprintf(f, ",%s_count,%s_cycles,%s_max", timer_names[t],
+            timer_names[t], timer_names[t]);
+        for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+            fprintf(f, ",%s_b%d", timer_names[t], i);
+    }
+    for (t = 0; t < HDRS; ++t)
+        fprintf(f, ",%s_count,%s_us,%s_max", hdr_names[t], hdr_names[t],
+            hdr_names[t]);
+    for (t = 0; t < HDRS; ++t)
+        for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+            fprintf(f, ",%s_h%d", hdr_names[t], i);
+
+    return fprintf(f, "\n") < 0 ? -1 : 0;
+}
+
+int ttm_stats_write(FILE *f, int format, unsigned long id,
+        const TtmStats *stats) {
+    unsigned long long v[STATS_VALUES];
+    int i, h;
+
+    get_values(stats, v);
+
+    if (format == TTM_STATS_BINARY) {
+        if (put_varint(f, id))
+            return -1;
+        for (i = 0; i < STATS_VALUES; ++i)
+            if (put_varint(f, v[i]))
+                return -1;
+
+        /* Buckets in use, each after the gap from the one before. */
+        for (h = 0; h < HDRS; ++h) {
+            const TtmHdr *hdr = get_hdr(stats, h);
+            int used = 0, last = -1;
+
+            for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+                used += hdr->hist[i] != 0;
+            if (put_varint(f, used))
+                return -1;
+            for (i = 0; i < TTM_HDR_BUCKETS; ++i) {
+                if (!hdr->hist[i])
+                    continue;
+                if (put_varint(f, i - last - 1) ||
+                        put_varint(f, hdr->hist[i]))
+                    return -1;
+                last = i;
+            }
+        }
+        return 0;
+    }
+
+    fprintf(f, "%lu", id);
+    for (i = 0; i < STATS_VALUES; ++i)
+        fprintf(f, ",%llu", v[i]);
+    for (h = 0; h < HDRS; ++h)
+        for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+            fprintf(f, ",%llu", get_hdr(stats, h)->hist[i]);
+
+    return fprintf(f, "\n") < 0 ? -1 : 0;
+}
+
+int ttm_stats_read_header(FILE *f) {
+    unsigned char header[7];
+
+    if (fread(header, sizeof(header), 1, f) != 1 ||
+            memcmp(header, "cts", 3) || header[3] != TTM_STATS_VERSION ||
+            header[4] != TTM_TIMERS || header[5] != TTM_STATS_BUCKETS ||
+            header[6] != TTM_HDR_BUCKETS)
+        return -1;
+
+    return 0;
+}
+
+int ttm_stats_read(FILE *f, unsigned long *id, TtmStats *stats) {
+    unsigned long long v[STATS_VALUES], game, used, gap;
+    int i, h, r = get_varint(f, &game);
+
+    if (r <= 0)
+        return r;
+
+    for (i = 0; i < STATS_VALUES; ++i)
+        if (get_varint(f, &v[i]) != 1)
+            return -1;
+
+    *id = (unsigned long)game;
+    set_values(stats, v);
+
+    for (h = 0; h < HDRS; ++h) {
+        TtmHdr *hdr = get_hdr(stats, h);
+        int b = -1;
+
+        for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+            hdr->hist[i] = 0;
+        if (get_varint(f, &used) != 1 || used > TTM_HDR_BUCKETS)
+            return -1;
+        for (; used; --used) {
+            if (get_varint(f, &gap) != 1 || gap >= TTM_HDR_BUCKETS ||
+                    b + 1 + (int)gap >= TTM_HDR_BUCKETS)
+                return -1;
+            b += 1 + (int)gap;
+            if (get_varint(f, &hdr->hist[b]) != 1)
+                return -1;
+        }
+    }
+
+    return 1;
+}
+
+void ttm_stats_add(TtmStats *total, const TtmStats *stats) {
+    int i, t;
+
+    total->collision_checks += stats->collision_checks;
+    total->collisions += stats->collisions;
+    total->rotations_rejected += stats->rotations_rejected;
+    total->spawns += stats->spawns;
+    for (i = 0; i < 5; ++i)
+        total->clears[i] += stats->clears[i];
+
+    for (t = 0; t < TTM_TIMERS; ++t) {
+        TtmTimer *a = &total->timers[t];
+        const TtmTimer *b = &stats->timers[t];
+
+        a->count += b->count;
+        a->cycles += b->cycles;
+        if (b->max > a->max)
+            a->max = b->max;
+        for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+            a->hist[i] += b->hist[i];
+    }
+
+    for (t = 0; t < HDRS; ++t) {
+        TtmHdr *a = get_hdr(total, t);
+        const TtmHdr *b = get_hdr(stats, t);
+
+        a->count += b->count;
+        a->total += b->total;
+        if (b->max > a->max)
+            a->max = b->max;
+        for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+            a->hist[i] += b->hist[i];
+    }
+}
+
+int ttm_hdr_write(FILE *f, const char *name, const TtmHdr *hdr) {
+    unsigned long long seen = 0;
+    int b;
+
+    fprintf(f, "%s\n%12s %12s %12s\n", name, "Value", "Percentile",
+        "TotalCount");
+    for (b = 0; b < TTM_HDR_BUCKETS; ++b) {
+        unsigned long long value = ttm_hdr_value(b);
+
+        if (!hdr->hist[b])
+            continue;
+        seen += hdr->hist[b];
+        fprintf(f, "%12llu %12.6f %12llu\n",
+            value < hdr->max ? value : hdr->max,
+            (double)seen / (double)hdr->count, seen);
+    }
+
+    return fprintf(f, "#[Mean = %.3f, Max = %llu, Total count = %llu]\n",
+        hdr->count ? (double)hdr->total / (double)hdr->count : 0.0,
+        hdr->max, hdr->count) < 0 ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+/* ctetris_stats.h */
+#ifndef CTETRIS_STATS_H
+#define CTETRIS_STATS_H
+
+#include <stdio.h>
+
+#include "ctetris.h"
+
+/*
+    Files of per-game TtmStats, one record per game in the order they
+    are written, as CSV or binary.
+
+    CSV has a line of column names, then a line per game: the game id,
+    the counters in the order of TtmStats with clears0 to clears4, for
+    each of the cycle, render and input timers its count, cycles, max
+    and histogram buckets b0 to b31, the count, total and max of the
+    latency and lateness histograms, then their buckets h0 to h239.
+
+    Binary has the same values as LEB128 varints:
+
+        header      'c' 't' 's' version         4 bytes
+                    timers buckets hdr_buckets  1 byte each
+        records     id and values as in CSV up to the buckets of the
+                    latency and lateness histograms, for each of them
+                    the number of buckets in use, then for every one
+                    the number of empty buckets before it and its count
+
+    Histograms are mostly zeros, so a record takes about 130 bytes.
+*/
+#define TTM_STATS_VERSION   2
+
+/* Formats of ttm_stats_write */
+#define TTM_STATS_CSV       0
+#define TTM_STATS_BINARY    1
+
+/* Writes the header of a file, returns 0 or -1 on a write error. */
+int ttm_stats_write_header(FILE *f, int format);
+
+/* Writes stats of game id, returns 0 or -1 on a write error. */
+int ttm_stats_write(FILE *f, int format, unsigned long id,
+    const TtmStats *stats);
+
+/*
+    Reads the header of a binary file. Returns 0 or -1 if it is not
+    one of this version and build.
+*/
+int ttm_stats_read_header(FILE *f);
+
+/*
+    Reads the next record of a binary file. Returns 1, 0 at the end of
+    the file or -1 if the record is truncated or malformed.
+*/
+int ttm_stats_read(FILE *f, unsigned long *id, TtmStats *stats);
+
+/* Adds stats to total, maximums are the larger of the two. */
+void ttm_stats_add(TtmStats *total, const TtmStats *stats);
+
+/*
+    Writes the percentile distribution of a histogram as text, a line
+    per bucket in use, as HdrHistogram does. Returns 0 or -1 on a write
+    error.
+*/
+int ttm_hdr_write(FILE *f, const char *name, const TtmHdr *hdr);
+
+#endif
@@ -0,0 +1,217 @@
+/* ctetris_term.c */
+#include "ctetris_term.h"
+
+/* Screen column of the first cell, after the left wall. */
+#define BOARD_COL       3
+
+/* Default foreground, of empty cells, the walls and the labels. */
+#define DEFAULT_COLOR   39
+
+/* SGR foreground of a TTM_CELL_ value, I J L O S T Z after empty. */
+static const unsigned char cell_colors[TTM_CELL_FILLED + 1] = {
+    DEFAULT_COLOR, 36, 34, 37, 33, 32, 35, 31, DEFAULT_COLOR
+};
+
+static void put_str(TtmTerm *t, const char *s) {
+    while (*s)
+        t->out[t->len++] = *s++;
+}
+
+static void put_uint(TtmTerm *t, unsigned int v) {
+    char digits[10];
+    int n = 0;
+
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    while (n)
+        t->out[t->len++] = digits[--n];
+}
+
+/* Moves the cursor, forward on its row if that is shorter. */
+static void move_to(TtmTerm *t, int row, int col) {
+    if (t->row == row && t->col == col)
+        return;
+
+    put_str(t, "\x1b[");
+    if (t->row == row && t->col && t->col < col) {
+        put_uint(t, col - t->col);
+        put_str(t, "C");
+    } else {
+        put_uint(t, row);
+        put_str(t, ";");
+        put_uint(t, col);
+        put_str(t, "H");
+    }
+
+    t->row = row;
+    t->col = col;
+}
+
+/* Writes at the cursor, which has to stay on the row. */
+static void put_text(TtmTerm *t, const char *s, int cols) {
+    put_str(t, s);
+    t->col += cols;
+}
+
+static void set_color(TtmTerm *t, int color) {
+    if (t->color == color)
+        return;
+
+    put_str(t, "\x1b[");
+    put_uint(t, color);
+    put_str(t, "m");
+    t->color = color;
+}
+
+static void put_cell(TtmTerm *t, int cell) {
+    set_color(t, cell_colors[cell]);
+    put_text(t, cell ? "[]" : " .", 2);
+}
+
+/* Screen row of board row y. */
+static int board_row(const TtmTerm *t, int y) {
+    return t->height - y;
+}
+
+/* Screen column of the preview and the lines count. */
+static int side_col(const TtmTerm *t) {
+    return BOARD_COL + 2 * t->width + 4;
+}
+
+/* Clears the screen and draws the walls and labels of a board. */
+static void draw_frame(TtmTerm *t, int width, int height) {
+    int x, y;
+
+    t->width = width;
+    t->height = height;
+    t->row = 1;
+    t->col = 1;
+    put_str(t, "\x1b[H\x1b[2J");
+    set_color(t, DEFAULT_COLOR);
+
+    for (y = height - 1; y >= 0; --y) {
+        move_to(t, board_row(t, y), 1);
+        put_text(t, "<!", 2);
+        for (x = 0; x < width; ++x) {
+            put_cell(t, TTM_CELL_EMPTY);
+            t->cells[y][x] = TTM_CELL_EMPTY;
+        }
+        put_text(t, "!>", 2);
+    }
+
+    move_to(t, height + 1, 1);
+    put_text(t, "<!", 2);
+    for (x = 0; x < width; ++x)
+        put_text(t, "==", 2);
+    put_text(t, "!>", 2);
+    move_to(t, height + 2, BOARD_COL);
+    for (x = 0; x < width; ++x)
+        put_text(t, "\\/", 2);
+
+    move_to(t, 1, side_col(t));
+    put_text(t, "next", 4);
+
+    /* Neither matches what comes, so both are drawn. */
+    t->next = -2;
+    t->lines = ~0U;
+}
+
+static void draw_preview(TtmTerm *t, int next) {
+    char rows[4][8];
+    int i, r;
+
+    for (r = 0; r < 4; ++r)
+        for (i = 0; i < 4; ++i) {
+            rows[r][2 * i] = ' ';
+            rows[r][2 * i + 1] = ' ';
+        }
+
+    if (next >= 0) {
+        const Tetrimino *ttm = &tetriminos[next];
+        for (i = 0; i < 4; ++i) {
+            rows[3 - ttm->defy[i]][2 * ttm->defx[i]] = '[';
+            rows[3 - ttm->defy[i]][2 * ttm->defx[i] + 1] = ']';
+        }
+    }
+
+    set_color(t, cell_colors[next + 1]);
+    for (r = 0; r < 4; ++r) {
+        move_to(t, 2 + r, side_col(t));
+        for (i = 0; i < 8; ++i)
+            t->out[t->len++] = rows[r][i];
+        t->col += 8;
+    }
+
+    t->next = next;
+}
+
+void ttm_term_reset(TtmTerm *t) {
+    t->width = 0;
+    t->height = 0;
+    t->row = 0;
+    t->col = 0;
+    t->color = 0;
+    t->len = 0;
+}
+
+size_t ttm_term_render(TtmTerm *t, const GameState *gs,
+        const unsigned char *gameboard, int width, int height, int low,
+        int high) {
+    int x, y;
+
+    t->len = 0;
+    if (t->width != width || t->height != height)
+        draw_frame(t, width, height);
+
+    for (y = high - 1; y >= low; --y) {
+        int row = board_row(t, y);
+
+        for (x = 0; x < width; ++x) {
+            int col = BOARD_COL + 2 * x, gx, fill;
+            unsigned char cell = gameboard[y * width + x];
+
+            if (t->cells[y][x] == cell)
+                continue;
+
+            /*
+                A cell in between takes 2 bytes, a move forward 4, as
+                long as the cells need no other colour.
+            */
+            fill = t->row == row && t->col >= BOARD_COL && t->col < col &&
+                col - t->col <= 4;
+            for (gx = (t->col - BOARD_COL) / 2; fill && gx < x; ++gx)
+                fill = cell_colors[t->cells[y][gx]] == t->color;
+
+            if (fill) {
+                for (gx = (t->col - BOARD_COL) / 2; gx < x; ++gx)
+                    put_cell(t, t->cells[y][gx]);
+            } else {
+                move_to(t, row, col);
+            }
+
+            put_cell(t, cell);
+            t->cells[y][x] = cell;
+        }
+    }
+
+    if (gs->next_tetrimino != t->next)
+        draw_preview(t, gs->next_tetrimino);
+
+    if (gs->lines != t->lines) {
+        move_to(t, 7, side_col(t));
+        set_color(t, DEFAULT_COLOR);
+        put_str(t, "lines ");
+        put_uint(t, gs->lines);
+        put_str(t, "\x1b[K");
+
+        /* Past the digits, wherever that is. */
+        t->col = 0;
+        t->row = 0;
+        t->lines = gs->lines;
+    }
+
+    return t->len;
+}
@@ -0,0 +1,54 @@
+/* ctetris_term.h */
+#ifndef CTETRIS_TERM_H
+#define CTETRIS_TERM_H
+
+#include <stddef.h>
+
+#include "ctetris.h"
+
+/*
+    Differential renderer for ANSI terminals. It keeps the frame that is
+    on the screen and turns a new gameboard into the escape sequences
+    that change only the cells that differ, to be sent with one write.
+
+    The board is drawn two characters per cell with the top row on
+    screen row 1, the next tetrimino and the lines count to the right
+    of it. Cells of a tetrimino get its colour, TTM_CELL_FILLED ones
+    the default. The first frame, and the first one after ttm_term_reset or a
+    change of board size, clears the screen and draws all of it, so it
+    has to come with every row, see ttm_dirty_rows.
+
+    Between two changed cells on a row the cursor is moved forward or,
+    when that takes more bytes, the unchanged cells are written again.
+    A colour is set only when it differs from the last one written.
+*/
+
+/* Largest frame, a full repaint of the largest board, a colour per cell. */
+#define TTM_TERM_BUFFER     ((HEIGHT + 8) * (7 * WIDTH + 24) + 256)
+
+typedef struct TtmTermTag {
+    int width;                      /* of the board on screen, 0 if none */
+    int height;
+    int row;                        /* cursor, 1-based, 0 if not known */
+    int col;
+    int next;                       /* tetrimino in the preview, -1 if none */
+    unsigned int lines;             /* count on screen */
+    int color;                      /* SGR foreground of the output */
+    unsigned char cells[HEIGHT][WIDTH]; /* on screen, row 0 at the bottom */
+    size_t len;                     /* bytes of the last frame in out */
+    char out[TTM_TERM_BUFFER];
+} TtmTerm;
+
+/* Forgets the screen, the next frame is drawn in full. */
+void ttm_term_reset(TtmTerm *t);
+
+/*
+    Makes the escape sequences that bring the screen to rows [low, high)
+    of the gameboard of a render callback and the preview and lines of
+    gs. Other rows are not read. Returns their length, 0 if nothing
+    changed, the bytes are in t->out.
+*/
+size_t ttm_term_render(TtmTerm *t, const GameState *gs,
+    const unsigned char *gameboard, int width, int height, int low, int high);
+
+#endif
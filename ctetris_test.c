@@ -1,7 +1,23 @@
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
-#define NOMAIN
-#include "ctetris.c"
+#include "ctetris.h"
+#include "ctetris_ai.h"
+#include "ctetris_search.h"
+#include "ctetris_moves.h"
+#include "ctetris_pool.h"
+#include "ctetris_replay.h"
+#include "ctetris_stats.h"
+#include "ctetris_term.h"
+
+GameState test_game;
+GameState *gs = &test_game;
+
+UserCommand ttm_read_command_callback(GameState *gs) {
+    (void)gs;
+    return NOTHING;
+}
 
 #define TEST(name)     int test__##name() {         \
             char *test_name__ = #name;              \
@@ -42,65 +58,1533 @@ TEST(max_int) {
 TEST(collapse_rows) {
     int i;
     
-    for (i = 0; i < (WIDTH * HEIGHT); ++i) {
-        gameboard[i] = 42;
-    }
-
     for (i = 0; i < HEIGHT; ++i) {
-        gameboard[i * WIDTH] = i;
+        gs->board[i] = (ttm_row_t)i;
     }
+    update_stack_shape(gs);
     
-    collapse_rows(4, 6);
+    collapse_rows(gs, 4, 6);
+    ASSERT_EQ(gs->stack_height, HEIGHT - 2);
 
     for (i = (HEIGHT - (6 - 4)); i < HEIGHT; ++i) {
-        int c = gameboard[i * WIDTH];
+        int c = gs->board[i];
         ASSERT_EQ(c, 0);
     }
 
     for (i = 4; i < (HEIGHT - 6 - (6 - 4)); ++i) {
-        int c = gameboard[i * WIDTH];
+        int c = gs->board[i];
         ASSERT_EQ(c, i + 2);
     }
     
     for (i = 0; i < 4; ++i) {
-        int c = gameboard[i * WIDTH];
+        int c = gs->board[i];
         ASSERT_EQ(c, i);
     }
 } END_TEST
 
-int main() {
+TEST(check_and_collapse_rows) {
+    int i, cleared;
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+
+    gs->board[0] = FULL_ROW;
+    gs->board[1] = 0x01;
+    gs->board[2] = FULL_ROW;
+    gs->board[3] = FULL_ROW;
+    gs->board[4] = 0x02;
+    update_stack_shape(gs);
+
+    /* Vertical I covering rows 0-3. */
+    gs->index = 0;
+    gs->rot = 1;
+    gs->shape = &tetrimino_shapes[0][1];
+    gs->pos_x = 0;
+    gs->pos_y = 0;
+
+    cleared = check_and_collapse_rows(gs);
+    ASSERT_EQ(cleared, 3);
+    ASSERT_EQ(gs->board[0], 0x01);
+    ASSERT_EQ(gs->board[1], 0x02);
+    for (i = 2; i < HEIGHT; ++i) {
+        ASSERT_EQ(gs->board[i], 0);
+    }
+
+    ASSERT_EQ(gs->stack_height, 2);
+    ASSERT_EQ(gs->row_fill[0], 1);
+    ASSERT_EQ(gs->row_fill[1], 1);
+    ASSERT_EQ(gs->column_height[0], 1);
+    ASSERT_EQ(gs->column_height[1], 2);
+    for (i = 2; i < WIDTH; ++i) {
+        ASSERT_EQ(gs->column_height[i], 0);
+    }
+} END_TEST
+
+TEST(place_tetrimino) {
+    int i;
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+    gs->board[0] = 0x04;
+    update_stack_shape(gs);
+
+    /* T pointing up, occupying rows 1-2 of its matrix. */
+    gs->index = 5;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[5][0];
+    gs->pos_x = 0;
+    gs->pos_y = 0;
+    place_tetrimino(gs);
+
+    ASSERT_EQ(gs->board[1], 0x07);
+    ASSERT_EQ(gs->board[2], 0x02);
+    ASSERT_EQ(gs->stack_height, 3);
+    ASSERT_EQ(gs->row_fill[0], 1);
+    ASSERT_EQ(gs->row_fill[1], 3);
+    ASSERT_EQ(gs->row_fill[2], 1);
+    ASSERT_EQ(gs->column_height[0], 2);
+    ASSERT_EQ(gs->column_height[1], 3);
+    ASSERT_EQ(gs->column_height[2], 2);
+    ASSERT_EQ(gs->column_height[3], 0);
+} END_TEST
+
+TEST(ttm_cell) {
+    int i;
+
+    ttm_set_size(gs, 7, HEIGHT);
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+    gs->board[0] = 0x04;
+    update_stack_shape(gs);
+    ASSERT_EQ(ttm_cell(gs, 2, 0), TTM_CELL_FILLED);
+    ASSERT_EQ(ttm_cell(gs, 1, 0), TTM_CELL_EMPTY);
+
+    /* T on row 1, its top on row 2, then I filling row 1. */
+    gs->index = 5;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[5][0];
+    gs->pos_x = 0;
+    gs->pos_y = 0;
+    place_tetrimino(gs);
+    ASSERT_EQ(ttm_cell(gs, 0, 1), 6);
+    ASSERT_EQ(ttm_cell(gs, 1, 2), 6);
+    ASSERT_EQ(ttm_cell(gs, 3, 1), TTM_CELL_EMPTY);
+
+    gs->index = 0;
+    gs->shape = &tetrimino_shapes[0][0];
+    gs->pos_x = 3;
+    gs->pos_y = -1;
+    place_tetrimino(gs);
+    ASSERT_EQ(ttm_cell(gs, 6, 1), 1);
+
+    /* Row 1 goes, the top of T comes down with its colour. */
+    ASSERT_EQ(check_and_collapse_rows(gs), 1);
+    ASSERT_EQ(ttm_cell(gs, 1, 1), 6);
+    ASSERT_EQ(ttm_cell(gs, 0, 1), TTM_CELL_EMPTY);
+    ASSERT_EQ(ttm_cell(gs, 2, 0), TTM_CELL_FILLED);
+    ASSERT_EQ(ttm_cell(gs, 1, 2), TTM_CELL_EMPTY);
+
+    ttm_set_size(gs, WIDTH, HEIGHT);
+} END_TEST
+
+TEST(check_collision) {
+    int i;
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+
+    /* I is horizontal in row 2 of its matrix. */
+    gs->index = 0;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[0][0];
+
+    gs->pos_x = 0;
+    gs->pos_y = -2;
+    ASSERT_EQ(check_collision(gs, 0), 0);
+    ASSERT_EQ(check_collision(gs, 1), 1);
+
+    gs->pos_x = -1;
+    ASSERT_EQ(check_collision(gs, 0), 1);
+    gs->pos_x = WIDTH - 4;
+    ASSERT_EQ(check_collision(gs, 0), 0);
+    gs->pos_x = WIDTH - 3;
+    ASSERT_EQ(check_collision(gs, 0), 1);
+
+    gs->pos_x = 0;
+    gs->pos_y = 0;
+    gs->board[2] = 0x08;
+    update_stack_shape(gs);
+    ASSERT_EQ(check_collision(gs, 0), 1);
+    gs->board[2] = 0x10;
+    update_stack_shape(gs);
+    ASSERT_EQ(check_collision(gs, 0), 0);
+
+    place_tetrimino(gs);
+    ASSERT_EQ(gs->board[2], 0x1F);
+} END_TEST
+
+TEST(ttm_drop_distance) {
+    int i;
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+    update_stack_shape(gs);
+
+    /* Flat I at x = 0, its cells are in row 2 of the matrix. */
+    gs->index = 0;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[0][0];
+    gs->pos_x = 0;
+    gs->pos_y = 5;
+    ASSERT_EQ(ttm_drop_distance(gs), 7);
+
+    gs->board[0] = 0x01;
+    gs->board[1] = 0x01;
+    gs->board[2] = 0x08;
+    update_stack_shape(gs);
+    ASSERT_EQ(ttm_drop_distance(gs), 4);
+
+    /* Tucked under an overhang at row 6, columns 0-3. */
+    gs->board[6] = 0x0F;
+    update_stack_shape(gs);
+    gs->pos_y = 2;
+    ASSERT_EQ(ttm_drop_distance(gs), 1);
+    ASSERT_EQ(check_collision_at(gs, gs->pos_x, gs->pos_y - 1), 0);
+    ASSERT_EQ(check_collision_at(gs, gs->pos_x, gs->pos_y - 2), 1);
+} END_TEST
+
+TEST(tetrimino_shapes) {
+    int t, k, i;
+
+    for (t = 0; t < 7; ++t) {
+        Tetrimino *tmdef = &tetriminos[t];
+        int cx[4], cy[4];
+
+        for (i = 0; i < 4; ++i) {
+            cx[i] = tmdef->defx[i];
+            cy[i] = tmdef->defy[i];
+        }
+
+        for (k = 0; k < 4; ++k) {
+            const TetriminoShape *shape = &tetrimino_shapes[t][k];
+            int rows[4] = { 0, 0, 0, 0 };
+
+            for (i = 0; i < 4; ++i)
+                rows[cy[i]] |= 1 << cx[i];
+
+            for (i = 0; i < 4; ++i) {
+                ASSERT_EQ(shape->rows[i], rows[i]);
+                ASSERT_EQ(shape->rows[shape->cy[i]] >> shape->cx[i] & 1, 1);
+            }
+
+            /* Rotate by 90 degrees within the box for the next orientation. */
+            for (i = 0; i < 4; ++i) {
+                int x = cx[i] - tmdef->x;
+                int y = cy[i] - tmdef->y;
+                cx[i] = tmdef->x + tmdef->box - 1 - y;
+                cy[i] = tmdef->y + x;
+            }
+        }
+    }
+} END_TEST
+
+TEST(rotate_tetrimino) {
+    gs->index = 1;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[1][0];
+
+    rotate_tetrimino(gs, -90);
+    ASSERT_EQ(gs->rot, 3);
+    ASSERT_EQ(gs->shape, &tetrimino_shapes[1][3]);
+
+    rotate_tetrimino(gs, 90);
+    rotate_tetrimino(gs, 90);
+    ASSERT_EQ(gs->rot, 1);
+    ASSERT_EQ(gs->shape, &tetrimino_shapes[1][1]);
+} END_TEST
+
+TEST(ttm_rotate) {
+    /* SRS 0->R of I and of T, both ROTATE_CCW here. */
+    static const signed char i_kicks[TTM_KICKS][2] = {
+        { 0, 0 }, { -2, 0 }, { 1, 0 }, { -2, -1 }, { 1, 2 }
+    };
+    static const signed char t_kicks[TTM_KICKS][2] = {
+        { 0, 0 }, { -1, 0 }, { -1, 1 }, { 0, -2 }, { -1, -2 }
+    };
+    signed char kicks[TTM_KICKS][2];
+    int i, r, same = 1;
+
+    ASSERT_EQ(ttm_kicks(0, 0, -1, kicks), TTM_KICKS);
+    for (i = 0; i < TTM_KICKS; ++i)
+        same &= kicks[i][0] == i_kicks[i][0] && kicks[i][1] == i_kicks[i][1];
+    ASSERT_EQ(ttm_kicks(5, 0, -1, kicks), TTM_KICKS);
+    for (i = 0; i < TTM_KICKS; ++i)
+        same &= kicks[i][0] == t_kicks[i][0] && kicks[i][1] == t_kicks[i][1];
+    ASSERT_EQ(same, 1);
+    ASSERT_EQ(ttm_kicks(3, 0, 1, kicks), 1);
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+
+    /* Upright I on the left wall turns flat one column right of it. */
+    gs->index = 0;
+    gs->rot = 1;
+    gs->shape = &tetrimino_shapes[0][1];
+    gs->pos_x = -1;
+    gs->pos_y = 5;
+    ASSERT_EQ(ttm_rotate(gs, 1), 1);
+    ASSERT_EQ(gs->rot, 2);
+    ASSERT_EQ(gs->pos_x, 0);
+    ASSERT_EQ(gs->pos_y, 5);
+
+    /* Walled in on every side, nothing changes. */
+    gs->index = 5;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[5][0];
+    gs->pos_x = 3;
+    gs->pos_y = 5;
+    for (r = 0; r < HEIGHT; ++r)
+        gs->board[r] = FULL_ROW;
+    for (i = 0; i < 4; ++i)
+        gs->board[gs->pos_y + gs->shape->cy[i]] &=
+            ~((ttm_row_t)1 << (gs->pos_x + gs->shape->cx[i]));
+    ASSERT_EQ(ttm_rotate(gs, -1), 0);
+    ASSERT_EQ(gs->rot, 0);
+    ASSERT_EQ(gs->pos_x, 3);
+    ASSERT_EQ(gs->pos_y, 5);
+} END_TEST
+
+TEST(ttm_step) {
+    int i;
+
+    init_game(gs);
+    ASSERT_EQ(gs->pieces, 0);
+
+    ASSERT_EQ(ttm_step(gs, DROP), CONTINUE_PLAY);
+    ASSERT_EQ(gs->pieces, 1);
+    ASSERT_EQ(gs->stack_height, 2);
+
+    /* Gravity moves the piece down once every 25 ticks. */
+    for (i = 0; i < 24; ++i)
+        ttm_step(gs, NOTHING);
+    ASSERT_EQ(gs->pos_y, HEIGHT - 2);
+    ttm_step(gs, NOTHING);
+    ASSERT_EQ(gs->pos_y, HEIGHT - 3);
+
+    ASSERT_EQ(ttm_step(gs, QUIT), QUIT_GAME);
+} END_TEST
+
+TEST(ttm_seed) {
+    GameState a, b;
+    int i, same = 1, differ = 0;
+
+    ttm_seed(&a, 42);
+    ttm_seed(&b, 42);
+    for (i = 0; i < 100; ++i)
+        same &= ttm_random(&a) == ttm_random(&b);
+    ASSERT_EQ(same, 1);
+
+    ttm_seed_stream(&a, 42, 0);
+    ttm_seed_stream(&b, 42, 1);
+    for (i = 0; i < 100; ++i)
+        differ |= ttm_random(&a) != ttm_random(&b);
+    ASSERT_EQ(differ, 1);
+
+    ttm_seed(&a, 7);
+    ttm_seed(&b, 7);
+    ttm_rng_jump(&a);
+    ttm_rng_jump(&b);
+    ASSERT_EQ(a.rng[0], b.rng[0]);
+    ASSERT_EQ(a.rng[3], b.rng[3]);
+
+    for (i = 0; i < 1000; ++i) {
+        unsigned int r = ttm_random_below(&a, 7);
+        if (r >= 7) {
+            ASSERT_EQ(r, 0);
+        }
+    }
+} END_TEST
+
+TEST(draw_tetrimino_bag7) {
+    int i, j;
+
+    ttm_seed(gs, 3);
+    gs->randomizer = TTM_BAG7;
+
+    for (i = 0; i < 10; ++i) {
+        int seen = 0;
+        for (j = 0; j < 7; ++j)
+            seen |= 1 << draw_tetrimino(gs);
+        ASSERT_EQ(seen, 0x7F);
+    }
+
+    gs->randomizer = TTM_UNIFORM;
+} END_TEST
+
+TEST(ttm_step_idle) {
+    GameState a, b;
+    PlayCycleResult result = CONTINUE_PLAY;
+    int i, same = 1;
+
+    ttm_seed(&a, 5);
+    ttm_seed(&b, 5);
+    ttm_set_size(&a, WIDTH, HEIGHT);
+    ttm_set_size(&b, WIDTH, HEIGHT);
+    a.randomizer = b.randomizer = TTM_UNIFORM;
+    a.record = b.record = NULL;
+    a.stats = b.stats = NULL;
+    init_game(&a);
+    init_game(&b);
+
+    for (i = 0; i < 1000 && result == CONTINUE_PLAY; ++i)
+        result = ttm_step(&a, NOTHING);
+    ASSERT_EQ(ttm_step_idle(&b, 1000), result);
+
+    ASSERT_EQ(a.ticks, b.ticks);
+    ASSERT_EQ(a.pieces, b.pieces);
+    ASSERT_EQ(a.pos_y, b.pos_y);
+    ASSERT_EQ(a.timer_counter, b.timer_counter);
+    for (i = 0; i < HEIGHT; ++i)
+        same &= a.board[i] == b.board[i];
+    ASSERT_EQ(same, 1);
+} END_TEST
+
+TEST(replay) {
+    static const UserCommand script[] = {
+        ROTATE_CW, MOVE_LEFT, MOVE_LEFT, DROP, MOVE_RIGHT, NOTHING, DROP,
+        ROTATE_CCW, NOTHING, NOTHING, MOVE_RIGHT, MOVE_RIGHT, DROP
+    };
+    unsigned char buf[4096];
+    TtmReplayWriter w;
+    TtmReplayInfo info;
+    GameState play;
+    size_t len;
+    int i, same = 1;
+    PlayCycleResult result = CONTINUE_PLAY;
+
+    gs->randomizer = TTM_BAG7;
+    ttm_replay_record_start(&w, gs, buf, sizeof(buf), 99, 3);
+    init_game(gs);
+    for (i = 0; result == CONTINUE_PLAY; ++i) {
+        result = ttm_step(gs, i % 7 ? NOTHING : script[i / 7 % 13]);
+        /* A burst, commands on the same tick. */
+        if (i % 21 == 14 && result == CONTINUE_PLAY)
+            result = run_command_cycle(gs, MOVE_LEFT);
+    }
+    len = ttm_replay_record_end(&w, gs);
+    gs->randomizer = TTM_UNIFORM;
+
+    /* A few bytes per piece. */
+    ASSERT_EQ(len != 0, 1);
+    ASSERT_EQ(len < 8 * gs->pieces + 32, 1);
+
+    play.randomizer = TTM_UNIFORM;
+    play.stats = NULL;
+    ASSERT_EQ(ttm_replay_play(&play, buf, len, &info), TTM_REPLAY_OK);
+    ASSERT_EQ(info.size, len);
+    ASSERT_EQ(info.seed, 99);
+    ASSERT_EQ(info.randomizer, TTM_BAG7);
+    ASSERT_EQ(info.ticks, gs->ticks);
+    ASSERT_EQ(play.pieces, gs->pieces);
+    for (i = 0; i < HEIGHT; ++i)
+        same &= play.board[i] == gs->board[i];
+    ASSERT_EQ(same, 1);
+
+    ASSERT_EQ(ttm_replay_play(&play, buf, len - 1, NULL), TTM_REPLAY_CORRUPT);
+    buf[8] ^= 1;
+    ASSERT_EQ(ttm_replay_play(&play, buf, len, NULL), TTM_REPLAY_MISMATCH);
+    buf[8] ^= 1;
+
+    ttm_replay_record_start(&w, gs, buf, 12, 99, 3);
+    init_game(gs);
+    ttm_step_idle(gs, 10000);
+    ASSERT_EQ(ttm_replay_record_end(&w, gs), 0);
+} END_TEST
+
+TEST(replay_seek) {
+    static const unsigned int targets[] = { 0, 1, 137, 700, 1401, 2950, ~0U };
+    /* Rotations can kick a piece up for ever, play at most 1 << 18 steps. */
+    static unsigned char buf[1 << 17], keys[128 * TTM_REPLAY_KEYFRAME_SIZE];
+    GameState saved[7];
+    TtmReplayWriter w;
+    TtmReplayInfo info;
+    GameState play;
+    PlayCycleResult result = CONTINUE_PLAY;
+    size_t len;
+    int i, j = 1, k, same;
+
+    ttm_replay_record_start(&w, gs, buf, sizeof(buf), 5, 0);
+    ttm_replay_record_keyframes(&w, keys, sizeof(keys), 1);
+    init_game(gs);
+    saved[0] = *gs;
+    for (i = 0; result == CONTINUE_PLAY && i < 1 << 18; ++i) {
+        result = ttm_step(gs, i % 5 ? NOTHING : (UserCommand)(1 + i / 5 % 4));
+        if (i % 40 == 20 && result == CONTINUE_PLAY)
+            result = run_command_cycle(gs, MOVE_RIGHT);
+        if (j < 6 && gs->ticks == targets[j])
+            saved[j++] = *gs;
+    }
+    saved[6] = *gs;
+    len = ttm_replay_record_end(&w, gs);
+
+    ASSERT_EQ(j, 6);
+    ASSERT_EQ(len != 0, 1);
+    play.stats = NULL;
+    ASSERT_EQ(ttm_replay_play(&play, buf, len, &info), TTM_REPLAY_OK);
+    ASSERT_EQ(info.keyframes >= info.pieces - 1, 1);
+    ASSERT_EQ(info.size, len);
+
+    for (j = 0; j < 7; ++j) {
+        ASSERT_EQ(ttm_replay_seek(&play, buf, len, targets[j], NULL), TTM_REPLAY_OK);
+        same = play.ticks == saved[j].ticks && play.pieces == saved[j].pieces &&
+            play.pos_x == saved[j].pos_x && play.pos_y == saved[j].pos_y &&
+            play.shape == saved[j].shape && play.rng[0] == saved[j].rng[0] &&
+            play.stack_height == saved[j].stack_height;
+        for (k = 0; k < HEIGHT; ++k)
+            same &= play.board[k] == saved[j].board[k];
+        ASSERT_EQ(same, 1);
+    }
+
+    /* Keyframes are checked on playback. */
+    buf[len - 12 - TTM_REPLAY_KEYFRAME_SIZE + 41] ^= 1;
+    ASSERT_EQ(ttm_replay_play(&play, buf, len, NULL), TTM_REPLAY_MISMATCH);
+} END_TEST
 
-    RUN_TEST(swap_int);
-    RUN_TEST(max_int);
-    RUN_TEST(collapse_rows);
-    
 /*
-    int matrix[] = { 
-        0, 0, 0, 0,
-        8, 8, 8, 8,
-        0, 0, 0, 0,
-        0, 0, 0, 0
-        };
-    int x, y;
-        
-    for (y = 0; y < 4; ++y) {
-        for (x = 0; x < 4; ++x) {
-            printf("%d ", matrix[y * 4 + x]);
+    Reference for ttm_gen_placements: search positions one command at
+    a time with check_collision_at and ttm_rotate, count distinct boards
+    after locking.
+*/
+int count_placements_slowly(GameState *start) {
+    static short stack[4 * TTM_MOVES_ROWS * (WIDTH + 4)][3];
+    static unsigned char seen[4][TTM_MOVES_ROWS][WIDTH + 4];
+    static ttm_row_t boards[TTM_MAX_PLACEMENTS][HEIGHT];
+    GameState gs = *start;
+    int n = 0, count = 0, i, j, k;
+
+    for (i = 0; i < 4; ++i)
+        for (j = 0; j < TTM_MOVES_ROWS; ++j)
+            for (k = 0; k < WIDTH + 4; ++k)
+                seen[i][j][k] = 0;
+
+    stack[n][0] = (short)gs.pos_x;
+    stack[n][1] = (short)gs.pos_y;
+    stack[n++][2] = (short)gs.rot;
+    seen[gs.rot][gs.pos_y + TTM_MOVES_Y0][gs.pos_x + 3] = 1;
+
+    while (n) {
+        int x, y, rot, m;
+
+        --n;
+        x = stack[n][0];
+        y = stack[n][1];
+        rot = stack[n][2];
+
+        for (m = 0; m < 5; ++m) {
+            int nx = x + (m == 0) - (m == 1), ny = y - (m == 2), nrot = rot;
+
+            gs.rot = rot;
+            gs.shape = &tetrimino_shapes[gs.index][rot];
+            if (m >= 3) {
+                gs.pos_x = x;
+                gs.pos_y = y;
+                if (!ttm_rotate(&gs, m == 3 ? 1 : -1))
+                    continue;
+                nx = gs.pos_x;
+                ny = gs.pos_y;
+                nrot = gs.rot;
+            } else if (check_collision_at(&gs, nx, ny)) {
+                continue;
+            }
+            if (seen[nrot][ny + TTM_MOVES_Y0][nx + 3])
+                continue;
+            seen[nrot][ny + TTM_MOVES_Y0][nx + 3] = 1;
+            stack[n][0] = (short)nx;
+            stack[n][1] = (short)ny;
+            stack[n++][2] = (short)nrot;
+        }
+
+        gs.shape = &tetrimino_shapes[gs.index][rot];
+        if (!check_collision_at(&gs, x, y - 1))
+            continue;
+
+        for (i = 0; i < HEIGHT; ++i)
+            boards[count][i] = start->board[i];
+        for (i = 0; i < 4; ++i) {
+            int r = y + gs.shape->cy[i];
+            if (r < HEIGHT)
+                boards[count][r] |= (ttm_row_t)1 << (x + gs.shape->cx[i]);
+        }
+        for (j = 0; j < count; ++j) {
+            for (i = 0; i < HEIGHT && boards[j][i] == boards[count][i]; ++i)
+                ;
+            if (i == HEIGHT)
+                break;
         }
-        printf("\n");
+        if (j == count)
+            ++count;
     }
-    
-    transpose(matrix, 4, 4);
-    mirror_y(matrix, 4, 4);
 
-    printf("\n");
+    return count;
+}
+
+TEST(ttm_gen_placements) {
+    /* Sum of WIDTH - width + 1 over orientations with distinct cells. */
+    static const int empty_board[7] = {
+        2 * WIDTH - 3, 4 * WIDTH - 6, 4 * WIDTH - 6, WIDTH - 1,
+        2 * WIDTH - 3, 4 * WIDTH - 6, 2 * WIDTH - 3
+    };
+    static TtmMoveGen gen;
+    static TtmPlacement placements[TTM_MAX_PLACEMENTS];
+    UserCommand path[TTM_MOVES_ROWS + 64];
+    GameState play;
+    int i, t, n, k, len, paths_ok = 1, same = 1;
+
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = 0;
+    update_stack_shape(gs);
+
+    for (t = 0; t < 7; ++t) {
+        gs->index = t;
+        gs->rot = 0;
+        gs->shape = &tetrimino_shapes[t][0];
+        gs->pos_x = (WIDTH - tetriminos[t].box) / 2;
+        gs->pos_y = HEIGHT - 2;
+        n = ttm_gen_placements(&gen, gs, placements);
+        ASSERT_EQ(n, empty_board[t]);
+    }
+
+    /* Random stacks with overhangs, compared with the slow search. */
+    ttm_seed(gs, 11);
+    for (k = 0; k < 40; ++k) {
+        for (i = 0; i < HEIGHT; ++i)
+            gs->board[i] = i < 12 ? (ttm_row_t)(ttm_random(gs) & ttm_random(gs) & FULL_ROW) : 0;
+        update_stack_shape(gs);
+        gs->next_tetrimino = -1;
+        spawn_new_tetrimino(gs);
+
+        n = ttm_gen_placements(&gen, gs, placements);
+        same &= n == count_placements_slowly(gs);
+
+        /* Every path locks the piece where the placement says. */
+        for (i = 0; i < n; ++i) {
+            ttm_row_t expected[HEIGHT];
+            int j, r;
 
-    for (y = 0; y < 4; ++y) {
-        for (x = 0; x < 4; ++x) {
-            printf("%d ", matrix[y * 4 + x]);
+            play = *gs;
+            play.shape = &tetrimino_shapes[play.index][placements[i].rot];
+            play.pos_x = placements[i].x;
+            play.pos_y = placements[i].y;
+            place_tetrimino(&play);
+            for (r = 0; r < HEIGHT; ++r)
+                expected[r] = play.board[r];
+
+            play = *gs;
+            len = ttm_placement_path(&gen, gs, &placements[i], path,
+                TTM_MOVES_ROWS + 64);
+            if (len < 1) {
+                paths_ok = 0;
+                continue;
+            }
+            for (j = 0; j < len - 1; ++j)
+                apply_command(&play, path[j]);
+            play.pos_y -= ttm_drop_distance(&play);
+            place_tetrimino(&play);
+            for (r = 0; r < HEIGHT; ++r)
+                paths_ok &= play.board[r] == expected[r];
+            paths_ok &= path[len - 1] == DROP;
         }
-        printf("\n");
     }
-*/  
-    return 0;
+
+    ASSERT_EQ(same, 1);
+    ASSERT_EQ(paths_ok, 1);
+} END_TEST
+
+/*
+    Features of a width x HEIGHT board counted cell by cell, in
+    TtmAiWeights order.
+*/
+void count_features_slowly(const ttm_row_t *board, int width, int *f) {
+    int h[WIDTH];
+    int r, c;
+
+#define CELL(c, r)  ((c) < 0 || (c) >= width || (r) < 0 || \
+            ((r) < HEIGHT && ((board[r] >> (c)) & 1)))
+
+    for (r = 0; r < 6; ++r)
+        f[r] = 0;
+
+    for (c = 0; c < width; ++c) {
+        for (h[c] = HEIGHT; h[c] > 0 && !CELL(c, h[c] - 1); --h[c])
+            ;
+        f[0] += h[c];
+        for (r = 0; r < h[c]; ++r)
+            f[1] += !CELL(c, r);
+        for (r = 0; r <= HEIGHT; ++r)
+            f[5] += CELL(c, r - 1) != CELL(c, r);
+    }
+
+    for (c = 0; c < width; ++c) {
+        if (c + 1 < width)
+            f[2] += h[c] > h[c + 1] ? h[c] - h[c + 1] : h[c + 1] - h[c];
+        for (r = h[c]; r < HEIGHT; ++r)
+            f[3] += (c == 0 || h[c - 1] > r) && (c == width - 1 || h[c + 1] > r);
+    }
+
+    for (r = 0; r < HEIGHT; ++r)
+        for (c = -1; c < width; ++c)
+            f[4] += CELL(c, r) != CELL(c + 1, r);
+
+#undef CELL
+}
+
+TEST(ttm_ai_evaluate) {
+    /* Each side of the 16 and 32 column kernels that the build has. */
+    static const int widths[] = { WIDTH, 64, 33, 32, 17, 16, 10, 4 };
+    static TtmAi ai;
+    static ttm_row_t boards[37][HEIGHT];
+    static int features[37][6];
+    TtmAiWeights w;
+    int *weight = &w.height;
+    int i, j, k, r, v, rows = HEIGHT / 2, same = 1;
+
+    for (v = 0; v < 8; ++v) {
+        int width = widths[v];
+
+        if (width > WIDTH)
+            continue;
+
+        /* Random stacks with holes, the top half empty. */
+        ttm_seed(gs, 5);
+        for (j = 0; j < 37; ++j) {
+            for (r = 0; r < HEIGHT; ++r) {
+                ttm_row_t row = ttm_random(gs);
+#if ROW_BITS > 32
+                row |= (ttm_row_t)ttm_random(gs) << 32;
+#endif
+                boards[j][r] = r < rows - j % 4 ? row & TTM_FULL_ROW(width) : 0;
+                ai.boards[r][j] = boards[j][r];
+            }
+            ai.lines[j] = j;
+            count_features_slowly(boards[j], width, features[j]);
+        }
+
+        /* One feature at a time with a unit weight. */
+        for (k = 0; k < 7; ++k) {
+            for (i = 0; i < 7; ++i)
+                weight[i] = i == k;
+            ttm_ai_init(&ai, &w);
+            ai.width = width;
+            ttm_ai_evaluate(&ai, 37, rows);
+            for (j = 0; j < 37; ++j)
+                same &= ai.scores[j] == (k < 6 ? features[j][k] : j);
+        }
+    }
+
+    ASSERT_EQ(same, 1);
+} END_TEST
+
+TEST(ttm_ai_command) {
+    static TtmAi ai;
+    TtmAiPlayer player;
+    PlayCycleResult result = CONTINUE_PLAY;
+
+    ttm_ai_init(&ai, NULL);
+    ttm_ai_player_init(&player);
+    ttm_seed(gs, 3);
+    gs->randomizer = TTM_UNIFORM;
+    gs->record = NULL;
+    init_game(gs);
+
+    while (result == CONTINUE_PLAY && gs->pieces < 500)
+        result = ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+
+    /* Alive after 500 pieces, so most of them went into lines. */
+    ASSERT_EQ(result, CONTINUE_PLAY);
+    ASSERT_EQ(gs->pieces, 500);
+} END_TEST
+
+TEST(ttm_set_size) {
+    static TtmAi ai;
+    static TtmMoveGen gen;
+    static TtmPlacement placements[TTM_MAX_PLACEMENTS];
+    TtmAiPlayer player;
+    ttm_row_t outside = 0;
+    int i;
+
+    ASSERT_EQ(ttm_set_size(gs, WIDTH + 1, HEIGHT), -1);
+    ASSERT_EQ(gs->width, WIDTH);
+    ASSERT_EQ(gs->height, HEIGHT);
+    ASSERT_EQ(ttm_set_size(gs, 6, TTM_MIN_SIZE - 1), -1);
+
+    ASSERT_EQ(ttm_set_size(gs, 6, 12), 0);
+    ttm_seed(gs, 3);
+    gs->randomizer = TTM_UNIFORM;
+    gs->record = NULL;
+    init_game(gs);
+    ASSERT_EQ(gs->width, 6);
+    ASSERT_EQ(gs->height, 12);
+    ASSERT_EQ(gs->pos_y, 10);
+    ASSERT_EQ(gs->pos_x, (6 - tetriminos[gs->index].box) / 2);
+
+    /* Flat I: walls at 6 columns, the row fills at 6 cells. */
+    gs->index = 0;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[0][0];
+    ASSERT_EQ(check_collision_at(gs, 2, 5), 0);
+    ASSERT_EQ(check_collision_at(gs, 3, 5), 1);
+    ASSERT_EQ(ttm_gen_placements(&gen, gs, placements), 2 * 6 - 3);
+
+    gs->board[0] = 0x3;
+    update_stack_shape(gs);
+    gs->pos_x = 2;
+    gs->pos_y = -2;
+    place_tetrimino(gs);
+    ASSERT_EQ(check_and_collapse_rows(gs), 1);
+    ASSERT_EQ(gs->stack_height, 0);
+
+    /* The player keeps to the board and clears its rows. */
+    init_game(gs);
+    ttm_ai_init(&ai, NULL);
+    ttm_ai_player_init(&player);
+    while (gs->pieces < 200 && ttm_step(gs, ttm_ai_command(&ai, &player, gs)) ==
+            CONTINUE_PLAY)
+        for (i = 0; i < HEIGHT; ++i)
+            outside |= gs->board[i] & (i < 12 ? ~TTM_FULL_ROW(6) : FULL_ROW);
+    ASSERT_EQ(outside, 0);
+    ASSERT_EQ(gs->lines > 20, 1);
+
+    ttm_set_size(gs, WIDTH, HEIGHT);
+} END_TEST
+
+TEST(ttm_preview) {
+    int pieces[8];
+    int i, j, same = 1;
+
+    ttm_seed(gs, 5);
+    gs->randomizer = TTM_BAG7;
+    gs->preview = 8 - SHOW_NEXT;
+    gs->record = NULL;
+    init_game(gs);
+
+    /* What is previewed is what spawns, the generator is not touched. */
+    for (i = 0; i < 20; ++i) {
+        ttm_preview(gs, pieces, 8);
+        for (j = 0; j < 8; ++j) {
+            spawn_new_tetrimino(gs);
+            same &= gs->index == pieces[j];
+        }
+    }
+
+    ASSERT_EQ(same, 1);
+
+    /* Nothing the game does not show. */
+    gs->preview = 2;
+    ASSERT_EQ(ttm_preview(gs, pieces, 8), SHOW_NEXT + 2);
+    gs->preview = 0;
+} END_TEST
+
+TEST(ttm_search) {
+    static TtmAi ai;
+    static TtmSearch one, three, rushed;
+    TtmSearchConfig config;
+    TtmAiPlayer player;
+    TtmPlacement a, b, c, d;
+    PlayCycleResult result = CONTINUE_PLAY;
+    int same = 1, timed_out = 1;
+
+    ttm_search_default_config(&config);
+    config.preview = 2;
+    config.budget = 0;
+    config.threads = 1;
+    ASSERT_EQ(ttm_search_init(&one, &config, NULL), 0);
+    config.threads = 3;
+    ASSERT_EQ(ttm_search_init(&three, &config, NULL), 0);
+    config.budget = 1e-9;
+    ASSERT_EQ(ttm_search_init(&rushed, &config, NULL), 0);
+
+    ttm_ai_init(&ai, NULL);
+    ttm_search_player_init(&one, &player);
+    ttm_seed(gs, 3);
+    gs->randomizer = TTM_UNIFORM;
+    gs->preview = 2 - SHOW_NEXT;
+    gs->record = NULL;
+    init_game(gs);
+
+    /*
+        Threads do not change the choice. Out of time the search still
+        gives the choice of the first ply.
+    */
+    while (result == CONTINUE_PLAY && gs->pieces < 200) {
+        if (player.pieces != gs->pieces) {
+            ttm_search_choose(&one, gs, &a);
+            ttm_search_choose(&three, gs, &b);
+            ttm_search_choose(&rushed, gs, &c);
+            ttm_ai_choose(&ai, gs, &d);
+            same &= a.x == b.x && a.y == b.y && a.rot == b.rot;
+            same &= c.x == d.x && c.y == d.y && c.rot == d.rot;
+            timed_out &= rushed.stats.timed_out && rushed.stats.plies == 1;
+        }
+        result = ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+    }
+
+    ASSERT_EQ(result, CONTINUE_PLAY);
+    ASSERT_EQ(same, 1);
+    ASSERT_EQ(timed_out, 1);
+    ASSERT_EQ(one.stats.plies, 4);
+    gs->preview = 0;
+
+    ttm_search_free(&one);
+    ttm_search_free(&three);
+    ttm_search_free(&rushed);
+} END_TEST
+
+TEST(state_key) {
+    static TtmAi ai;
+    TtmAiPlayer player;
+    GameState copy;
+    PlayCycleResult result = CONTINUE_PLAY;
+    unsigned long long empty;
+    int same = 1, i;
+
+    ttm_ai_init(&ai, NULL);
+    ttm_ai_player_init(&player);
+    ttm_seed(gs, 9);
+    gs->randomizer = TTM_UNIFORM;
+    gs->record = NULL;
+    init_game(gs);
+    empty = gs->key ^ ttm_piece_key(gs->index, gs->next_tetrimino) ^
+        ttm_size_key(gs->width, gs->height);
+
+    /* The kept key is always the one made from scratch. */
+    while (result == CONTINUE_PLAY && gs->pieces < 300) {
+        result = ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+        copy = *gs;
+        update_stack_shape(&copy);
+        same &= copy.key == gs->key;
+    }
+
+    ASSERT_EQ(same, 1);
+    ASSERT_EQ(empty, 0);
+
+    /* The same rows on a board of another size are another state. */
+    copy = *gs;
+    ttm_set_size(&copy, gs->width - 1, gs->height);
+    update_stack_shape(&copy);
+    ASSERT_EQ(copy.key != gs->key, 1);
+    ttm_set_size(&copy, gs->width, gs->height - 1);
+    update_stack_shape(&copy);
+    ASSERT_EQ(copy.key != gs->key, 1);
+
+    /* Every cell of every row changes the key. */
+    for (i = 0; i < HEIGHT * WIDTH; ++i)
+        same &= ttm_row_key(i / WIDTH, (ttm_row_t)1 << (i % WIDTH)) != 0 &&
+            ttm_row_key(i / WIDTH, (ttm_row_t)1 << (i % WIDTH)) !=
+            ttm_row_key((i + 1) / WIDTH, (ttm_row_t)1 << ((i + 1) % WIDTH));
+    ASSERT_EQ(same, 1);
+} END_TEST
+
+/* Fields a snapshot keeps or rebuilds. */
+int same_state(const GameState *a, const GameState *b) {
+    int i, same = a->pos_x == b->pos_x && a->pos_y == b->pos_y &&
+        a->index == b->index && a->rot == b->rot && a->shape == b->shape &&
+        a->next_tetrimino == b->next_tetrimino &&
+        a->timer_counter == b->timer_counter &&
+        a->time_is_up == b->time_is_up && a->bag == b->bag &&
+        a->stack_height == b->stack_height && a->key == b->key;
+
+    for (i = 0; i < 4; ++i)
+        same &= a->rng[i] == b->rng[i];
+    for (i = 0; i < HEIGHT; ++i)
+        same &= a->board[i] == b->board[i] && a->row_fill[i] == b->row_fill[i];
+    for (i = 0; i < WIDTH; ++i)
+        same &= a->column_height[i] == b->column_height[i];
+#if TTM_COLORS
+    for (i = 0; i < HEIGHT * TTM_COLOR_WORDS; ++i)
+        same &= a->colors[i / TTM_COLOR_WORDS][i % TTM_COLOR_WORDS] ==
+            b->colors[i / TTM_COLOR_WORDS][i % TTM_COLOR_WORDS];
+#endif
+
+    return same;
+}
+
+TEST(ttm_snapshot) {
+    static TtmAi ai;
+    static TtmUndo undo;
+    static GameState spawned[TTM_UNDO_DEPTH + 9];
+    unsigned char buf[256];
+    TtmReplayWriter w;
+    TtmAiPlayer player;
+    TtmSnapshot snap;
+    GameState saved;
+    int same = 1, i;
+
+    if (WIDTH <= 16 && HEIGHT <= 20) {
+#if TTM_COLORS
+        ASSERT_EQ(offsetof(TtmSnapshot, colors) <= 64, 1);
+#else
+        ASSERT_EQ(sizeof(TtmSnapshot), 64);
+#endif
+    }
+
+    ttm_ai_init(&ai, NULL);
+    ttm_ai_player_init(&player);
+    ttm_undo_init(&undo);
+    ttm_seed(gs, 11);
+    gs->randomizer = TTM_BAG7;
+    gs->record = NULL;
+    init_game(gs);
+
+    /* Ticks into the game, so the timer and the generator have moved. */
+    while (gs->pieces < 100)
+        ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+    for (i = 0; i < 30; ++i)
+        ttm_step(gs, NOTHING);
+
+    saved = *gs;
+    ttm_snapshot(gs, &snap);
+    while (gs->pieces < 120)
+        ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+    ttm_restore(gs, &snap);
+    ASSERT_EQ(same_state(gs, &saved), 1);
+    gs->pieces = saved.pieces;
+    gs->lines = saved.lines;
+
+    /* Undo goes back spawn by spawn, as far as the stack reaches. */
+    ttm_ai_player_init(&player);
+    spawned[0] = *gs;
+    while (gs->pieces < saved.pieces + TTM_UNDO_DEPTH + 8) {
+        unsigned int pieces = gs->pieces;
+        ttm_undo_track(&undo, gs);
+        ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+        if (gs->pieces != pieces)
+            spawned[gs->pieces - saved.pieces] = *gs;
+    }
+    ttm_undo_track(&undo, gs);
+
+    for (i = 1; i < TTM_UNDO_DEPTH; ++i) {
+        GameState *want = &spawned[gs->pieces - 1 - saved.pieces];
+        same &= ttm_undo_move(&undo, gs) == 0;
+        same &= same_state(gs, want) && gs->pieces == want->pieces &&
+            gs->lines == want->lines;
+    }
+    ASSERT_EQ(same, 1);
+    ASSERT_EQ(ttm_undo_move(&undo, gs), -1);
+
+    /* The game goes on as it would have from there. */
+    ttm_ai_player_init(&player);
+    saved = *gs;
+    while (gs->pieces < saved.pieces + 5)
+        ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+    ASSERT_EQ(gs->index, spawned[gs->pieces - spawned[0].pieces].index);
+
+    /* A recorded game can not be undone. */
+    ttm_replay_record_start(&w, gs, buf, sizeof(buf), 11, 0);
+    ttm_undo_init(&undo);
+    ttm_undo_track(&undo, gs);
+    saved = *gs;
+    while (gs->pieces < saved.pieces + 2)
+        ttm_step(gs, ttm_ai_command(&ai, &player, gs));
+    ttm_undo_track(&undo, gs);
+    ASSERT_EQ(ttm_undo_move(&undo, gs), -1);
+    ASSERT_EQ(gs->pieces, saved.pieces + 2);
+    gs->record = NULL;
+    ASSERT_EQ(ttm_undo_move(&undo, gs), 0);
+    ASSERT_EQ(same_state(gs, &saved), 1);
+} END_TEST
+
+/* Value stored for a key, so torn entries would show. */
+static int tt_value(unsigned long long key) {
+    return (int)(key >> 17) ^ (int)key;
+}
+
+typedef struct TtRaceTag {
+    TtmTt tt;
+    volatile int torn;
+} TtRace;
+
+static void tt_task(void *ctx, int worker, long item) {
+    TtRace *race = (TtRace *)ctx;
+    unsigned long long key = (unsigned long long)(item % 5000 + 1) *
+        0x9E3779B97F4A7C15ULL;
+    TtmTtData d;
+
+    (void)worker;
+    if (item & 1) {
+        d.value = tt_value(key);
+        d.depth = (int)(item % 7);
+        d.aux = (unsigned int)(key >> 41);
+        ttm_tt_store(&race->tt, key, &d);
+    } else if (ttm_tt_probe(&race->tt, key, &d) &&
+            (d.value != tt_value(key) || d.aux != (unsigned int)(key >> 41))) {
+        race->torn = 1;
+    }
+}
+
+TEST(ttm_tt) {
+    static TtRace race;
+    TtmTt tt;
+    TtmTtData d, out;
+    int i, found = 0;
+
+    ASSERT_EQ(ttm_tt_init(&tt, 1 << 12), 0);
+    ASSERT_EQ(tt.mask, (1 << 12) / (TTM_TT_BUCKET * sizeof(TtmTtEntry)) - 1);
+
+    d.value = -5;
+    d.depth = 3;
+    d.aux = TTM_TT_MAX_AUX;
+    ASSERT_EQ(ttm_tt_probe(&tt, 42, &out), 0);
+    ttm_tt_store(&tt, 42, &d);
+    ASSERT_EQ(ttm_tt_probe(&tt, 42, &out), 1);
+    ASSERT_EQ(out.value, -5);
+    ASSERT_EQ(out.depth, 3);
+    ASSERT_EQ(out.aux, TTM_TT_MAX_AUX);
+    ASSERT_EQ(ttm_tt_probe(&tt, 43, &out), 0);
+
+    /* A shallower result does not replace a deeper one. */
+    d.value = 7;
+    d.depth = 2;
+    ttm_tt_store(&tt, 42, &d);
+    ttm_tt_probe(&tt, 42, &out);
+    ASSERT_EQ(out.value, -5);
+
+    /* A full bucket loses its shallowest entry. */
+    for (i = 1; i <= TTM_TT_BUCKET; ++i) {
+        d.value = i;
+        d.depth = 10 + i;
+        ttm_tt_store(&tt, 42 + i * (tt.mask + 1), &d);
+    }
+    ASSERT_EQ(ttm_tt_probe(&tt, 42, &out), 0);
+    for (i = 1; i <= TTM_TT_BUCKET; ++i)
+        found += ttm_tt_probe(&tt, 42 + i * (tt.mask + 1), &out);
+    ASSERT_EQ(found, TTM_TT_BUCKET);
+
+    /* Threads racing on few buckets read whole entries or nothing. */
+    ttm_tt_free(&tt);
+    ASSERT_EQ(ttm_tt_init(&race.tt, 1 << 12), 0);
+    ASSERT_EQ(ttm_pool_run(4, 400000, tt_task, &race), 0);
+    ASSERT_EQ(race.torn, 0);
+    ttm_tt_free(&race.tt);
+} END_TEST
+
+typedef struct PoolHitsTag {
+    unsigned char hits[5000];
+    int workers;
+    int outside;
+} PoolHits;
+
+static void pool_task(void *ctx, int worker, long item) {
+    PoolHits *h = (PoolHits *)ctx;
+
+    ++h->hits[item];
+    if (worker >= h->workers)
+        h->outside = 1;
+}
+
+TEST(ttm_pool) {
+    static const long items[] = { 0, 1, 3, 5000, 17, 5000 };
+    static const int workers[] = { 4, 4, 2, 3, 1, 9 };
+    static PoolHits h;
+    TtmPool *pool = ttm_pool_create(4);
+    int i, once;
+    long k;
+
+    ASSERT_EQ(pool != NULL, 1);
+
+    /* Batches of any size on any part of the pool run every item once. */
+    for (i = 0; i < 6; ++i) {
+        memset(&h, 0, sizeof(h));
+        h.workers = workers[i] < 4 ? workers[i] : 4;
+        ttm_pool_submit(pool, workers[i], items[i], pool_task, &h);
+        once = 1;
+        for (k = 0; k < 5000; ++k)
+            once &= h.hits[k] == (k < items[i]);
+        ASSERT_EQ(once, 1);
+        ASSERT_EQ(h.outside, 0);
+    }
+
+    ttm_pool_free(pool);
+} END_TEST
+
+TEST(ttm_stats) {
+    static TtmStats stats, copy;
+    static const TtmStats zero;
+    FILE *f;
+    unsigned long id = 0;
+    unsigned long long cleared = 0, lines = 0, hist = 0;
+    int header = 0, fields = 0, c, i, r, steps = 0, same = 1;
+    PlayCycleResult result = CONTINUE_PLAY;
+
+    stats = zero;
+    ttm_seed(gs, 7);
+    gs->randomizer = TTM_UNIFORM;
+    gs->record = NULL;
+    gs->stats = &stats;
+    init_game(gs);
+    ASSERT_EQ(stats.spawns, 1);
+
+    /* Every piece spawns the next one and clears 0 to 4 rows. */
+    for (i = 0; result == CONTINUE_PLAY; ++i, ++steps)
+        result = ttm_step(gs, i % 3 ? NOTHING : (UserCommand)(1 + i / 3 % 6));
+    for (i = 0; i < 5; ++i) {
+        cleared += stats.clears[i];
+        lines += i * stats.clears[i];
+    }
+    ASSERT_EQ(stats.spawns, gs->pieces + 1);
+    ASSERT_EQ(cleared, gs->pieces);
+    ASSERT_EQ(lines, gs->lines);
+    ASSERT_EQ(stats.collisions > 0, 1);
+    ASSERT_EQ(stats.collision_checks > stats.collisions, 1);
+
+    /* Cycles are timed, input only where the engine reads it. */
+    ASSERT_EQ(stats.timers[TTM_TIMER_CYCLE].count, steps);
+    ASSERT_EQ(stats.timers[TTM_TIMER_INPUT].count, 0);
+    for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+        hist += stats.timers[TTM_TIMER_CYCLE].hist[i];
+    ASSERT_EQ(hist, steps);
+    ASSERT_EQ(stats.timers[TTM_TIMER_CYCLE].cycles >=
+        stats.timers[TTM_TIMER_CYCLE].max, 1);
+    run_cycle(gs);
+    ASSERT_EQ(stats.timers[TTM_TIMER_INPUT].count, 1);
+
+    /* Walled in T, no kick is free. */
+    gs->index = 5;
+    gs->rot = 0;
+    gs->shape = &tetrimino_shapes[5][0];
+    gs->pos_x = 3;
+    gs->pos_y = 5;
+    for (r = 0; r < HEIGHT; ++r)
+        gs->board[r] = FULL_ROW;
+    for (i = 0; i < 4; ++i)
+        gs->board[gs->pos_y + gs->shape->cy[i]] &=
+            ~((ttm_row_t)1 << (gs->pos_x + gs->shape->cx[i]));
+    ASSERT_EQ(ttm_rotate(gs, 1), 0);
+    ASSERT_EQ(stats.rotations_rejected, 1);
+    gs->stats = NULL;
+
+    /* No clock here, the frontends feed these. */
+    ASSERT_EQ(stats.latency.count, 0);
+    ttm_hdr_add(&stats.latency, 5);
+    ttm_hdr_add(&stats.latency, 900);
+    ttm_hdr_add(&stats.lateness, 0xFFFFFFFFU);
+
+    f = tmpfile();
+    ASSERT_EQ(f != NULL, 1);
+    if (!f)
+        return 0;
+
+    /* Binary reads back as written. */
+    ASSERT_EQ(ttm_stats_write_header(f, TTM_STATS_BINARY), 0);
+    ASSERT_EQ(ttm_stats_write(f, TTM_STATS_BINARY, 12, &stats), 0);
+    rewind(f);
+    ASSERT_EQ(ttm_stats_read_header(f), 0);
+    ASSERT_EQ(ttm_stats_read(f, &id, &copy), 1);
+    ASSERT_EQ(id, 12);
+    ASSERT_EQ(ttm_stats_read(f, &id, &copy), 0);
+    ttm_stats_add(&copy, &stats);
+    same &= copy.spawns == 2 * stats.spawns && copy.collisions == 2 * stats.collisions;
+    same &= copy.timers[TTM_TIMER_CYCLE].max == stats.timers[TTM_TIMER_CYCLE].max;
+    for (i = 0; i < TTM_STATS_BUCKETS; ++i)
+        same &= copy.timers[TTM_TIMER_CYCLE].hist[i] ==
+            2 * stats.timers[TTM_TIMER_CYCLE].hist[i];
+    same &= copy.latency.total == 2 * 905 && copy.lateness.max == 0xFFFFFFFFU;
+    for (i = 0; i < TTM_HDR_BUCKETS; ++i)
+        same &= copy.latency.hist[i] == 2 * stats.latency.hist[i] &&
+            copy.lateness.hist[i] == 2 * stats.lateness.hist[i];
+    ASSERT_EQ(same, 1);
+
+    /* CSV lines have a value for every column. */
+    rewind(f);
+    ASSERT_EQ(ttm_stats_write_header(f, TTM_STATS_CSV), 0);
+    ASSERT_EQ(ttm_stats_write(f, TTM_STATS_CSV, 12, &stats), 0);
+    rewind(f);
+    while ((c = getc(f)) != '\n' && c != EOF)
+        header += c == ',';
+    while ((c = getc(f)) != '\n' && c != EOF)
+        fields += c == ',';
+    ASSERT_EQ(header, 9 + TTM_TIMERS * (3 + TTM_STATS_BUCKETS) +
+        2 * (3 + TTM_HDR_BUCKETS));
+    ASSERT_EQ(fields, header);
+
+    fclose(f);
+} END_TEST
+
+TEST(ttm_hdr) {
+    static TtmHdr hdr;
+    static const TtmHdr zero;
+    unsigned int v, low = 0;
+    int b, found, ok = 1;
+    char line[128];
+    FILE *f;
+
+    /* Buckets are in order and hold values to within 1/8. */
+    for (v = 0; v < 100000; v += 1 + v / 64) {
+        hdr = zero;
+        ttm_hdr_add(&hdr, v);
+        for (found = 0, b = 0; b < TTM_HDR_BUCKETS; ++b)
+            if (hdr.hist[b])
+                found = b;
+        ok &= ttm_hdr_value(found) >= v &&
+            (found == 0 || ttm_hdr_value(found - 1) < v) &&
+            ttm_hdr_value(found) - v <= v / 8;
+    }
+    ASSERT_EQ(ok, 1);
+    for (b = 1; b < TTM_HDR_BUCKETS; ++b)
+        if (ttm_hdr_value(b) <= ttm_hdr_value(b - 1))
+            ok = 0;
+    ASSERT_EQ(ok, 1);
+    ASSERT_EQ(ttm_hdr_value(TTM_HDR_BUCKETS - 1), 0xFFFFFFFFU);
+
+    /* Percentiles up to the max, then the summary. */
+    hdr = zero;
+    for (v = 1; v <= 100; ++v)
+        ttm_hdr_add(&hdr, v * 10);
+    ASSERT_EQ(hdr.count, 100);
+    ASSERT_EQ(hdr.max, 1000);
+    f = tmpfile();
+    ASSERT_EQ(f != NULL, 1);
+    if (!f)
+        return 0;
+    ASSERT_EQ(ttm_hdr_write(f, "latency us", &hdr), 0);
+    rewind(f);
+    found = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int value;
+        double percentile;
+        if (sscanf(line, "%u %lf", &value, &percentile) == 2) {
+            ok &= value > low && percentile <= 1.0;
+            low = value;
+        }
+        found += !strcmp(line, "#[Mean = 505.000, Max = 1000, Total count = 100]\n");
+    }
+    ASSERT_EQ(ok, 1);
+    ASSERT_EQ(low, 1000);
+    ASSERT_EQ(found, 1);
+    fclose(f);
+} END_TEST
+
+TEST(ttm_dirty_rows) {
+    int i;
+
+    ttm_seed(gs, 5);
+    gs->randomizer = TTM_UNIFORM;
+    gs->record = NULL;
+    init_game(gs);
+    ASSERT_EQ(gs->dirty_low, 0);
+    ASSERT_EQ(gs->dirty_high, gs->height);
+    ASSERT_EQ(gs->drawn_high, 0);
+
+    /* Moves are the render's to find, the board did not change. */
+    gs->dirty_low = gs->dirty_high = 0;
+    ttm_step(gs, MOVE_LEFT);
+    ttm_step(gs, ROTATE_CW);
+    ASSERT_EQ(gs->dirty_high, 0);
+
+    /* A locked piece dirties its rows. */
+    gs->pos_y -= ttm_drop_distance(gs);
+    place_tetrimino(gs);
+    ASSERT_EQ(gs->dirty_low, gs->pos_y + gs->shape->bottom);
+    ASSERT_EQ(gs->dirty_high, gs->pos_y + gs->shape->top + 1);
+
+    /* A collapse dirties every row that moved down. */
+    for (i = 0; i < HEIGHT; ++i)
+        gs->board[i] = i < 5 ? 1 : 0;
+    gs->board[2] = FULL_ROW;
+    update_stack_shape(gs);
+    gs->dirty_low = gs->dirty_high = 0;
+    collapse_rows(gs, 2, 3);
+    ASSERT_EQ(gs->dirty_low, 2);
+    ASSERT_EQ(gs->dirty_high, 5);
+
+    /* Ranges join. */
+    ttm_dirty_rows(gs, 9, 11);
+    ttm_dirty_rows(gs, 7, 7);
+    ASSERT_EQ(gs->dirty_low, 2);
+    ASSERT_EQ(gs->dirty_high, 11);
+    gs->dirty_low = gs->dirty_high = 0;
+    ttm_dirty_rows(gs, 7, 8);
+    ASSERT_EQ(gs->dirty_low, 7);
+    ASSERT_EQ(gs->dirty_high, 8);
+} END_TEST
+
+TEST(ttm_input) {
+    static TtmInput in;
+    int i;
+
+    ttm_input_init(&in, 100, 30);
+    ASSERT_EQ(ttm_input_wait_ms(&in, 0), TTM_WAIT_FOREVER);
+
+    /* Held left: the press, then after das, then every arr. */
+    ttm_input_push(&in, MOVE_LEFT, 0);
+    ASSERT_EQ(ttm_input_wait_ms(&in, 0), 0);
+    ASSERT_EQ(ttm_input_read(&in, 0), MOVE_LEFT);
+    ASSERT_EQ(ttm_input_read(&in, 50), NOTHING);
+    ASSERT_EQ(ttm_input_wait_ms(&in, 50), 50);
+    ASSERT_EQ(ttm_input_read(&in, 100), MOVE_LEFT);
+    ASSERT_EQ(in.read_ms, 100);
+    ASSERT_EQ(ttm_input_read(&in, 129), NOTHING);
+    ASSERT_EQ(ttm_input_read(&in, 130), MOVE_LEFT);
+
+    /* Released before the next repeat, read after it was due. */
+    ttm_input_push(&in, MOVE_LEFT | TTM_KEY_UP, 140);
+    ASSERT_EQ(ttm_input_read(&in, 200), NOTHING);
+    ASSERT_EQ(ttm_input_wait_ms(&in, 200), TTM_WAIT_FOREVER);
+
+    /* The system's repeat of a key that is down is left out. */
+    ttm_input_push(&in, ROTATE_CW, 200);
+    ttm_input_push(&in, ROTATE_CW, 230);
+    ttm_input_push(&in, ROTATE_CW | TTM_KEY_UP, 240);
+    ASSERT_EQ(ttm_input_read(&in, 250), ROTATE_CW);
+    ASSERT_EQ(ttm_input_read(&in, 250), NOTHING);
+
+    /* A burst comes out in order, taps do not repeat. */
+    ttm_input_push(&in, MOVE_RIGHT, 300);
+    ttm_input_push(&in, MOVE_RIGHT | TTM_KEY_UP, 300);
+    ttm_input_push(&in, MOVE_RIGHT, 301);
+    ttm_input_push(&in, MOVE_RIGHT | TTM_KEY_UP, 301);
+    ttm_input_push(&in, DROP, 302);
+    ASSERT_EQ(ttm_input_read(&in, 310), MOVE_RIGHT);
+    ASSERT_EQ(ttm_input_read(&in, 310), MOVE_RIGHT);
+    ASSERT_EQ(ttm_input_read(&in, 310), DROP);
+    ASSERT_EQ(ttm_input_read(&in, 1000), NOTHING);
+
+    /* A repeat goes before a later key read at the same time. */
+    ttm_input_push(&in, SPEEDUP, 1000);
+    ttm_input_push(&in, ROTATE_CCW, 1120);
+    ASSERT_EQ(ttm_input_read(&in, 1130), SPEEDUP);
+    ASSERT_EQ(ttm_input_read(&in, 1130), SPEEDUP);
+    ASSERT_EQ(in.read_ms, 1100);
+    ASSERT_EQ(ttm_input_read(&in, 1130), ROTATE_CCW);
+    ASSERT_EQ(ttm_input_read(&in, 1130), SPEEDUP);
+    ASSERT_EQ(ttm_input_read(&in, 1130), NOTHING);
+
+    /* Times wrap, a full queue drops. */
+    ttm_input_init(&in, 100, 0);
+    ASSERT_EQ(in.arr, 20);
+    ttm_input_push(&in, MOVE_LEFT, 0xFFFFFFF0U);
+    ASSERT_EQ(ttm_input_read(&in, 0xFFFFFFF0U), MOVE_LEFT);
+    ASSERT_EQ(ttm_input_wait_ms(&in, 10), 74);
+    ASSERT_EQ(ttm_input_read(&in, 84), MOVE_LEFT);
+    for (i = 0; i < TTM_INPUT_SIZE; ++i)
+        ttm_input_push(&in, DROP, 100);
+    ASSERT_EQ(in.dropped, 0);
+    ASSERT_EQ(ttm_input_push(&in, DROP, 100), -1);
+    ASSERT_EQ(in.dropped, 1);
+} END_TEST
+
+/* Count of s in the first len bytes of out. */
+int count_in(const char *out, size_t len, const char *s) {
+    size_t i, j, n = 0;
+
+    for (i = 0; i < len; ++i) {
+        for (j = 0; s[j] && i + j < len && out[i + j] == s[j]; ++j)
+            ;
+        n += !s[j];
+    }
+
+    return (int)n;
+}
+
+TEST(ttm_term) {
+    static TtmTerm term;
+    static unsigned char gameboard[WIDTH * HEIGHT];
+    size_t len;
+    int i;
+
+    for (i = 0; i < WIDTH * HEIGHT; ++i)
+        gameboard[i] = 0;
+    gs->next_tetrimino = 1;
+    gs->lines = 0;
+
+    /* The first frame is drawn in full, an unchanged one is nothing. */
+    ttm_term_reset(&term);
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "\x1b[2J"), 1);
+    ASSERT_EQ(count_in(term.out, len, " ."), WIDTH * HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "[]"), 4);
+    ASSERT_EQ(ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT), 0);
+
+    /* One cell is a move and the cell. */
+    gameboard[2 * WIDTH + 3] = TTM_CELL_FILLED;
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(len < 12, 1);
+    ASSERT_EQ(count_in(term.out, len, "[]"), 1);
+    ASSERT_EQ(count_in(term.out, len, "\x1b["), 1);
+
+    /* Close cells on a row are joined by the cells in between. */
+    gameboard[2 * WIDTH + 3] = TTM_CELL_EMPTY;
+    gameboard[2 * WIDTH + 5] = TTM_CELL_FILLED;
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "\x1b["), 1);
+    ASSERT_EQ(count_in(term.out, len, " . .[]"), 1);
+
+    /* A tetrimino cell takes its colour, the default comes back after. */
+    gameboard[2 * WIDTH + 6] = 6;
+    gameboard[2 * WIDTH + 7] = 6;
+    gameboard[0] = TTM_CELL_FILLED;
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "\x1b[35m[][]"), 1);
+    ASSERT_EQ(count_in(term.out, len, "\x1b[39m[]"), 1);
+    ASSERT_EQ(count_in(term.out, len, "m"), 2);
+
+    /* The preview and the lines count change on their own. */
+    gs->next_tetrimino = 0;
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "[][][][]"), 1);
+    ASSERT_EQ(count_in(term.out, len, " ."), 0);
+    gs->lines = 12;
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "lines 12"), 1);
+    ASSERT_EQ(count_in(term.out, len, "[]"), 0);
+
+    /* Another size or a reset repaints. */
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT - 1, 0, HEIGHT - 1);
+    ASSERT_EQ(count_in(term.out, len, "\x1b[2J"), 1);
+    ttm_term_reset(&term);
+    len = ttm_term_render(&term, gs, gameboard, WIDTH, HEIGHT, 0, HEIGHT);
+    ASSERT_EQ(count_in(term.out, len, "\x1b[2J"), 1);
+    ASSERT_EQ(len <= TTM_TERM_BUFFER, 1);
+
+    gs->lines = 0;
+} END_TEST
+
+int main() {
+    int result = 1;
+
+    ttm_set_size(gs, WIDTH, HEIGHT);
+
+    result &= RUN_TEST(swap_int);
+    result &= RUN_TEST(max_int);
+    result &= RUN_TEST(collapse_rows);
+    result &= RUN_TEST(check_and_collapse_rows);
+    result &= RUN_TEST(place_tetrimino);
+    result &= RUN_TEST(ttm_cell);
+    result &= RUN_TEST(check_collision);
+    result &= RUN_TEST(ttm_drop_distance);
+    result &= RUN_TEST(tetrimino_shapes);
+    result &= RUN_TEST(rotate_tetrimino);
+    result &= RUN_TEST(ttm_rotate);
+    result &= RUN_TEST(ttm_step);
+    result &= RUN_TEST(ttm_seed);
+    result &= RUN_TEST(draw_tetrimino_bag7);
+    result &= RUN_TEST(ttm_step_idle);
+    result &= RUN_TEST(replay);
+    result &= RUN_TEST(replay_seek);
+    result &= RUN_TEST(ttm_gen_placements);
+    result &= RUN_TEST(ttm_ai_evaluate);
+    result &= RUN_TEST(ttm_ai_command);
+    result &= RUN_TEST(ttm_set_size);
+    result &= RUN_TEST(ttm_preview);
+    result &= RUN_TEST(ttm_search);
+    result &= RUN_TEST(state_key);
+    result &= RUN_TEST(ttm_tt);
+    result &= RUN_TEST(ttm_pool);
+    result &= RUN_TEST(ttm_snapshot);
+    result &= RUN_TEST(ttm_stats);
+    result &= RUN_TEST(ttm_hdr);
+    result &= RUN_TEST(ttm_dirty_rows);
+    result &= RUN_TEST(ttm_input);
+    result &= RUN_TEST(ttm_term);
+    
+    return result ? 0 : 1;
 }
@@ -0,0 +1,117 @@
+/* ctetris_tt.c */
+#include <stdlib.h>
+
+#include "ctetris_tt.h"
+
+/*
+    Entry words are read and written whole where the target allows it.
+    Where it does not, a torn word fails the key check like a torn pair.
+*/
+#if defined(_MSC_VER)
+#define tt_load(p)          (*(p))
+#define tt_store(p, v)      (*(p) = (v))
+#else
+#define tt_load(p)          __atomic_load_n((p), __ATOMIC_RELAXED)
+#define tt_store(p, v)      __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#endif
+
+/*
+    Data word:
+        value       bits 0-31
+        depth       bits 32-39
+        aux         bits 40-62
+        valid       bit 63, so that no stored entry is all zero
+*/
+#define TT_VALID    0x8000000000000000ULL
+
+static unsigned long long pack(const TtmTtData *d) {
+    return (unsigned long long)(unsigned int)d->value |
+        (unsigned long long)(d->depth & 0xFF) << 32 |
+        (unsigned long long)(d->aux & TTM_TT_MAX_AUX) << 40 | TT_VALID;
+}
+
+static void unpack(unsigned long long data, TtmTtData *d) {
+    d->value = (int)(unsigned int)data;
+    d->depth = (int)(data >> 32) & 0xFF;
+    d->aux = (unsigned int)(data >> 40) & TTM_TT_MAX_AUX;
+}
+
+int ttm_tt_init(TtmTt *tt, size_t bytes) {
+    size_t buckets = 1;
+
+    while (buckets * 2 * TTM_TT_BUCKET * sizeof(TtmTtEntry) <= bytes)
+        buckets *= 2;
+
+    /* Buckets are cache lines, malloc does not align them. */
+    tt->mem = malloc(buckets * TTM_TT_BUCKET * sizeof(TtmTtEntry) + 64);
+    if (!tt->mem)
+        return -1;
+
+    tt->entries = (TtmTtEntry *)((char *)tt->mem +
+        (64 - (size_t)tt->mem % 64) % 64);
+    tt->mask = buckets - 1;
+    ttm_tt_clear(tt);
+
+    return 0;
+}
+
+void ttm_tt_free(TtmTt *tt) {
+    free(tt->mem);
+    tt->mem = NULL;
+    tt->entries = NULL;
+}
+
+void ttm_tt_clear(TtmTt *tt) {
+    size_t i, n = (size_t)(tt->mask + 1) * TTM_TT_BUCKET;
+
+    for (i = 0; i < n; ++i) {
+        tt->entries[i].check = 0;
+        tt->entries[i].data = 0;
+    }
+}
+
+int ttm_tt_probe(const TtmTt *tt, unsigned long long key, TtmTtData *out) {
+    const TtmTtEntry *e = &tt->entries[(key & tt->mask) * TTM_TT_BUCKET];
+    int i;
+
+    for (i = 0; i < TTM_TT_BUCKET; ++i) {
+        unsigned long long data = tt_load(&e[i].data);
+        unsigned long long check = tt_load(&e[i].check);
+
+        if ((data & TT_VALID) && (check ^ data) == key) {
+            unpack(data, out);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+void ttm_tt_store(TtmTt *tt, unsigned long long key, const TtmTtData *d) {
+    TtmTtEntry *e = &tt->entries[(key & tt->mask) * TTM_TT_BUCKET];
+    unsigned long long data = pack(d);
+    int i, victim = 0, victim_depth = 256;
+
+    for (i = 0; i < TTM_TT_BUCKET; ++i) {
+        unsigned long long old = tt_load(&e[i].data);
+        int depth = (int)(old >> 32) & 0xFF;
+
+        if (!(old & TT_VALID)) {
+            victim = i;
+            break;
+        }
+        if ((tt_load(&e[i].check) ^ old) == key) {
+            if (depth > (d->depth & 0xFF))
+                return;
+            victim = i;
+            break;
+        }
+        if (depth < victim_depth) {
+            victim = i;
+            victim_depth = depth;
+        }
+    }
+
+    tt_store(&e[victim].check, key ^ data);
+    tt_store(&e[victim].data, data);
+}
@@ -0,0 +1,60 @@
+/* ctetris_tt.h */
+#ifndef CTETRIS_TT_H
+#define CTETRIS_TT_H
+
+#include <stddef.h>
+
+/*
+    Transposition table: a fixed size cache of values keyed by 64-bit
+    state keys, see GameState.key. Any number of threads can probe and
+    store at the same time without locks.
+
+    An entry is two words, the data and the key XORed with the data.
+    Writers store the words one after the other, so a reader can see
+    one word of a store and one of another. Such a pair does not decode
+    to the key probed for and reads as a miss, like an entry that was
+    replaced.
+
+    Entries are in buckets of 4 that share a cache line. A store goes to
+    the entry with the same key, else to an empty one, else to the one
+    with the lowest depth.
+*/
+
+#define TTM_TT_BUCKET       4
+
+/* Largest aux, see TtmTtData. */
+#define TTM_TT_MAX_AUX      0x7FFFFF
+
+typedef struct TtmTtDataTag {
+    int value;
+    int depth;              /* 0-255, deeper results replace shallower */
+    unsigned int aux;       /* for the caller, TTM_TT_MAX_AUX at most */
+} TtmTtData;
+
+typedef struct TtmTtEntryTag {
+    volatile unsigned long long check;  /* key ^ data */
+    volatile unsigned long long data;
+} TtmTtEntry;
+
+typedef struct TtmTtTag {
+    TtmTtEntry *entries;
+    unsigned long long mask;    /* buckets - 1 */
+    void *mem;
+} TtmTt;
+
+/*
+    Allocates the largest power of two number of buckets that fits in
+    bytes, 1 at least. Returns 0 or -1 if out of memory.
+*/
+int ttm_tt_init(TtmTt *tt, size_t bytes);
+void ttm_tt_free(TtmTt *tt);
+
+/* Empties the table, not safe while other threads use it. */
+void ttm_tt_clear(TtmTt *tt);
+
+/* Returns 1 and the data stored for key or 0 if there is none. */
+int ttm_tt_probe(const TtmTt *tt, unsigned long long key, TtmTtData *out);
+
+void ttm_tt_store(TtmTt *tt, unsigned long long key, const TtmTtData *data);
+
+#endif
@@ -0,0 +1,311 @@
+/* ctetris_tty.c */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ctetris.h"
+#include "ctetris_stats.h"
+#include "ctetris_term.h"
+
+/*
+    Terminal frontend for Linux and other POSIX systems. Keys are read
+    from the raw terminal into a TtmInput, frames are sent with one
+    write each, see ctetris_term.h. A terminal does not tell when a key
+    is released, so holding one repeats at the terminal's rate.
+        Left, Right     move
+        Up, Down        rotate
+        r               speed up
+        Space           drop
+        Backspace       take back the last move
+        q               quit
+
+    Usage: ctetris_tty [-l file]
+        -l file     writes the input latency and the lateness of ticks
+                    of all games to file at the end, see TtmStats.
+                    Needs a build with -DTTM_STATS=1
+*/
+
+#define ttm_rnd_seed() tty_seed()
+#define ttm_now_ms() tty_now_ms()
+#define ttm_now_us() tty_now_us()
+#define ttm_wait_input_ms(gs, ms) tty_wait_input_ms(ms)
+
+#define ttm_read_command_callback(gs) read_command_callback(gs)
+#define ttm_render_rows_callback(gs, gb, w, h, low, high) \
+    render_callback(gs, gb, w, h, low, high)
+
+unsigned int tty_seed();
+unsigned int tty_now_ms();
+unsigned int tty_now_us();
+int tty_wait_input_ms(unsigned int ms);
+UserCommand read_command_callback(GameState *gs);
+void render_callback(GameState *gs, unsigned char *gameboard, int width,
+    int height, int low, int high);
+
+#include "ctetris.c"
+
+/* Bytes read from the terminal and not yet taken as keys. */
+#define INPUT_SIZE      64
+
+struct termios saved_termios;
+int termios_saved;
+
+unsigned char input[INPUT_SIZE];
+int input_len;
+int input_partial;                  /* input is the start of a sequence */
+
+TtmTerm term;
+
+/* Keys taken off the input, for the game to read in order. */
+TtmInput keys;
+
+/* Set by SIGWINCH, the screen is drawn again in full. */
+volatile sig_atomic_t resized;
+
+/* Spawns of the current game, Backspace takes back the last move. */
+TtmUndo undo;
+
+/* Of all games, with -l. */
+TtmStats stats;
+
+unsigned int tty_seed() {
+    unsigned int seed;
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0 || read(fd, &seed, sizeof(seed)) != sizeof(seed))
+        seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() << 16;
+    if (fd >= 0)
+        close(fd);
+
+    return seed;
+}
+
+unsigned int tty_now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)ts.tv_sec * 1000U +
+        (unsigned int)(ts.tv_nsec / 1000000);
+}
+
+unsigned int tty_now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned int)ts.tv_sec * 1000000U +
+        (unsigned int)(ts.tv_nsec / 1000);
+}
+
+int tty_wait_input_ms(unsigned int ms) {
+    struct pollfd pfd;
+    unsigned int due = ttm_input_wait_ms(&keys, tty_now_ms());
+
+    if ((input_len && !input_partial) || !due)
+        return 1;
+    if (due < ms)
+        ms = due;
+
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, ms == TTM_WAIT_FOREVER ? -1 : (int)ms) > 0 ||
+        ms == due;
+}
+
+/* Sends all of buf, a frame goes out in one write unless it is cut short. */
+void write_all(const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return;
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* Reads what the terminal has without waiting. */
+void fill_input() {
+    ssize_t n;
+
+    if (input_len == INPUT_SIZE || !tty_wait_input_ms(0))
+        return;
+
+    n = read(STDIN_FILENO, input + input_len, INPUT_SIZE - input_len);
+    if (n > 0) {
+        input_len += (int)n;
+        input_partial = 0;
+    }
+}
+
+/*
+    Takes the next key off the input. Returns the command, NOTHING for
+    keys that are not bound, or -1 if the key has to wait: the input
+    ends inside an escape sequence, input_partial is set then, or it is
+    Backspace and moves before it are still queued.
+*/
+int take_key(GameState *gs) {
+    int used = 1, cmd = NOTHING, i;
+
+    switch (input[0]) {
+        case 0x1B:
+            /* Arrows are ESC [ or, in application mode, ESC O. */
+            if (input_len > 1 && input[1] != '[' && input[1] != 'O')
+                break;
+            if (input_len < 3) {
+                input_partial = 1;
+                return -1;
+            }
+            used = 3;
+            switch (input[2]) {
+                case 'A': cmd = ROTATE_CCW; break;
+                case 'B': cmd = ROTATE_CW; break;
+                case 'C': cmd = MOVE_RIGHT; break;
+                case 'D': cmd = MOVE_LEFT; break;
+            }
+            break;
+        case 'r':
+            cmd = SPEEDUP;
+            break;
+        case ' ':
+            cmd = DROP;
+            break;
+        case 'q':
+            cmd = QUIT;
+            break;
+        case 0x7F:
+        case 0x08:
+            if (keys.head != keys.tail)
+                return -1;
+            if (!ttm_undo_move(&undo, gs))
+                render_gameboard(gs);
+            break;
+    }
+
+    input_len -= used;
+    for (i = 0; i < input_len; ++i)
+        input[i] = input[i + used];
+
+    return cmd;
+}
+
+UserCommand read_command_callback(GameState *gs) {
+    unsigned int now = tty_now_ms();
+    int cmd;
+
+    ttm_undo_track(&undo, gs);
+
+    if (resized && gs->shape) {
+        resized = 0;
+        ttm_term_reset(&term);
+        ttm_dirty_rows(gs, 0, gs->height);
+        render_gameboard(gs);
+    }
+
+    /* All there is goes to the queue, a key is pressed and released. */
+    fill_input();
+    while (input_len && !input_partial &&
+            keys.tail - keys.head <= TTM_INPUT_SIZE - 2 &&
+            (cmd = take_key(gs)) >= 0) {
+        if (cmd == NOTHING)
+            continue;
+        ttm_input_push(&keys, cmd, now);
+        ttm_input_push(&keys, cmd | TTM_KEY_UP, now);
+    }
+
+    return ttm_input_read(&keys, now);
+}
+
+void render_callback(GameState *gs, unsigned char *gameboard, int width,
+        int height, int low, int high) {
+    write_all(term.out, ttm_term_render(&term, gs, gameboard, width, height,
+        low, high));
+}
+
+void restore_terminal() {
+    /* Colours off, cursor shown again, main screen back. */
+    static const char restore[] = "\x1b[m\x1b[?25h\x1b[?1049l";
+
+    if (!termios_saved)
+        return;
+    write_all(restore, sizeof(restore) - 1);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+    termios_saved = 0;
+}
+
+void on_signal(int sig) {
+    if (sig == SIGWINCH) {
+        resized = 1;
+        return;
+    }
+    restore_terminal();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int main(int argc, char *argv[]) {
+    static const char setup[] = "\x1b[?1049h\x1b[?25l\x1b[H\x1b[2J"
+        "any key to start, q to quit";
+    struct termios raw;
+    const char *latency_file = NULL;
+    FILE *f;
+
+    if (argc == 3 && !strcmp(argv[1], "-l"))
+        latency_file = argv[2];
+    else if (argc != 1) {
+        fprintf(stderr, "usage: ctetris_tty [-l file]\n");
+        return 2;
+    }
+    if (latency_file && !TTM_STATS) {
+        fprintf(stderr, "-l needs a build with -DTTM_STATS=1\n");
+        return 2;
+    }
+    if (latency_file)
+        game.stats = &stats;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_termios))
+        return 1;
+
+    /* Keys one at a time, without echo, Ctrl-C still interrupts. */
+    raw = saved_termios;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw))
+        return 1;
+    termios_saved = 1;
+
+    atexit(restore_terminal);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);
+    signal(SIGWINCH, on_signal);
+
+    write_all(setup, sizeof(setup) - 1);
+    ttm_term_reset(&term);
+    ttm_undo_init(&undo);
+    ttm_input_init(&keys, TTM_DAS_MS, TTM_ARR_MS);
+
+    game_loop();
+    restore_terminal();
+
+    if (latency_file) {
+        f = fopen(latency_file, "w");
+        if (!f || ttm_hdr_write(f, "latency us", &stats.latency) ||
+                ttm_hdr_write(f, "lateness us", &stats.lateness) ||
+                fclose(f)) {
+            perror(latency_file);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/* ctetris_verify.c */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ctetris.h"
+#include "ctetris_pool.h"
+#include "ctetris_replay.h"
+
+#define ttm_read_command_callback(gs) NOTHING
+
+#include "ctetris.c"
+
+/* play_loop sleeps 20 ms per tick, for the realtime factor. */
+#define TICK_SECONDS    0.02
+
+typedef struct VerifyStatsTag {
+    unsigned long long ok;
+    unsigned long long failed;
+    unsigned long long pieces;
+    unsigned long long ticks;
+    unsigned long long commands;
+    char pad[64 - 5 * sizeof(unsigned long long)];
+} VerifyStats;
+
+typedef struct VerifyTag {
+    const unsigned char *data;
+    size_t *offsets;                /* replays + 1 entries */
+    VerifyStats *stats;             /* per worker */
+    int verbose;
+    int seek;
+    unsigned int seek_tick;
+} Verify;
+
+void verify_replay(void *ctx, int worker, long item) {
+    Verify *v = (Verify *)ctx;
+    VerifyStats *st = &v->stats[worker];
+    size_t offset = v->offsets[item];
+    TtmReplayInfo info;
+    GameState gs;
+    int result;
+
+    memset(&gs, 0, sizeof(gs));
+    if (v->seek)
+        result = ttm_replay_seek(&gs, v->data + offset,
+            v->offsets[item + 1] - offset, v->seek_tick, &info);
+    else
+        result = ttm_replay_play(&gs, v->data + offset,
+            v->offsets[item + 1] - offset, &info);
+
+    if (result == TTM_REPLAY_OK) {
+        ++st->ok;
+        st->pieces += info.pieces;
+        st->ticks += info.ticks;
+        st->commands += info.commands;
+    } else {
+        ++st->failed;
+        if (v->verbose)
+            fprintf(stderr, "replay %ld at %lu: error %d\n", item,
+                (unsigned long)offset, result);
+    }
+}
+
+unsigned char *read_file(const char *name, size_t *len) {
+    FILE *f = fopen(name, "rb");
+    unsigned char *data = NULL;
+    size_t size = 0, n;
+
+    *len = 0;
+    if (!f)
+        return NULL;
+
+    do {
+        unsigned char *p;
+        size = size * 2 + (1 << 16);
+        p = (unsigned char *)realloc(data, size);
+        if (!p) {
+            free(data);
+            fclose(f);
+            return NULL;
+        }
+        data = p;
+        n = fread(data + *len, 1, size - *len, f);
+        *len += n;
+    } while (*len == size);
+
+    fclose(f);
+    return data;
+}
+
+void usage() {
+    fprintf(stderr,
+        "usage: ctetris_verify [-t threads] [-s tick] [-v] replay_file\n"
+        "  -t  worker threads (default: all processors)\n"
+        "  -s  only seek every replay to tick, from its nearest keyframe\n"
+        "  -v  report every replay that fails\n");
+}
+
+int main(int argc, char **argv) {
+    Verify v;
+    VerifyStats total;
+    const char *file = NULL;
+    int threads = ttm_cpu_count();
+    size_t len, pos;
+    long replays = 0, capacity = 1024;
+    double start, elapsed;
+    int i;
+
+    v.verbose = 0;
+    v.seek = 0;
+
+    for (i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            v.seek = 1;
+            v.seek_tick = (unsigned int)strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-v"))
+            v.verbose = 1;
+        else if (argv[i][0] != '-' && !file)
+            file = argv[i];
+        else {
+            usage();
+            return 2;
+        }
+    }
+
+    if (!file) {
+        usage();
+        return 2;
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    v.data = read_file(file, &len);
+    if (!v.data) {
+        perror(file);
+        return 1;
+    }
+
+    /* Replays are self-delimiting, find them all before playing. */
+    v.offsets = (size_t *)malloc((capacity + 1) * sizeof(size_t));
+    for (pos = 0; v.offsets && pos < len; ++replays) {
+        size_t size = ttm_replay_size(v.data + pos, len - pos);
+        if (!size) {
+            fprintf(stderr, "%s: truncated at %lu\n", file, (unsigned long)pos);
+            break;
+        }
+        if (replays == capacity) {
+            size_t *p = (size_t *)realloc(v.offsets,
+                (capacity * 2 + 1) * sizeof(size_t));
+            if (!p) {
+                free(v.offsets);
+                v.offsets = NULL;
+                break;
+            }
+            v.offsets = p;
+            capacity *= 2;
+        }
+        v.offsets[replays] = pos;
+        pos += size;
+    }
+
+    v.stats = (VerifyStats *)calloc(threads, sizeof(VerifyStats));
+    if (!v.offsets || !v.stats)
+        return 1;
+    v.offsets[replays] = pos;
+
+    start = ttm_seconds();
+    if (ttm_pool_run(threads, replays, verify_replay, &v))
+        fprintf(stderr, "warning: not all worker threads started\n");
+    elapsed = ttm_seconds() - start;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < threads; ++i) {
+        total.ok += v.stats[i].ok;
+        total.failed += v.stats[i].failed;
+        total.pieces += v.stats[i].pieces;
+        total.ticks += v.stats[i].ticks;
+        total.commands += v.stats[i].commands;
+    }
+
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+
+    printf("threads      %d\n", threads);
+    printf("replays      %ld (%lu bytes)\n", replays, (unsigned long)pos);
+    printf("ok           %llu\n", total.ok);
+    printf("failed       %llu\n", total.failed);
+    printf("pieces       %llu (%.2f bytes per piece)\n", total.pieces,
+        total.pieces ? (double)pos / total.pieces : 0.0);
+    printf("commands     %llu\n", total.commands);
+    printf("time         %.3f s\n", elapsed);
+    printf("replays/sec  %.0f\n", replays / elapsed);
+    printf("pieces/sec   %.0f\n", total.pieces / elapsed);
+    printf("realtime     %.0fx\n", total.ticks * TICK_SECONDS / elapsed);
+
+    free(v.stats);
+    free(v.offsets);
+    free((void *)v.data);
+
+    return total.failed || pos < len ? 1 : 0;
+}
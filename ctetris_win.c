@@ -2,70 +2,133 @@
 #include <Windows.h>
 #include <Rpc.h>
 
-#define ttm_rnd() win_rnd()
-#define ttm_sleep_ms(ms) Sleep(ms)
+#define ttm_rnd_seed() win_seed()
+#define ttm_now_ms() GetTickCount()
+#define ttm_wait_input_ms(gs, ms) win_wait_input_ms(ms)
 
-#define ttm_read_command_callback() read_command_callback()
-#define ttm_render_callback(gb, w, h) render_callback(gb, w, h)
+#define ttm_read_command_callback(gs) read_command_callback(gs)
+#define ttm_render_rows_callback(gs, gb, w, h, low, high) \
+    render_callback(gs, gb, w, h, low, high)
 
-int win_rnd();
-int read_command_callback();
-void render_callback(int *gameboard, int width, int height);
+#include "ctetris.h"
+
+unsigned int win_seed();
+int win_wait_input_ms(unsigned int ms);
+int read_command_callback(GameState *gs);
+void render_callback(GameState *gs, unsigned char *gameboard, int width,
+    int height, int low, int high);
 
 #include "ctetris.c"
 
-int win_rnd() {
+unsigned int win_seed() {
     UUID uuid;
     UuidCreate(&uuid);
-    return uuid.Data3;
+    return uuid.Data1;
+}
+
+/* Spawns of the current game, Backspace takes back the last move. */
+TtmUndo undo;
+
+/* Key presses and releases, read by the game in order. */
+TtmInput keys;
+
+/* Console input records taken at a time. */
+#define INPUT_RECORDS   16
+
+int win_wait_input_ms(unsigned int ms) {
+    unsigned int due = ttm_input_wait_ms(&keys, GetTickCount());
+
+    if (!due)
+        return 1;
+    if (due < ms)
+        ms = due;
+
+    return WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), ms) ==
+        WAIT_OBJECT_0 || ms == due;
 }
 
-int read_command_callback() {
-    DWORD wait_result;
+int key_command(WORD key) {
+    switch (key) {
+        case VK_LEFT:
+            return MOVE_LEFT;
+        case VK_RIGHT:
+            return MOVE_RIGHT;
+        case VK_UP: /* UP */
+            return ROTATE_CCW;
+        case VK_DOWN: /* DOWN */
+            return ROTATE_CW;
+        case 0x52:
+            return SPEEDUP;
+        case VK_SPACE:
+            return DROP;
+        case 0x51:
+            return QUIT;
+    }
+
+    return NOTHING;
+}
+
+int read_command_callback(GameState *gs) {
     HANDLE std_input_handle;
+    INPUT_RECORD input_records[INPUT_RECORDS];
+    DWORD records, i;
+    unsigned int now = GetTickCount();
     
+    ttm_undo_track(&undo, gs);
+
     std_input_handle = GetStdHandle(STD_INPUT_HANDLE);
     
-    wait_result = WaitForSingleObject(std_input_handle, 0);
-    if (wait_result == WAIT_OBJECT_0)  {
-        INPUT_RECORD input_record;
-        DWORD records_read;
-        BOOL result = ReadConsoleInput(std_input_handle, 
-                &input_record,
-                1,
-                &records_read);
-        if (result &&
-                input_record.EventType == KEY_EVENT &&
-                input_record.Event.KeyEvent.bKeyDown) {
-            WORD key = input_record.Event.KeyEvent.wVirtualKeyCode;
-            switch (key) {
-                case VK_LEFT:
-                    return MOVE_LEFT;
-                case VK_RIGHT:
-                    return MOVE_RIGHT;
-                case VK_UP: /* UP */
-                    return ROTATE_CCW;
-                case VK_DOWN: /* DOWN */
-                    return ROTATE_CW;
-                case 0x52:
-                    return SPEEDUP;
-                case VK_SPACE:
-                    return DROP;
-                case 0x51:
-                    return QUIT;
+    /* Everything the console has, as long as the queue takes it. */
+    while (keys.tail - keys.head <= TTM_INPUT_SIZE - INPUT_RECORDS &&
+            GetNumberOfConsoleInputEvents(std_input_handle, &records) &&
+            records &&
+            ReadConsoleInput(std_input_handle, input_records,
+                INPUT_RECORDS, &records)) {
+        for (i = 0; i < records; ++i) {
+            KEY_EVENT_RECORD *key = &input_records[i].Event.KeyEvent;
+            int cmd;
+
+            if (input_records[i].EventType != KEY_EVENT)
+                continue;
+
+            if (key->wVirtualKeyCode == VK_BACK && key->bKeyDown) {
+                if (!ttm_undo_move(&undo, gs))
+                    render_gameboard(gs);
+                continue;
             }
+
+            cmd = key_command(key->wVirtualKeyCode);
+            if (cmd != NOTHING)
+                ttm_input_push(&keys, key->bKeyDown ? cmd : cmd | TTM_KEY_UP,
+                    now);
         }
     }
         
-    return NOTHING;
+    return ttm_input_read(&keys, now);
 }
 
 HANDLE screen_buffer_handle;
 CHAR_INFO screen_buffer[WIDTH * HEIGHT];
+
+#define FOREGROUND_WHITE (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE)
+
+/* Attributes of a TTM_CELL_ value, I J L O S T Z after empty. */
+const WORD cell_attributes[TTM_CELL_FILLED + 1] = {
+    FOREGROUND_GREEN,
+    FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY,
+    FOREGROUND_BLUE | FOREGROUND_INTENSITY,
+    FOREGROUND_WHITE,
+    FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_INTENSITY,
+    FOREGROUND_GREEN | FOREGROUND_INTENSITY,
+    FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_INTENSITY,
+    FOREGROUND_RED | FOREGROUND_INTENSITY,
+    FOREGROUND_GREEN
+};
 COORD screen_buffer_pos;
 COORD screen_buffer_size;
 
-void render_callback(int *gameboard, int width, int height) {
+void render_callback(GameState *gs, unsigned char *gameboard, int width,
+        int height, int low, int high) {
     SMALL_RECT screen_buffer_rect;
     int x, y, i;
     CHAR_INFO preview_sb[4 * 4];
@@ -73,32 +136,38 @@ void render_callback(int *gameboard, int width, int height) {
     COORD preview_sb_size;
     SMALL_RECT preview_sb_rect;
     
-    /* Suppress pedantic warning */
-    width = width;
-    height = height;
-    
-    for (y = 0; y < HEIGHT; ++y) {
-        for (x = 0; x < WIDTH; ++x) {
-            CHAR_INFO *sptr = &screen_buffer[(HEIGHT - 1 - y) * WIDTH + x];
-            sptr->Char.AsciiChar = gameboard[y * WIDTH + x] ? '\xDB' : '\xfa';
-            sptr->Attributes = FOREGROUND_GREEN;
+    for (y = low; y < high; ++y) {
+        for (x = 0; x < width; ++x) {
+            CHAR_INFO *sptr = &screen_buffer[(height - 1 - y) * width + x];
+            unsigned char cell = gameboard[y * width + x];
+            sptr->Char.AsciiChar = cell ? '\xDB' : '\xfa';
+            sptr->Attributes = cell_attributes[cell];
         }
     }
 
+    /*
+        The game sets the size, screen_buffer holds the largest board.
+        Only the changed rows are written, board row y is screen row
+        height - 1 - y.
+    */
+    screen_buffer_size.X = (SHORT)width;
+    screen_buffer_size.Y = (SHORT)height;
+    screen_buffer_pos.Y = (SHORT)(height - high);
     screen_buffer_rect.Left = 0;
-    screen_buffer_rect.Top = 0;
-    screen_buffer_rect.Right = WIDTH - 1;
-    screen_buffer_rect.Bottom = HEIGHT - 1;
+    screen_buffer_rect.Top = (SHORT)(height - high);
+    screen_buffer_rect.Right = (SHORT)(width - 1);
+    screen_buffer_rect.Bottom = (SHORT)(height - 1 - low);
     
-    WriteConsoleOutput( 
-        screen_buffer_handle,   /* screen buffer to write to            */
-        screen_buffer,          /* buffer to copy from                  */
-        screen_buffer_size,     /* col-row size of screen_buffer        */
-        screen_buffer_pos,      /* top left src cell in screen_buffer   */
-        &screen_buffer_rect);   /* dest. screen buffer rectangle        */
+    if (low < high)
+        WriteConsoleOutput( 
+            screen_buffer_handle,   /* screen buffer to write to            */
+            screen_buffer,          /* buffer to copy from                  */
+            screen_buffer_size,     /* col-row size of screen_buffer        */
+            screen_buffer_pos,      /* top left src cell in screen_buffer   */
+            &screen_buffer_rect);   /* dest. screen buffer rectangle        */
 
 #if SHOW_NEXT
-    if (next_tetrimino >= 0) {
+    if (gs->next_tetrimino >= 0) {
         for (i = 0; i < 4 * 4; ++i) {
             CHAR_INFO *sptr = &preview_sb[i];
             sptr->Char.AsciiChar = ' ';
@@ -106,10 +175,10 @@ void render_callback(int *gameboard, int width, int height) {
         }
         
         for (i = 0; i < 4; ++i) {
-            Tetrimino *ttm = &tetriminos[next_tetrimino];
+            Tetrimino *ttm = &tetriminos[gs->next_tetrimino];
             CHAR_INFO *sptr = &preview_sb[(4 - ttm->defy[i]) * 4 + ttm->defx[i]];
             sptr->Char.AsciiChar = '\xDB';
-            sptr->Attributes = FOREGROUND_GREEN;
+            sptr->Attributes = cell_attributes[gs->next_tetrimino + 1];
         }
     }
     
@@ -146,10 +215,9 @@ int __stdcall WinMainCRTStartup() {
     screen_buffer_pos.X = 0;
     screen_buffer_pos.Y = 0;
     
-    screen_buffer_size.X = WIDTH;
-    screen_buffer_size.Y = HEIGHT;
     // SetConsoleScreenBufferSize(screen_buffer_handle, screen_buffer_size);
 
+    ttm_input_init(&keys, TTM_DAS_MS, TTM_ARR_MS);
     game_loop();
 
     screen_buffer_size.X = console_info.dwSize.X;